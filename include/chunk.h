@@ -2,6 +2,7 @@
 #define clox_chunk_h
 
 #include "common.h"
+#include "superinstructions.h"
 #include "value.h"
 
 /*
@@ -15,17 +16,20 @@ typedef enum {
     OP_POP,
     OP_GET_LOCAL,
     OP_SET_LOCAL,
-    OP_GET_GLOBAL,
-    OP_DEFINE_GLOBAL,
-    OP_SET_GLOBAL,
+    OP_GET_GLOBAL_SLOT,
+    OP_DEFINE_GLOBAL_SLOT,
+    OP_SET_GLOBAL_SLOT,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_GET_SUPER,
     OP_EQUAL,
+    OP_NOT_EQUAL,
     OP_GREATER,
+    OP_GREATER_EQUAL,
     OP_LESS,
+    OP_LESS_EQUAL,
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
@@ -35,8 +39,19 @@ typedef enum {
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    // pop the condition and jump if it is falsey
+    OP_POP_JUMP_IF_FALSE,
+    // compare-and-branch: pop both operands and jump if the comparison is false
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_EQUAL,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_NOT_GREATER_EQUAL,
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_NOT_LESS_EQUAL,
     OP_LOOP,
     OP_CALL,
+    // a call whose result is returned right away, reuses the caller's frame
+    OP_TAIL_CALL,
     OP_INVOKE,
     OP_SUPER_INVOKE,
     OP_CLOSURE,
@@ -45,8 +60,56 @@ typedef enum {
     OP_CLASS,
     OP_METHOD,
     OP_INHERIT,
+    // quickened forms the vm rewrites an arithmetic or comparison instruction into
+    // once it has seen its operand types, and back when they change
+    OP_ADD_NUMBER,
+    OP_ADD_STRING,
+    OP_SUBTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
+    OP_GREATER_NUMBER,
+    OP_LESS_NUMBER,
+    // superinstructions, one opcode standing for a run of plain ones, see superinstructions.h
+#define SUPERINSTRUCTION_OPCODE(name, ...) name,
+    FOR_EACH_SUPERINSTRUCTION2(SUPERINSTRUCTION_OPCODE)
+    FOR_EACH_SUPERINSTRUCTION3(SUPERINSTRUCTION_OPCODE)
+#undef SUPERINSTRUCTION_OPCODE
 } OPCode;
 
+// opcodes the compiler emits directly, OP_INHERIT has to stay the last of them
+#define PLAIN_OPCODE_COUNT (OP_INHERIT + 1)
+
+// how many shapes a property or invoke site remembers before it starts evicting
+#define INLINE_CACHE_WAYS 4
+
+/*
+ * what a property or invoke site learned about one receiver shape
+ */
+typedef struct {
+    // shape of the receiver the entry was filled for, NULL if the entry is empty
+    Obj *shape;
+    // shape the receiver moves to when the store adds the field, otherwise NULL
+    Obj *transition;
+    // `version` of the receiver's class when a method was cached
+    int version;
+    // slot of the field, -1 if the name is a method
+    int index;
+    // the method closure when index is -1
+    Value method;
+} InlineCacheEntry;
+
+/*
+ * per instruction cache of OP_GET_PROPERTY, OP_SET_PROPERTY and OP_INVOKE.
+ * the instruction holds the index of its cache as a 16 bit operand.
+ */
+typedef struct {
+    // offset of the instruction owning the cache
+    int offset;
+    uint64_t hits;
+    uint64_t misses;
+    InlineCacheEntry entries[INLINE_CACHE_WAYS];
+} InlineCache;
+
 /*
  * a chunk of bytecode
  */
@@ -56,6 +119,9 @@ typedef struct {
     uint8_t *code;
     int *lines;
     ValueArray constants;
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache *caches;
 } Chunk;
 
 void initChunk(Chunk *chunk);
@@ -66,4 +132,10 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line);
 
 int addConstant(Chunk *chunk, Value value);
 
+int addInlineCache(Chunk *chunk, int offset);
+
+uint8_t plainInstruction(uint8_t instruction);
+
+int instructionLength(const Chunk *chunk, int offset);
+
 #endif
@@ -6,10 +6,39 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+// release builds (-DNDEBUG) run quietly, so they can be benchmarked
+#ifndef NDEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#define DEBUG_PRINT_IR
 // #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
+#endif
+// threaded dispatch is turned on by the CLOX_COMPUTED_GOTO cmake option,
+// but it needs the labels-as-values extension of GCC and Clang.
+#if defined(COMPUTED_GOTO) && !defined(__GNUC__)
+#undef COMPUTED_GOTO
+#endif
+// the value and frame stacks are reserved with mmap and grow when a write
+// faults on their uncommitted pages, which needs POSIX signals
+#if defined(__unix__) || defined(__APPLE__)
+#define STACK_GUARD
+#endif
+// the baseline jit (src/jit.c) emits x86-64 code for the System V calling convention.
+// it relies on the nan boxed value layout, and pushes frames without checking FRAMES_MAX
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING) && defined(STACK_GUARD)
+#define JIT
+#endif
+// loops are recorded as traces by switching run() to a dispatch table that reports
+// every instruction to the recorder first, so traces need threaded dispatch
+#if defined(JIT) && defined(COMPUTED_GOTO)
+#define TRACE_JIT
+#endif
+// major collections can mark on a background thread (--gc-concurrent). it reads values
+// while the interpreter stores them, so they must be single words, and it needs pthreads
+#if defined(NAN_BOXING) && defined(__GNUC__) && (defined(__unix__) || defined(__APPLE__))
+#define CONCURRENT_GC
+#endif
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
\ No newline at end of file
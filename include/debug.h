@@ -2,8 +2,12 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "ir.h"
 
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
+#ifdef TRACE_JIT
+void printIR(const IR *ir, const char *name);
+#endif
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,222 @@
+#ifndef clox_ir_h
+#define clox_ir_h
+
+#include "common.h"
+
+#ifdef TRACE_JIT
+#include "object.h"
+
+struct Trace;
+
+/*
+ * one instruction of a recorded loop, with what the interpreter saw when it ran it
+ */
+typedef struct {
+    // the instruction, in the chunk of `function`
+    const uint8_t *ip;
+    ObjFunction *function;
+    // its plain opcode
+    uint8_t instruction;
+    // stack height above the loop frame's slots before the instruction
+    int top;
+    // the branch went to its target
+    bool taken;
+    // the operands of OP_ADD were strings
+    bool strings;
+    // receiver shape of a field access or invoke, NULL for the generic template
+    ObjShape *shape;
+    // shape a store moved the receiver to, NULL if the field existed
+    ObjShape *transition;
+    // slot of the field
+    int index;
+    // the value called by OP_CALL, the superclass of OP_SUPER_INVOKE, the class of the
+    // receiver of OP_INVOKE
+    Value callee;
+    // closure whose frame the call pushed, NULL for natives and classes without init
+    ObjClosure *closure;
+    // method version of the class the closure was found in
+    int version;
+    // trace of an inner loop run at `ip`, and the instruction it left at
+    struct Trace *link;
+    const uint8_t *exit;
+} TraceRecord;
+
+/*
+ * the optimizing tier: a recorded loop lifted into SSA form. every instruction
+ * defines at most one value, operands refer to earlier instructions by index.
+ * the stack slots of the frames are not part of it, an instruction reads a slot
+ * once and later reads use that value, so values only reach the interpreter's
+ * stack through snapshots, when the trace leaves or calls out.
+ */
+typedef uint16_t IRRef;
+
+typedef enum {
+    IR_NOP,
+    // values: a constant, a stack slot, a global, a field or an upvalue
+    IR_CONST,
+    IR_SLOAD,
+    IR_GLOAD,
+    IR_FLOAD,
+    IR_FRAME_CLOSURE,
+    IR_UPVALUE,
+    IR_ULOAD,
+    // number arithmetic, the operands are checked to be numbers
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_NEG,
+    // booleans, the comparisons take numbers
+    IR_LT,
+    IR_LE,
+    IR_GT,
+    IR_GE,
+    IR_EQ,
+    IR_NOT,
+    // guards, leave the trace through their snapshot when the check fails
+    IR_CHECK_NUMBER,
+    IR_CHECK_DEFINED,
+    IR_CHECK_VALUE,
+    IR_CHECK_SHAPE,
+    IR_CHECK_VERSION,
+    IR_CHECK_CAPACITY,
+    IR_CHECK_TRUTHY,
+    IR_CHECK_FALSEY,
+    // stores
+    IR_GSTORE,
+    IR_FSTORE,
+    IR_SET_SHAPE,
+    IR_USTORE,
+    // frames and calls out of the trace, the ones with a snapshot write it back first
+    IR_FLUSH,
+    IR_CALL_FRAME,
+    IR_RETURN_FRAME,
+    IR_CALL_NATIVE,
+    IR_INSTANTIATE,
+    IR_PRINT,
+    IR_FALLBACK,
+    IR_LINK,
+    // the loop: instructions before IR_LOOP run once, the ones after it repeat
+    IR_LOOP,
+    IR_PHI,
+    // an IR_INSTANTIATE whose instance never escapes the trace. its stores emit no
+    // code, an exit that has the instance in its snapshot builds it as they left it
+    IR_SUNK,
+} IROp;
+
+// what is known about a value
+typedef enum {
+    IRT_NONE,
+    // maybe UNDEFINED_VAL, a global not defined yet
+    IRT_ANY,
+    IRT_VALUE,
+    IRT_NUMBER,
+    IRT_BOOL,
+    IRT_INSTANCE,
+    // a raw pointer: a closure or an upvalue
+    IRT_POINTER,
+} IRType;
+
+typedef struct {
+    uint8_t op;
+    uint8_t type;
+    IRRef a;
+    IRRef b;
+    // previous instruction with the same op, common subexpressions are searched along it
+    IRRef prev;
+    // slot, field index, global slot, argument count or version, by op
+    int aux;
+    // frame depth of IR_CALL_FRAME and IR_RETURN_FRAME, an entry value for IR_SLOAD, the slot
+    // of the new instance for IR_INSTANTIATE
+    int aux2;
+    // state written back when a guard fails, or before a call out of the trace. -1 for none
+    int snapshot;
+    Value value;
+    // shape, class, closure, function or trace, by op
+    void *pointer;
+    // where the caller resumes after IR_CALL_FRAME, the instruction of IR_FALLBACK and
+    // where the inner trace of IR_LINK has to leave
+    const uint8_t *ip;
+} IRIns;
+
+// a stack slot above the loop frame's slots holding a value the interpreter has not seen
+typedef struct {
+    int slot;
+    IRRef ref;
+} SnapshotEntry;
+
+/*
+ * the frame of an inlined call that is not on the frame stack yet. the trace only
+ * pushes it when it leaves or calls out while the callee runs, so the interpreter
+ * and the stack traces of runtime errors see every frame
+ */
+typedef struct {
+    ObjClosure *closure;
+    // slot of the callee, above the loop frame's slots
+    int base;
+    // where the caller resumes
+    const uint8_t *ip;
+} VirtualFrame;
+
+/*
+ * interpreter state at a point of the trace: the frame on top, where it goes on,
+ * the stack height and the slots to write back
+ */
+typedef struct {
+    const uint8_t *ip;
+    int depth;
+    int top;
+    int start;
+    int count;
+    // the top `virtuals` frames up to `depth` are pushed from frames[frameStart] on
+    int frameStart;
+    int virtuals;
+} Snapshot;
+
+typedef struct {
+    IRIns *code;
+    int count;
+    int capacity;
+    Snapshot *snapshots;
+    int snapshotCount;
+    int snapshotCapacity;
+    SnapshotEntry *entries;
+    int entryCount;
+    int entryCapacity;
+    VirtualFrame *frames;
+    int frameCount;
+    int frameCapacity;
+    // last instruction of each op
+    IRRef chain[IR_SUNK + 1];
+    // memory may have changed in any way at this instruction
+    IRRef barrier;
+    // the IR_LOOP instruction
+    IRRef loop;
+    // the loop frame's slots at the back-edge: every value known there, and the ones
+    // only the trace has
+    int endState;
+    int endDirty;
+    // instructions the optimizations removed, calls that got no frame and allocations
+    // that were sunk, for the dump
+    int folded;
+    int eliminated;
+    int inlined;
+    int sunk;
+} IR;
+
+void initIR(IR *ir);
+
+void freeIR(IR *ir);
+
+bool buildIR(IR *ir, const TraceRecord *records, int count);
+
+void optimizeIR(IR *ir);
+
+const char *irOpName(IROp op);
+
+static inline bool irHasValue(const IRIns *ins) {
+    return ins->type != IRT_NONE && ins->op != IR_NOP;
+}
+#endif
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+// calls after which a function is compiled to native code
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 100
+#endif
+// back-edges an interpreted frame takes in a function before the function is compiled
+// and the frame goes on as native code from the loop header
+#ifndef OSR_THRESHOLD
+#define OSR_THRESHOLD 1000
+#endif
+
+/*
+ * how native code left a frame
+ */
+typedef enum {
+    // keep running, only used between the native code and its helpers
+    JIT_NEXT,
+    // the top frame changed, the interpreter resumes it at its ip
+    JIT_EXIT,
+    // the top frame goes on in the interpreter at its ip, for an instruction the jit
+    // does not compile. the frame comes back to native code at its next back-edge or return
+    JIT_DEOPT,
+    // the frame returned, its caller is on top
+    JIT_RETURN,
+    // the script returned
+    JIT_DONE,
+    // a runtime error was reported
+    JIT_ERROR,
+} JitStatus;
+
+/*
+ * native code of a function, one straight translation of each instruction
+ */
+typedef struct JitCode {
+    uint8_t *code;
+    size_t size;
+    // native offset of the instruction starting at each bytecode offset, so a frame can
+    // be resumed wherever the interpreter left it
+    uint32_t *entries;
+} JitCode;
+
+void jitCompile(ObjFunction *function);
+
+JitStatus jitRun(CallFrame *frame);
+
+void jitFree(ObjFunction *function);
+#endif
+
+#ifdef TRACE_JIT
+// back-edges after which a loop is recorded
+#ifndef TRACE_THRESHOLD
+#define TRACE_THRESHOLD 50
+#endif
+// abandoned recordings after which a loop is left to the interpreter
+#define TRACE_ATTEMPTS 3
+// instructions in a trace, a longer recording is abandoned. they lift to far fewer
+// than the 65536 instructions an IRRef can address
+#define TRACE_MAX 1000
+// frames a trace may push on top of the loop's frame
+#define TRACE_DEPTH_MAX 16
+// callees up to this many bytes of bytecode run in the trace without a frame of their own
+#ifndef TRACE_INLINE_MAX
+#define TRACE_INLINE_MAX 64
+#endif
+
+/*
+ * native code of one loop, compiled from the path the interpreter took through it
+ * once. it runs until a guard sees something the recording did not, then leaves
+ * to the interpreter at that instruction.
+ */
+typedef struct Trace {
+    // bytecode offset of the loop header in the function owning the trace
+    int header;
+    // recordings of this loop that were abandoned
+    int aborts;
+    // NULL until a recording completed
+    uint8_t *code;
+    size_t size;
+    // native offset of the loop header
+    uint32_t start;
+    // objects the guards compare with, kept alive with the function
+    Obj **objects;
+    int objectCount;
+    struct Trace *next;
+} Trace;
+
+JitStatus traceLoop(CallFrame *frame);
+
+JitStatus traceRecord(CallFrame *frame);
+
+void traceAbort();
+
+void markTraces(const ObjFunction *function);
+
+void markRecorderRoots();
+#endif
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
         (type*) reallocate(NULL, 0, sizeof(type) * (count))
@@ -15,14 +16,53 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+#ifdef CONCURRENT_GC
+// a store the background marker may see before the stores that prepared it otherwise,
+// such as a count after the element, or a capacity after the larger array
+#define PUBLISH(target, value) __atomic_store_n(&(target), (value), __ATOMIC_RELEASE)
+// a load by the marker that sees the stores before the matching PUBLISH
+#define ACQUIRE(source) __atomic_load_n(&(source), __ATOMIC_ACQUIRE)
+#else
+#define PUBLISH(target, value) ((target) = (value))
+#define ACQUIRE(source) (source)
+#endif
+
 void *reallocate(void *pointer, const size_t oldSize, const size_t newSize);
 
+Obj *allocateObject(size_t size, ObjType type);
+
 void markValue(Value value);
 
 void markObject(Obj *object);
 
+void writeBarrierSlow(Obj *object);
+
+/**
+ * call after storing a reference into `object`. an old object that may now point at a
+ * young one is rescanned by the next minor collection, which does not trace old objects.
+ * while a major collection marks in slices, a black object is made gray again. while
+ * it marks on a background thread, the remembered objects are scanned again at its end
+ */
+static inline void writeBarrier(Obj *object) {
+    if (object->isOld && (!object->isRemembered || vm.gcPhase == GC_MARK)) {
+        writeBarrierSlow(object);
+    }
+}
+
 void collectGarbage();
 
+/**
+ * walk the heap
+ * @return the object after `object`, the first one for NULL, NULL after the last one
+ */
+Obj *nextObject(const Obj *object);
+
+void collectYoung();
+
 void freeObjects();
 
+#ifdef GC_STATS
+void printGCStats();
+#endif
+
 #endif
@@ -17,6 +17,7 @@
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*) AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass*) AS_OBJ(value))
@@ -24,6 +25,7 @@
 #define AS_FUNCTION(value) ((ObjFunction*) AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*) AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*) AS_OBJ(value))->function)
+#define AS_SHAPE(value) ((ObjShape*) AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*) AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 
@@ -34,6 +36,7 @@ typedef enum {
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE,
 } ObjType;
@@ -41,7 +44,13 @@ typedef enum {
 struct Obj {
     ObjType type;
     bool isMarked;
-    struct Obj *next;
+    // survived a collection, only full collections trace it
+    bool isOld;
+    // old, and may point at young objects since the last collection, see writeBarrier.
+    // jit code reads isOld and isRemembered as one 16 bit word
+    bool isRemembered;
+    // the cell is on the free list of its block, see allocateObject
+    bool isFree;
 };
 
 // Function Object
@@ -56,6 +65,18 @@ typedef struct {
     Chunk chunk;
     // Function Name
     ObjString *name;
+#ifdef JIT
+    // calls so far, the function is compiled to native code at JIT_THRESHOLD
+    int calls;
+    // back-edges taken by interpreted frames, the function is compiled at OSR_THRESHOLD
+    int backEdges;
+    // native code, NULL while the function is interpreted
+    struct JitCode *jit;
+#endif
+#ifdef TRACE_JIT
+    // loops recorded or being recorded, by header
+    struct Trace *traces;
+#endif
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value *args);
@@ -72,23 +93,60 @@ typedef struct ObjUpvalue {
     struct ObjUpvalue *next;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
     Obj obj;
     ObjFunction *function;
     ObjUpvalue **upvalues;
     int upvalueCount;
 } ObjClosure;
 
+/*
+ * hidden class: the field layout of an instance. instances that got the same
+ * fields in the same order share a shape, the shapes of a class form a tree
+ * rooted at the class's empty shape.
+ */
+typedef struct ObjShape {
+    Obj obj;
+    // shape this one was reached from by adding `name`, NULL for the root
+    struct ObjShape *parent;
+    // the field added last, it lives in slot fieldCount - 1. NULL for the root
+    ObjString *name;
+    // number of fields
+    int fieldCount;
+    // field name -> shape with that field added
+    Table transitions;
+} ObjShape;
+
 typedef struct {
     Obj obj;
     ObjString *name;
     Table methods;
+    // bumped whenever `methods` changes, so inline caches filled before are stale
+    int version;
+    // shape of a new instance, without any field
+    ObjShape *rootShape;
+    // the `init` method, NULL if there is none. set by OP_METHOD and OP_INHERIT
+    struct ObjClosure *initializer;
+    // most fields an instance of the class got so far, new instances are allocated with room for them
+    int instanceFields;
 } ObjClass;
 
+// fields an instance keeps in its own allocation before spilling to the heap
+#define INSTANCE_INLINE_FIELDS 4
+// instances are never allocated with more inline fields than this, however many the class has seen.
+// every object fits in a cell of CELL_MAX bytes, see memory.c
+#define INSTANCE_INLINE_FIELDS_MAX 16
+
 typedef struct {
     Obj obj;
     ObjClass *klass;
-    Table fields;
+    // names and slots of the fields
+    ObjShape *shape;
+    // field values by slot, points at `inlineFields` until they are used up
+    Value *fields;
+    int fieldCapacity;
+    int inlineCapacity;
+    Value inlineFields[];
 } ObjInstance;
 
 typedef struct ObjString {
@@ -119,6 +177,12 @@ ObjInstance *newInstance(ObjClass *klass);
 
 ObjNative *newNative(NativeFn function);
 
+ObjShape *newShape(ObjShape *parent, ObjString *name);
+
+int shapeSlot(const ObjShape *shape, const ObjString *name);
+
+int setField(ObjInstance *instance, ObjString *name, Value value);
+
 ObjString *takeString(char *chars, int length);
 
 ObjString *copyString(const char *chars, int length);
@@ -145,6 +209,8 @@ static inline const char *translateType(const ObjType type) {
             return "instance";
         case OBJ_NATIVE:
             return "native function";
+        case OBJ_SHAPE:
+            return "shape";
         case OBJ_STRING:
             return "string";
         case OBJ_UPVALUE:
@@ -0,0 +1,24 @@
+// generated by tools/superinstructions.py, do not edit by hand.
+// profile: examples/benchmark.lox, examples/benchmark_alloc.lox, examples/benchmark_gc.lox, examples/benchmark_mark.lox, examples/class_super_test.lox, examples/class_test.lox, examples/fun_test.lox, examples/stack_test.lox, examples/tail_call_test.lox
+#ifndef clox_superinstructions_h
+#define clox_superinstructions_h
+
+// X(name, first, second)
+#define FOR_EACH_SUPERINSTRUCTION2(X) \
+    X(OP_ADD__GET_GLOBAL_SLOT, OP_ADD, OP_GET_GLOBAL_SLOT) \
+    X(OP_CONSTANT__SET_PROPERTY, OP_CONSTANT, OP_SET_PROPERTY) \
+    X(OP_GET_GLOBAL_SLOT__CALL, OP_GET_GLOBAL_SLOT, OP_CALL) \
+    X(OP_GET_GLOBAL_SLOT__INVOKE, OP_GET_GLOBAL_SLOT, OP_INVOKE) \
+    X(OP_GET_LOCAL__CONSTANT, OP_GET_LOCAL, OP_CONSTANT) \
+    X(OP_GET_LOCAL__GET_PROPERTY, OP_GET_LOCAL, OP_GET_PROPERTY) \
+    X(OP_GET_LOCAL__RETURN, OP_GET_LOCAL, OP_RETURN) \
+    X(OP_POP__GET_LOCAL, OP_POP, OP_GET_LOCAL)
+
+// X(name, first, second, third)
+#define FOR_EACH_SUPERINSTRUCTION3(X) \
+    X(OP_ADD__GET_GLOBAL_SLOT__INVOKE, OP_ADD, OP_GET_GLOBAL_SLOT, OP_INVOKE) \
+    X(OP_GET_LOCAL__CONSTANT__SET_PROPERTY, OP_GET_LOCAL, OP_CONSTANT, OP_SET_PROPERTY) \
+    X(OP_POP__GET_LOCAL__RETURN, OP_POP, OP_GET_LOCAL, OP_RETURN) \
+    X(OP_POP__POP__POP, OP_POP, OP_POP, OP_POP)
+
+#endif
@@ -13,9 +13,11 @@ typedef struct ObjString ObjString;
 #define TAG_NIL             1
 #define TAG_FALSE           2
 #define TAG_TRUE            3
+#define TAG_UNDEFINED       4
 typedef uint64_t Value;
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
 #define IS_OBJ(value)   \
     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
@@ -27,6 +29,8 @@ typedef uint64_t Value;
 #define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
+// value of a global variable slot before the variable is defined
+#define UNDEFINED_VAL       ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num)     numToValue(num)
 #define OBJ_VAL(obj)    \
     (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
@@ -52,6 +56,7 @@ typedef enum {
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -66,6 +71,7 @@ typedef struct {
 #define IS_NIL(value)      ((value).type == VAL_NIL)
 #define IS_NUMBER(value)   ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)      ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define AS_OBJ(value)      ((value).as.obj)
 #define AS_BOOL(value)     ((value).as.boolean)
 #define AS_NUMBER(value)    ((value).as.number)
@@ -73,6 +79,8 @@ typedef struct {
 #define NIL_VAL             ((Value) {VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value)   ((Value) {VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)     ((Value) {VAL_OBJ, {.obj = (Obj*)object }})
+// value of a global variable slot before the variable is defined
+#define UNDEFINED_VAL       ((Value) {VAL_UNDEFINED, {.number = 0}})
 #endif
 /*
  * ValueArray--Constant value pool
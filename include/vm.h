@@ -5,10 +5,34 @@
 #include "table.h"
 #include "value.h"
 
+#ifdef STACK_GUARD
+// Max call deep, the stacks are only reserved, pages are committed once they are used
+#define FRAMES_MAX (1 << 20)
+// Max stack size
+#define STACK_MAX (1 << 24)
+#else
 // Max call deep
 #define FRAMES_MAX 64
 // Max stack size, every call frame has 255 slots to store local value
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#endif
+// bound methods kept for reuse, a power of two
+#define BOUND_METHODS_MAX 256
+// default of vm.gcSliceWork, the --gc-slice switch
+#define GC_SLICE_WORK 1000
+// most threads a major collection marks with, the --gc-threads switch
+#define GC_THREADS_MAX 64
+
+// the major collection in progress
+typedef enum {
+    GC_IDLE,
+    // gray objects are blackened a slice at a time, stores into black objects make them gray
+    GC_MARK,
+    // gray objects are blackened by a background thread, see collectSlice
+    GC_MARK_CONCURRENT,
+    // the blocks of the heap are swept a slice at a time
+    GC_SWEEP,
+} GCPhase;
 
 /**
  * Call Frame
@@ -24,28 +48,57 @@ typedef struct {
 } CallFrame;
 
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    // FRAMES_MAX frames and STACK_MAX values, they never move
+    CallFrame *frames;
     int frameCount;
-    Value stack[STACK_MAX];
+    Value *stack;
     // top of stack. point the next free slot
     Value *stackTop;
-    // global variables
-    Table globals;
+    // global variables by slot, UNDEFINED_VAL until the variable is defined
+    ValueArray globalValues;
+    // name of the global variable in each slot
+    ValueArray globalNames;
+    // global variable name -> slot
+    Table globalSlots;
     // interned strings
     Table strings;
     // string behalf `init`
     ObjString *initString;
     // open upvalues
     ObjUpvalue *openUpvalues;
-    // all objects
-    Obj *objects;
+    // recently bound methods by receiver and method, so fetching the same method off the
+    // same instance again allocates nothing. entries are weak, the gc clears dead ones
+    ObjBoundMethod *boundMethods[BOUND_METHODS_MAX];
+    // old objects written to since the last collection, see writeBarrier
+    Obj **remembered;
+    int rememberedCount;
+    int rememberedCapacity;
     // gray objects
     int grayCount;
     int grayCapacity;
     // self adjust gc
     size_t bytesAllocated;
     size_t nextGC;
+    GCPhase gcPhase;
+    // objects a slice of a major collection marks or sweeps, 0 to run it in one pause
+    int gcSliceWork;
+    // major collections mark on a background thread, the --gc-concurrent switch
+    bool gcConcurrent;
+    // threads that blacken the gray objects of a major collection together
+    int gcThreads;
+    // the arrays of dead old objects are freed by a background thread, the --gc-background-free switch
+    bool gcBackgroundFree;
+    // bytes allocated since the last collection, a minor collection runs at NURSERY_SIZE
+    size_t youngBytes;
     Obj **grayStack;
+#ifdef JIT
+    // compile hot functions to native code, the --jit switch
+    bool jit;
+#endif
+#ifdef TRACE_JIT
+    // a loop is being recorded, run() reports each instruction before it executes it
+    bool recording;
+#endif
 } VM;
 
 typedef enum {
@@ -62,8 +115,54 @@ void freeVM();
 
 InterpretResult interpret(const char *source);
 
+int globalSlot(ObjString *name);
+
 void push(const Value value);
 
 Value pop();
 
+// runtime helpers of run(), the native code of jit.c calls them for its slow paths.
+// they work on vm.stackTop and the top frame, as the interpreter leaves them between instructions
+
+void runtimeError(const char *format, ...);
+
+bool callValue(Value callee, int argCount);
+
+bool tailCall(int argCount);
+
+bool invoke(const ObjString *name, int argCount, InlineCache *cache);
+
+bool invokeFromClass(const ObjClass *klass, const ObjString *name, int argCount);
+
+bool bindMethod(const ObjClass *klass, const ObjString *name);
+
+ObjBoundMethod *bindReceiver(Value receiver, ObjClosure *method);
+
+ObjUpvalue *captureUpvalue(Value *local);
+
+void closeUpvalues(Value *last);
+
+void concatenate();
+
+void fillCacheEntry(InlineCache *cache, const ObjShape *shape, const ObjShape *transition,
+                    const ObjClass *klass, int index, Value method);
+
+/**
+ * find the entry `cache` keeps for receivers of `shape`
+ * @return NULL if the shape was never seen, or a cached method is stale
+ */
+static inline const InlineCacheEntry *findCacheEntry(const InlineCache *cache, const ObjShape *shape,
+                                                     const ObjClass *klass) {
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+        const InlineCacheEntry *entry = &cache->entries[i];
+        if (entry->shape == (Obj *) shape) {
+            return entry->index >= 0 || entry->version == klass->version ? entry : NULL;
+        }
+        if (entry->shape == NULL) {
+            break;
+        }
+    }
+    return NULL;
+}
+
 #endif
@@ -11,12 +11,16 @@ void initChunk(Chunk *chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
 }
 
 void freeChunk(Chunk *chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
     // change chunk state to default value -- zero.
     initChunk(chunk);
 }
@@ -40,3 +44,95 @@ int addConstant(Chunk *chunk, const Value value) {
     pop();
     return chunk->constants.count - 1;
 }
+
+int addInlineCache(Chunk *chunk, const int offset) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        const int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+    InlineCache *cache = &chunk->caches[chunk->cacheCount];
+    cache->offset = offset;
+    cache->hits = 0;
+    cache->misses = 0;
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+        cache->entries[i].shape = NULL;
+        cache->entries[i].transition = NULL;
+        cache->entries[i].version = 0;
+        cache->entries[i].index = -1;
+        cache->entries[i].method = NIL_VAL;
+    }
+    const int index = chunk->cacheCount;
+    PUBLISH(chunk->cacheCount, index + 1);
+    return index;
+}
+
+/**
+ * the opcode a generic handler runs for `instruction`: a superinstruction starts with its
+ * first component, the others keep their opcode byte, and a quickened opcode is a form of
+ * its generic one
+ */
+uint8_t plainInstruction(const uint8_t instruction) {
+    switch (instruction) {
+#define SUPERINSTRUCTION_FIRST(name, first, ...) case name: return first;
+        FOR_EACH_SUPERINSTRUCTION2(SUPERINSTRUCTION_FIRST)
+        FOR_EACH_SUPERINSTRUCTION3(SUPERINSTRUCTION_FIRST)
+#undef SUPERINSTRUCTION_FIRST
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING: return OP_ADD;
+        case OP_SUBTRACT_NUMBER: return OP_SUBTRACT;
+        case OP_MULTIPLY_NUMBER: return OP_MULTIPLY;
+        case OP_DIVIDE_NUMBER: return OP_DIVIDE;
+        case OP_GREATER_NUMBER: return OP_GREATER;
+        case OP_LESS_NUMBER: return OP_LESS;
+        default: return instruction;
+    }
+}
+
+/**
+ * size in bytes of the instruction at `offset`, opcode and operands.
+ * a superinstruction only covers its first component, the others keep their own opcode byte
+ */
+int instructionLength(const Chunk *chunk, const int offset) {
+    const uint8_t instruction = plainInstruction(chunk->code[offset]);
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+            return 2;
+        case OP_GET_GLOBAL_SLOT:
+        case OP_DEFINE_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_LOOP:
+        case OP_SUPER_INVOKE:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 4;
+        case OP_INVOKE:
+            return 5;
+        case OP_CLOSURE: {
+            const ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            // 每个上值占两个字节：isLocal 和 index
+            return 2 + function->upvalueCount * 2;
+        }
+        default:
+            return 1;
+    }
+}
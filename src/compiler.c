@@ -78,6 +78,12 @@ typedef struct Compiler {
     Upvalue upvalues[UINT8_COUNT];
     // 当前作用域的嵌套深度
     int scopeDepth;
+    // offset of the last constant load (OP_CONSTANT/NIL/TRUE/FALSE), -1 if none can be folded
+    int lastConstant;
+    // offset of the last comparison opcode, -1 if it can't be fused into a jump
+    int lastComparison;
+    // offset of the last OP_CALL, -1 if it can't become a tail call
+    int lastCall;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -198,6 +204,7 @@ static void emitReturn() {
 
 static uint8_t makeConstant(const Value value) {
     const int constant = addConstant(currentChunk(), value);
+    writeBarrier((Obj *) current->function);
     if (constant > UINT8_MAX) {
         error("Too many constants in one chunk.");
         return 0;
@@ -205,11 +212,53 @@ static uint8_t makeConstant(const Value value) {
     return (uint8_t) constant;
 }
 
+/**
+ * give the instruction starting at `offset` an inline cache, written as a 16 bit operand
+ */
+static void emitInlineCache(const int offset) {
+    const int cache = addInlineCache(currentChunk(), offset);
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one chunk.");
+    }
+    emitByte((cache >> 8) & 0xff);
+    emitByte(cache & 0xff);
+}
+
+/**
+ * emit the jump taken when the condition just compiled is false. the jump pops the
+ * condition; a trailing comparison is fused into it so no boolean is pushed.
+ */
+static int emitConditionJump() {
+    Chunk *chunk = currentChunk();
+    const int last = current->lastComparison;
+    if (last != -1 && last == chunk->count - 1) {
+        OPCode jump;
+        switch (chunk->code[last]) {
+            case OP_EQUAL: jump = OP_JUMP_IF_NOT_EQUAL; break;
+            case OP_NOT_EQUAL: jump = OP_JUMP_IF_EQUAL; break;
+            case OP_GREATER: jump = OP_JUMP_IF_NOT_GREATER; break;
+            case OP_GREATER_EQUAL: jump = OP_JUMP_IF_NOT_GREATER_EQUAL; break;
+            case OP_LESS: jump = OP_JUMP_IF_NOT_LESS; break;
+            case OP_LESS_EQUAL: jump = OP_JUMP_IF_NOT_LESS_EQUAL; break;
+            default: return emitJump(OP_POP_JUMP_IF_FALSE);
+        }
+        chunk->count = last;
+        return emitJump(jump);
+    }
+    return emitJump(OP_POP_JUMP_IF_FALSE);
+}
+
 static void emitConstant(const Value value) {
+    current->lastConstant = currentChunk()->count;
     emitBytes(OP_CONSTANT, makeConstant(value));
 }
 
 static void patchJump(const int offset) {
+    // the jump now lands on the current end of the chunk, so the code before it
+    // must not be folded away any more
+    current->lastConstant = -1;
+    current->lastComparison = -1;
+    current->lastCall = -1;
     // 减2是为了指向挑战字节码的起始位置
     int jump = currentChunk()->count - offset - 2;
     if (jump > UINT16_MAX) {
@@ -226,11 +275,15 @@ static void initCompiler(Compiler *compiler, const FunctionType type) {
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lastConstant = -1;
+    compiler->lastComparison = -1;
+    compiler->lastCall = -1;
     compiler->function = newFunction();
     current = compiler;
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start,
                                              parser.previous.length);
+        writeBarrier((Obj *) current->function);
     }
     Local *local = &current->locals[current->localCount++];
     local->depth = 0;
@@ -246,9 +299,89 @@ static void initCompiler(Compiler *compiler, const FunctionType type) {
     }
 }
 
+#ifndef OPCODE_PROFILE
+// the profile counts plain opcodes, superinstructions are not emitted
+typedef struct {
+    uint8_t opcode;
+    // number of components, 0 ends the table
+    int length;
+    uint8_t components[3];
+} Superinstruction;
+
+// longer runs first, so they win over the pairs they start with
+static const Superinstruction superinstructions[] = {
+#define SUPERINSTRUCTION3(name, first, second, third) {name, 3, {first, second, third}},
+#define SUPERINSTRUCTION2(name, first, second) {name, 2, {first, second, 0}},
+    FOR_EACH_SUPERINSTRUCTION3(SUPERINSTRUCTION3)
+    FOR_EACH_SUPERINSTRUCTION2(SUPERINSTRUCTION2)
+#undef SUPERINSTRUCTION3
+#undef SUPERINSTRUCTION2
+    {0, 0, {0}},
+};
+
+static int jumpOperand(const Chunk *chunk, const int offset) {
+    return (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+}
+
+/**
+ * peephole pass over a finished chunk: the first opcode of a run that matches a
+ * superinstruction is replaced by it. nothing moves, the other components keep their
+ * bytes and the vm skips them, so jump offsets stay valid. a run must not contain a
+ * jump target after its first instruction.
+ */
+static void emitSuperinstructions(Chunk *chunk) {
+    bool *isTarget = ALLOCATE(bool, chunk->count + 1);
+    memset(isTarget, 0, sizeof(bool) * (chunk->count + 1));
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        switch (chunk->code[offset]) {
+            case OP_LOOP:
+                isTarget[offset + 3 - jumpOperand(chunk, offset)] = true;
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_NOT_EQUAL:
+            case OP_JUMP_IF_EQUAL:
+            case OP_JUMP_IF_NOT_GREATER:
+            case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_NOT_LESS_EQUAL:
+                isTarget[offset + 3 + jumpOperand(chunk, offset)] = true;
+                break;
+            default:
+                break;
+        }
+    }
+
+    for (int offset = 0; offset < chunk->count;) {
+        int next = offset + instructionLength(chunk, offset);
+        for (const Superinstruction *super = superinstructions; super->length != 0; super++) {
+            int end = offset;
+            int matched = 0;
+            while (matched < super->length && end < chunk->count &&
+                   (matched == 0 || !isTarget[end]) &&
+                   chunk->code[end] == super->components[matched]) {
+                end += instructionLength(chunk, end);
+                matched++;
+            }
+            if (matched == super->length) {
+                chunk->code[offset] = super->opcode;
+                next = end;
+                break;
+            }
+        }
+        offset = next;
+    }
+    FREE_ARRAY(bool, isTarget, chunk->count + 1);
+}
+#endif
+
 static ObjFunction *endCompiler() {
     emitReturn();
     ObjFunction *function = current->function;
+#ifndef OPCODE_PROFILE
+    emitSuperinstructions(currentChunk());
+#endif
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         disassembleChunk(currentChunk(),
@@ -279,6 +412,104 @@ static void endScope() {
     }
 }
 
+/**
+ * if the instruction at `offset` is a constant load ending exactly at `end`,
+ * store the value it loads in `value`
+ */
+static bool constantLoadAt(const int offset, const int end, Value *value) {
+    if (offset < 0) return false;
+    const Chunk *chunk = currentChunk();
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+            *value = chunk->constants.values[chunk->code[offset + 1]];
+            return offset + 2 == end;
+        case OP_NIL:
+            *value = NIL_VAL;
+            break;
+        case OP_TRUE:
+            *value = BOOL_VAL(true);
+            break;
+        case OP_FALSE:
+            *value = BOOL_VAL(false);
+            break;
+        default:
+            return false;
+    }
+    return offset + 1 == end;
+}
+
+/**
+ * drop the constant load at `offset`, and its constant too if nothing was added after it
+ */
+static void discardConstantLoad(const int offset) {
+    Chunk *chunk = currentChunk();
+    if (chunk->code[offset] == OP_CONSTANT &&
+        chunk->code[offset + 1] == chunk->constants.count - 1) {
+        chunk->constants.count--;
+    }
+    chunk->count = offset;
+}
+
+/**
+ * emit the result of a folded expression, nil and booleans have their own opcodes
+ */
+static void emitFolded(const Value value) {
+    if (IS_NIL(value)) {
+        current->lastConstant = currentChunk()->count;
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        current->lastConstant = currentChunk()->count;
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(value);
+    }
+}
+
+static bool isFalsey(const Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+/**
+ * evaluate `a op b` at compile time. only operand types the vm accepts are folded,
+ * anything else is left for the runtime error.
+ */
+static bool foldBinary(const TokenType operatorType, const Value a, const Value b, Value *result) {
+    if (operatorType == TOKEN_EQUAL_EQUAL) {
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    }
+    if (operatorType == TOKEN_BANG_EQUAL) {
+        *result = BOOL_VAL(!valuesEqual(a, b));
+        return true;
+    }
+    if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        const ObjString *left = AS_STRING(a);
+        const ObjString *right = AS_STRING(b);
+        const int length = left->length + right->length;
+        char *chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        *result = OBJ_VAL(takeString(chars, length));
+        return true;
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    const double x = AS_NUMBER(a);
+    const double y = AS_NUMBER(b);
+    switch (operatorType) {
+        case TOKEN_PLUS: *result = NUMBER_VAL(x + y); return true;
+        case TOKEN_MINUS: *result = NUMBER_VAL(x - y); return true;
+        case TOKEN_STAR: *result = NUMBER_VAL(x * y); return true;
+        case TOKEN_SLASH: *result = NUMBER_VAL(x / y); return true;
+        case TOKEN_GREATER: *result = BOOL_VAL(x > y); return true;
+        // same as the OP_LESS, OP_NOT pair emitted for it, NaN included
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+        case TOKEN_LESS: *result = BOOL_VAL(x < y); return true;
+        case TOKEN_LESS_EQUAL: *result = BOOL_VAL(!(x > y)); return true;
+        default: return false;
+    }
+}
+
 /**
  * forward declaration
  */
@@ -296,13 +527,25 @@ static uint8_t identifierConstant(const Token *name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+/**
+ * global variables are resolved at compile time to a slot of the vm
+ */
+static uint16_t identifierSlot(const Token *name) {
+    const int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return (uint16_t) slot;
+}
+
 static bool identifiersEqual(const Token *a, const Token *b) {
     if (a->length != b->length) return false;
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
 static int resolveLocal(Compiler *compiler, Token *name) {
-    for (int i = current->localCount - 1; i >= 0; i--) {
+    for (int i = compiler->localCount - 1; i >= 0; i--) {
         const Local *local = &compiler->locals[i];
         if (identifiersEqual(name, &local->name)) {
             if (local->depth == -1) {
@@ -334,13 +577,13 @@ static int addUpvalue(Compiler *compiler, const uint8_t index, const bool isLoca
 static int resolveUpvalue(Compiler *compiler, Token *name) {
     if (compiler->enclosing == NULL) return -1;
 
-    const int local = resolveLocal((Compiler *) current->enclosing, name);
+    const int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
         return addUpvalue(compiler, (uint8_t) local, true);
     }
 
-    const int upvalue = resolveUpvalue((Compiler *) current->enclosing, name);
+    const int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
         return addUpvalue(compiler, (uint8_t) upvalue, false);
     }
@@ -377,11 +620,11 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char *errorMessage) {
+static uint16_t parseVariable(const char *errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
     declareVariable();
     if (current->scopeDepth > 0) return 0;
-    return identifierConstant(&parser.previous);
+    return identifierSlot(&parser.previous);
 }
 
 static void markInitialized() {
@@ -390,12 +633,14 @@ static void markInitialized() {
             current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(const uint16_t global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitByte(OP_DEFINE_GLOBAL_SLOT);
+    emitByte((global >> 8) & 0xff);
+    emitByte(global & 0xff);
 }
 
 static uint8_t argumentList() {
@@ -426,10 +671,26 @@ static void and_(const bool canAssign) {
 static void binary(const bool canAssign) {
     const TokenType operatorType = parser.previous.type;
     const ParseRule *rule = getRule(operatorType);
+    // constant folding: both operands are constant loads right next to each other
+    const int left = current->lastConstant;
+    const int right = currentChunk()->count;
+    Value a;
+    const bool leftConstant = constantLoadAt(left, right, &a);
     parsePrecedence(rule->precedence + 1);
+    Value b, result;
+    if (leftConstant && current->lastConstant == right &&
+        constantLoadAt(right, currentChunk()->count, &b) &&
+        foldBinary(operatorType, a, b, &result)) {
+        discardConstantLoad(right);
+        discardConstantLoad(left);
+        emitFolded(result);
+        return;
+    }
+    // a comparison may be fused with the jump of an if/while/for condition
+    current->lastComparison = currentChunk()->count;
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:
-            emitBytes(OP_EQUAL, OP_NOT);
+            emitByte(OP_NOT_EQUAL);
             break;
         case TOKEN_EQUAL_EQUAL:
             emitByte(OP_EQUAL);
@@ -438,13 +699,13 @@ static void binary(const bool canAssign) {
             emitByte(OP_GREATER);
             break;
         case TOKEN_GREATER_EQUAL:
-            emitBytes(OP_LESS, OP_NOT);
+            emitByte(OP_GREATER_EQUAL);
             break;
         case TOKEN_LESS:
             emitByte(OP_LESS);
             break;
         case TOKEN_LESS_EQUAL:
-            emitBytes(OP_GREATER, OP_NOT);
+            emitByte(OP_LESS_EQUAL);
             break;
         case TOKEN_PLUS:
             emitByte(OP_ADD);
@@ -465,6 +726,7 @@ static void binary(const bool canAssign) {
 
 static void call(const bool canAssign) {
     const uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
 }
 
@@ -473,17 +735,24 @@ static void dot(const bool canAssign) {
     const uint8_t name = identifierConstant(&parser.previous);
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
+        const int offset = currentChunk()->count;
         emitBytes(OP_SET_PROPERTY, name);
+        emitInlineCache(offset);
     } else if (match(TOKEN_LEFT_PAREN)) {
         const uint8_t argCount = argumentList();
+        const int offset = currentChunk()->count;
         emitBytes(OP_INVOKE, name);
         emitByte(argCount);
+        emitInlineCache(offset);
     } else {
+        const int offset = currentChunk()->count;
         emitBytes(OP_GET_PROPERTY, name);
+        emitInlineCache(offset);
     }
 }
 
 static void literal(const bool canAssign) {
+    current->lastConstant = currentChunk()->count;
     switch (parser.previous.type) {
         case TOKEN_FALSE:
             emitByte(OP_FALSE);
@@ -507,11 +776,26 @@ static void grouping(const bool canAssign) {
 static void unary(const bool canAssign) {
     const TokenType operatorType = parser.previous.type;
     parsePrecedence(PREC_UNARY);
-    expression();
+
+    const int operand = current->lastConstant;
+    Value value;
+    if (constantLoadAt(operand, currentChunk()->count, &value)) {
+        if (operatorType == TOKEN_BANG) {
+            discardConstantLoad(operand);
+            emitFolded(BOOL_VAL(isFalsey(value)));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(value)) {
+            discardConstantLoad(operand);
+            emitFolded(NUMBER_VAL(-AS_NUMBER(value)));
+            return;
+        }
+    }
 
     switch (operatorType) {
         case TOKEN_BANG:
             emitByte(OP_NOT);
+            break;
         case TOKEN_MINUS:
             emitByte(OP_NEGATE);
             break;
@@ -553,16 +837,21 @@ static void namedVariable(Token name, const bool canAssign) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        arg = identifierSlot(&name);
+        getOp = OP_GET_GLOBAL_SLOT;
+        setOp = OP_SET_GLOBAL_SLOT;
     }
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t) arg);
+        emitByte(setOp);
     } else {
-        emitBytes(getOp, (uint8_t) arg);
+        emitByte(getOp);
+    }
+    // global slots take two bytes
+    if (getOp == OP_GET_GLOBAL_SLOT) {
+        emitByte((arg >> 8) & 0xff);
     }
+    emitByte(arg & 0xff);
 }
 
 static void variable(const bool canAssign) {
@@ -631,7 +920,7 @@ ParseRule rules[] = {
     [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
     [TOKEN_STRING] = {string, NULL, PREC_NONE},
     [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
-    [TOKEN_AND] = {NULL, and_, PREC_NONE},
+    [TOKEN_AND] = {NULL, and_, PREC_AND},
     [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
     [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
     [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
@@ -639,12 +928,12 @@ ParseRule rules[] = {
     [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
     [TOKEN_IF] = {NULL, NULL, PREC_NONE},
     [TOKEN_NIL] = {literal, NULL, PREC_NONE},
-    [TOKEN_OR] = {NULL, or_, PREC_NONE},
+    [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
     [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
     [TOKEN_THIS] = {this_, NULL, PREC_NONE},
-    [TOKEN_TRUE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
     [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
@@ -699,7 +988,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            const uint8_t constant = parseVariable("Expect parameter name.");
+            const uint16_t constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -737,7 +1026,7 @@ static void classDeclaration() {
 
     emitBytes(OP_CLASS, nameConstant);
     // mark class name available
-    defineVariable(nameConstant);
+    defineVariable(current->scopeDepth > 0 ? 0 : identifierSlot(&className));
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
@@ -779,14 +1068,14 @@ static void classDeclaration() {
 
 
 static void funDeclaration() {
-    const uint8_t global = parseVariable("Expect function name.");
+    const uint16_t global = parseVariable("Expect function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
 }
 
 static void varDeclaration() {
-    const uint8_t global = parseVariable("Expect variable name.");
+    const uint16_t global = parseVariable("Expect variable name.");
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
@@ -818,10 +1107,8 @@ static void forStatement() {
         // 生成for循环条件表达式
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition");
-        // 生成跳转语句，如果条件为假，则跳过循环体
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        // 执行循环体之前，弹出栈顶的真值
-        emitByte(OP_POP);
+        // 生成跳转语句，如果条件为假，则跳过循环体，条件值由跳转指令弹出
+        exitJump = emitConditionJump();
     }
     // 整个增量子句的实现用了三次跳转，进入增量子句之前，跳转到了循环体开始的位置
     // 改写 loopStart 变量在循环体结束时，跳转到增量子句开始的位置
@@ -849,8 +1136,6 @@ static void forStatement() {
     // 如果存在条件子句，则填充添条件子句为假时跳转的地方
     if (exitJump != -1) {
         patchJump(exitJump);
-        // 不执行循环体，弹出栈顶的假值
-        emitByte(OP_POP);
     }
 
     endScope();
@@ -861,15 +1146,12 @@ static void ifStatement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    // 弹出栈顶的真值
-    emitByte(OP_POP);
+    // 条件值由跳转指令弹出，两个分支都不需要再 OP_POP
+    int thenJump = emitConditionJump();
     statement();
 
     int elseJump = emitJump(OP_JUMP);
     patchJump(thenJump);
-    // 弹出栈顶的真值
-    emitByte(OP_POP);
     if (match(TOKEN_ELSE)) {
         statement();
     }
@@ -895,6 +1177,11 @@ static void returnStatement() {
         }
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // return f(x); the call is the last thing the function does, so it can reuse the frame.
+        // OP_RETURN stays for callees that don't take over the frame
+        if (current->lastCall != -1 && current->lastCall == currentChunk()->count - 2) {
+            currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
@@ -905,16 +1192,13 @@ static void whileStatement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    // 循环体内，需要弹出栈顶的真值
-    emitByte(OP_POP);
+    // 条件值由跳转指令弹出，循环体内外都不需要再 OP_POP
+    int exitJump = emitConditionJump();
     statement();
 
     emitLoop(loopStart);
 
     patchJump(exitJump);
-    // 循环体外，也需要弹出栈顶的真值
-    emitByte(OP_POP);
 }
 
 static void synchronize() {
@@ -934,6 +1218,7 @@ static void synchronize() {
                 return;
             default: ;
         }
+        advance();
     }
 }
 
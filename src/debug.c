@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 static int constantInstruction(const char *name, Chunk *chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
@@ -14,14 +15,43 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
 }
 
 static int invokeInstruction(const char *name, const Chunk *chunk, const int offset) {
-    const uint8_t argCount = chunk->code[offset + 1];
-    const uint8_t constant = chunk->code[offset + 2];
+    const uint8_t constant = chunk->code[offset + 1];
+    const uint8_t argCount = chunk->code[offset + 2];
     printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
     return offset + 3;
 }
 
+static int cacheIndex(const Chunk *chunk, const int offset) {
+    return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+static int propertyInstruction(const char *name, const Chunk *chunk, const int offset) {
+    const uint8_t constant = chunk->code[offset + 1];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cacheIndex(chunk, offset + 2));
+    return offset + 4;
+}
+
+static int cachedInvokeInstruction(const char *name, const Chunk *chunk, const int offset) {
+    const uint8_t constant = chunk->code[offset + 1];
+    const uint8_t argCount = chunk->code[offset + 2];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cacheIndex(chunk, offset + 3));
+    return offset + 5;
+}
+
+static int globalInstruction(const char *name, const Chunk *chunk, const int offset) {
+    const int slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int simpleInstruction(const char *name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -48,6 +78,17 @@ void disassembleChunk(Chunk *chunk, const char *name) {
     }
 }
 
+static int disassemblePlain(Chunk *chunk, int offset, uint8_t instruction);
+
+/**
+ * a superinstruction is printed on its own line, followed by its first component.
+ * the other components keep their opcode byte and are printed as usual
+ */
+static int superInstruction(const char *name, const uint8_t first, Chunk *chunk, const int offset) {
+    printf("%s\n%04d    | ", name, offset);
+    return disassemblePlain(chunk, offset, first);
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
     printf("%04d ", offset);
     if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
@@ -55,7 +96,20 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     } else {
         printf("%4d ", chunk->lines[offset]);
     }
-    uint8_t instruction = chunk->code[offset];
+    const uint8_t instruction = chunk->code[offset];
+    switch (instruction) {
+#define SUPERINSTRUCTION_CASE(name, first, ...) \
+        case name: \
+            return superInstruction(#name, first, chunk, offset);
+        FOR_EACH_SUPERINSTRUCTION2(SUPERINSTRUCTION_CASE)
+        FOR_EACH_SUPERINSTRUCTION3(SUPERINSTRUCTION_CASE)
+#undef SUPERINSTRUCTION_CASE
+        default:
+            return disassemblePlain(chunk, offset, instruction);
+    }
+}
+
+static int disassemblePlain(Chunk *chunk, int offset, const uint8_t instruction) {
     switch (instruction) {
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
@@ -71,28 +125,34 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
-        case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-        case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-        case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL_SLOT:
+            return globalInstruction("OP_GET_GLOBAL_SLOT", chunk, offset);
+        case OP_DEFINE_GLOBAL_SLOT:
+            return globalInstruction("OP_DEFINE_GLOBAL_SLOT", chunk, offset);
+        case OP_SET_GLOBAL_SLOT:
+            return globalInstruction("OP_SET_GLOBAL_SLOT", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
         case OP_GREATER:
             return simpleInstruction("OP_GREATER", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
         case OP_LESS:
             return simpleInstruction("OP_LESS", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
         case OP_ADD:
             return simpleInstruction("OP_ADD", offset);
         case OP_SUBTRACT:
@@ -111,11 +171,27 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS_EQUAL", 1, chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
-        case OP_INVOKE: return invokeInstruction("OP_INVOKE", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_INVOKE: return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE: {
@@ -143,8 +219,113 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return constantInstruction("OP_METHOD", chunk, offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_ADD_NUMBER:
+            return simpleInstruction("OP_ADD_NUMBER", offset);
+        case OP_ADD_STRING:
+            return simpleInstruction("OP_ADD_STRING", offset);
+        case OP_SUBTRACT_NUMBER:
+            return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+        case OP_MULTIPLY_NUMBER:
+            return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+        case OP_DIVIDE_NUMBER:
+            return simpleInstruction("OP_DIVIDE_NUMBER", offset);
+        case OP_GREATER_NUMBER:
+            return simpleInstruction("OP_GREATER_NUMBER", offset);
+        case OP_LESS_NUMBER:
+            return simpleInstruction("OP_LESS_NUMBER", offset);
         default:
             printf("Unknown instruction %d\n", instruction);
             return offset + 1;
     }
 }
+
+#ifdef TRACE_JIT
+static void printSnapshot(const IR *ir, const int index) {
+    const Snapshot *snapshot = &ir->snapshots[index];
+    printf(" {");
+    for (int i = 0; i < snapshot->count; i++) {
+        const SnapshotEntry *entry = &ir->entries[snapshot->start + i];
+        printf("%s%d=%04d", i > 0 ? " " : "", entry->slot, entry->ref);
+    }
+    printf("}");
+    if (snapshot->virtuals > 0) {
+        printf(" +%d frames", snapshot->virtuals);
+    }
+}
+
+void printIR(const IR *ir, const char *name) {
+    printf("== %s ==\n", name);
+    for (int ref = 1; ref < ir->count; ref++) {
+        const IRIns *ins = &ir->code[ref];
+        if (ins->op == IR_NOP) {
+            continue;
+        }
+        if (ins->op == IR_LOOP) {
+            printf("---- LOOP ----\n");
+            continue;
+        }
+        printf("%04d %-14s", ref, irOpName(ins->op));
+        if (ins->a != 0) {
+            printf(" %04d", ins->a);
+        }
+        if (ins->b != 0) {
+            printf(" %04d", ins->b);
+        }
+        switch (ins->op) {
+            case IR_CONST:
+                if (ins->type == IRT_POINTER) {
+                    printf(" %p", ins->pointer);
+                } else {
+                    printf(" ");
+                    printValue(ins->value);
+                }
+                break;
+            case IR_SLOAD:
+                printf(" #%d%s", ins->aux, ins->aux2 ? " entry" : "");
+                break;
+            case IR_GLOAD:
+            case IR_GSTORE:
+                printf(" '");
+                printValue(vm.globalNames.values[ins->aux]);
+                printf("'");
+                break;
+            case IR_FLOAD:
+            case IR_FSTORE:
+            case IR_UPVALUE:
+            case IR_CHECK_CAPACITY:
+                printf(" [%d]", ins->aux);
+                break;
+            case IR_CHECK_VALUE:
+                printf(" ");
+                printValue(ins->value);
+                break;
+            case IR_CHECK_VERSION:
+                printf(" ");
+                printValue(OBJ_VAL(ins->pointer));
+                printf(" v%d", ins->aux);
+                break;
+            case IR_CALL_FRAME:
+                printf(" ");
+                printValue(OBJ_VAL(ins->pointer));
+                printf(" base %d depth %d", ins->aux, ins->aux2);
+                break;
+            case IR_CALL_NATIVE:
+                printf(" (%d args)", ins->aux);
+                break;
+            case IR_INSTANTIATE:
+            case IR_SUNK:
+                printf(" ");
+                printValue(OBJ_VAL(ins->pointer));
+                printf(" (%d args)", ins->aux);
+                break;
+            default:
+                break;
+        }
+        if (ins->snapshot >= 0) {
+            printSnapshot(ir, ins->snapshot);
+        }
+        printf("\n");
+    }
+    printf("folded %d, eliminated %d, inlined %d, sunk %d\n", ir->folded, ir->eliminated, ir->inlined, ir->sunk);
+}
+#endif
@@ -0,0 +1,1323 @@
+#include "ir.h"
+
+#ifdef TRACE_JIT
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "jit.h"
+
+/*
+ * a trace is lifted by running its records through an abstract interpreter whose
+ * stack holds IR values instead of lox values. every instruction goes through
+ * emit, which folds constants, drops guards whose outcome is known and reuses an
+ * earlier instruction computing the same thing. optimizeIR then peels the loop:
+ * the lifted iteration runs once, and a copy of it, emitted through the same
+ * folding, repeats. whatever the copy could take from the first iteration is
+ * loop invariant and no longer computed in the loop. instances that do not escape
+ * the trace are sunk, and the instructions nothing needs any more are removed.
+ */
+
+static void *growArray(void *array, int *capacity, const int count, const size_t size) {
+    if (count < *capacity) {
+        return array;
+    }
+    *capacity = *capacity < 64 ? 64 : *capacity * 2;
+    array = realloc(array, size * *capacity);
+    if (array == NULL) {
+        exit(1);
+    }
+    return array;
+}
+
+// the type an instruction is emitted with, guards refine it later
+static IRType opType(const IROp op) {
+    switch (op) {
+        case IR_CONST:
+        case IR_SLOAD:
+        case IR_FLOAD:
+        case IR_ULOAD:
+            return IRT_VALUE;
+        case IR_GLOAD:
+            return IRT_ANY;
+        case IR_FRAME_CLOSURE:
+        case IR_UPVALUE:
+            return IRT_POINTER;
+        case IR_INSTANTIATE:
+            return IRT_INSTANCE;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_NEG:
+            return IRT_NUMBER;
+        case IR_LT:
+        case IR_LE:
+        case IR_GT:
+        case IR_GE:
+        case IR_EQ:
+        case IR_NOT:
+            return IRT_BOOL;
+        default:
+            return IRT_NONE;
+    }
+}
+
+static IRIns instruction(const IROp op, const IRRef a, const IRRef b) {
+    IRIns ins;
+    memset(&ins, 0, sizeof(ins));
+    ins.op = op;
+    ins.type = opType(op);
+    ins.a = a;
+    ins.b = b;
+    ins.snapshot = -1;
+    return ins;
+}
+
+static IRRef append(IR *ir, IRIns ins) {
+    ir->code = growArray(ir->code, &ir->capacity, ir->count, sizeof(IRIns));
+    const IRRef ref = (IRRef) ir->count++;
+    ins.prev = ir->chain[ins.op];
+    ir->code[ref] = ins;
+    ir->chain[ins.op] = ref;
+    return ref;
+}
+
+void initIR(IR *ir) {
+    memset(ir, 0, sizeof(IR));
+    // ref 0 stands for no operand
+    append(ir, instruction(IR_NOP, 0, 0));
+}
+
+void freeIR(IR *ir) {
+    free(ir->code);
+    free(ir->snapshots);
+    free(ir->entries);
+    free(ir->frames);
+    memset(ir, 0, sizeof(IR));
+}
+
+static int addSnapshot(IR *ir, const uint8_t *ip, const int depth, const int top) {
+    ir->snapshots = growArray(ir->snapshots, &ir->snapshotCapacity, ir->snapshotCount, sizeof(Snapshot));
+    Snapshot *snapshot = &ir->snapshots[ir->snapshotCount];
+    snapshot->ip = ip;
+    snapshot->depth = depth;
+    snapshot->top = top;
+    snapshot->start = ir->entryCount;
+    snapshot->count = 0;
+    snapshot->frameStart = 0;
+    snapshot->virtuals = 0;
+    return ir->snapshotCount++;
+}
+
+// add an entry to the last snapshot
+static void addEntry(IR *ir, const int slot, const IRRef ref) {
+    ir->entries = growArray(ir->entries, &ir->entryCapacity, ir->entryCount, sizeof(SnapshotEntry));
+    ir->entries[ir->entryCount].slot = slot;
+    ir->entries[ir->entryCount].ref = ref;
+    ir->entryCount++;
+    ir->snapshots[ir->snapshotCount - 1].count++;
+}
+
+// --------------------------------------------------------------------------------
+// folding
+// --------------------------------------------------------------------------------
+
+static bool isGuard(const IROp op) {
+    return op >= IR_CHECK_NUMBER && op <= IR_CHECK_FALSEY;
+}
+
+// calls out of the trace that may change any global, field or slot
+static bool isBarrier(const IROp op) {
+    return op == IR_CALL_NATIVE || op == IR_FALLBACK || op == IR_LINK;
+}
+
+// instructions writing the slots of their snapshot back before they run. an allocation
+// writes them too, for the collector, but the trace does not rely on it
+static bool writesState(const IROp op) {
+    return op == IR_FLUSH || op == IR_CALL_NATIVE || op == IR_FALLBACK || op == IR_LINK;
+}
+
+static IRType valueType(const Value value) {
+    if (IS_NUMBER(value)) {
+        return IRT_NUMBER;
+    }
+    if (IS_BOOL(value)) {
+        return IRT_BOOL;
+    }
+    if (IS_INSTANCE(value)) {
+        return IRT_INSTANCE;
+    }
+    return IRT_VALUE;
+}
+
+static bool falsey(const Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static IRRef constant(IR *ir, const Value value) {
+    for (IRRef ref = ir->chain[IR_CONST]; ref != 0; ref = ir->code[ref].prev) {
+        if (ir->code[ref].type != IRT_POINTER && ir->code[ref].value == value) {
+            return ref;
+        }
+    }
+    IRIns ins = instruction(IR_CONST, 0, 0);
+    ins.type = valueType(value);
+    ins.value = value;
+    return append(ir, ins);
+}
+
+static IRRef pointerConstant(IR *ir, void *pointer) {
+    for (IRRef ref = ir->chain[IR_CONST]; ref != 0; ref = ir->code[ref].prev) {
+        if (ir->code[ref].type == IRT_POINTER && ir->code[ref].pointer == pointer) {
+            return ref;
+        }
+    }
+    IRIns ins = instruction(IR_CONST, 0, 0);
+    ins.type = IRT_POINTER;
+    ins.pointer = pointer;
+    return append(ir, ins);
+}
+
+static IRRef folded(IR *ir, const Value value) {
+    ir->folded++;
+    return constant(ir, value);
+}
+
+static double arithmetic(const IROp op, const double a, const double b) {
+    switch (op) {
+        case IR_ADD: return a + b;
+        case IR_SUB: return a - b;
+        case IR_MUL: return a * b;
+        default: return a / b;
+    }
+}
+
+// the comparisons of the interpreter, a >= b is !(a < b)
+static bool compare(const IROp op, const double a, const double b) {
+    switch (op) {
+        case IR_LT: return a < b;
+        case IR_LE: return !(a > b);
+        case IR_GT: return a > b;
+        default: return !(a < b);
+    }
+}
+
+static bool sameInstruction(const IRIns *a, const IRIns *b) {
+    return a->a == b->a && a->b == b->b && a->aux == b->aux && a->aux2 == b->aux2 && a->value == b->value &&
+           a->pointer == b->pointer;
+}
+
+// an instruction depending on its operands only
+static IRRef findPure(const IR *ir, const IRIns *ins) {
+    for (IRRef ref = ir->chain[ins->op]; ref != 0; ref = ir->code[ref].prev) {
+        if (sameInstruction(&ir->code[ref], ins)) {
+            return ref;
+        }
+    }
+    return 0;
+}
+
+// the global was loaded or stored since memory last changed
+static IRRef findGlobal(const IR *ir, const IRIns *ins) {
+    IRRef store = 0;
+    for (IRRef ref = ir->chain[IR_GSTORE]; ref > ir->barrier; ref = ir->code[ref].prev) {
+        if (ir->code[ref].aux == ins->aux) {
+            store = ref;
+            break;
+        }
+    }
+    for (IRRef ref = ir->chain[IR_GLOAD]; ref > ir->barrier && ref > store; ref = ir->code[ref].prev) {
+        if (ir->code[ref].aux == ins->aux) {
+            return ref;
+        }
+    }
+    return store != 0 ? ir->code[store].b : 0;
+}
+
+// the same for a field. any store to the slot, of whatever instance, may be to this one
+static IRRef findField(const IR *ir, const IRIns *ins) {
+    IRRef store = 0;
+    for (IRRef ref = ir->chain[IR_FSTORE]; ref > ir->barrier; ref = ir->code[ref].prev) {
+        if (ir->code[ref].aux == ins->aux) {
+            store = ref;
+            break;
+        }
+    }
+    for (IRRef ref = ir->chain[IR_FLOAD]; ref > ir->barrier && ref > store; ref = ir->code[ref].prev) {
+        if (ir->code[ref].a == ins->a && ir->code[ref].aux == ins->aux) {
+            return ref;
+        }
+    }
+    return store != 0 && ir->code[store].a == ins->a ? ir->code[store].b : 0;
+}
+
+// the instance is known to have the shape, by a check, by a store of it or by its allocation
+static IRRef findShape(const IR *ir, const IRIns *ins) {
+    const IRRef set = ir->chain[IR_SET_SHAPE] > ir->barrier ? ir->chain[IR_SET_SHAPE] : 0;
+    if (set != 0 && ir->code[set].a == ins->a && ir->code[set].pointer == ins->pointer) {
+        return set;
+    }
+    const IRIns *instance = &ir->code[ins->a];
+    if (instance->op == IR_INSTANTIATE && ins->a > ir->barrier && ins->a > set &&
+        ((ObjClass *) instance->pointer)->rootShape == ins->pointer) {
+        return ins->a;
+    }
+    for (IRRef ref = ir->chain[IR_CHECK_SHAPE]; ref > ir->barrier && ref > set; ref = ir->code[ref].prev) {
+        if (ir->code[ref].a == ins->a && ir->code[ref].pointer == ins->pointer) {
+            return ref;
+        }
+    }
+    return 0;
+}
+
+static IRRef findCommon(const IR *ir, const IRIns *ins) {
+    switch (ins->op) {
+        case IR_FRAME_CLOSURE:
+        case IR_UPVALUE:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_NEG:
+        case IR_LT:
+        case IR_LE:
+        case IR_GT:
+        case IR_GE:
+        case IR_EQ:
+        case IR_NOT:
+        case IR_CHECK_VALUE:
+        case IR_CHECK_TRUTHY:
+        case IR_CHECK_FALSEY:
+            return findPure(ir, ins);
+        case IR_GLOAD:
+            return findGlobal(ir, ins);
+        case IR_FLOAD:
+            return findField(ir, ins);
+        case IR_CHECK_SHAPE:
+            return findShape(ir, ins);
+        case IR_CHECK_VERSION:
+            for (IRRef ref = ir->chain[IR_CHECK_VERSION]; ref > ir->barrier; ref = ir->code[ref].prev) {
+                if (ir->code[ref].pointer == ins->pointer && ir->code[ref].aux == ins->aux) {
+                    return ref;
+                }
+            }
+            return 0;
+        case IR_CHECK_CAPACITY:
+            if (ir->code[ins->a].op == IR_INSTANTIATE && ins->aux < INSTANCE_INLINE_FIELDS) {
+                // a new instance keeps its fields inline, and capacities never shrink
+                return ins->a;
+            }
+            for (IRRef ref = ir->chain[IR_CHECK_CAPACITY]; ref > ir->barrier; ref = ir->code[ref].prev) {
+                if (ir->code[ref].a == ins->a && ir->code[ref].aux >= ins->aux) {
+                    return ref;
+                }
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+// what a guard that passed tells about its operand
+static void refine(IR *ir, const IRIns *ins) {
+    IRIns *operand = &ir->code[ins->a];
+    switch (ins->op) {
+        case IR_CHECK_NUMBER:
+            operand->type = IRT_NUMBER;
+            break;
+        case IR_CHECK_DEFINED:
+            if (operand->type == IRT_ANY) {
+                operand->type = IRT_VALUE;
+            }
+            break;
+        case IR_CHECK_SHAPE:
+            operand->type = IRT_INSTANCE;
+            break;
+        case IR_CHECK_VALUE:
+            operand->type = valueType(ins->value);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * add an instruction, folded where its operands allow
+ * @return the ref of its value, which may be an earlier instruction or a constant.
+ * 0 for a guard that is known to hold
+ */
+static IRRef emit(IR *ir, IRIns ins) {
+    const IRIns *a = &ir->code[ins.a];
+    const IRIns *b = &ir->code[ins.b];
+    switch (ins.op) {
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+            if (a->op == IR_CONST && b->op == IR_CONST) {
+                return folded(ir, NUMBER_VAL(arithmetic(ins.op, AS_NUMBER(a->value), AS_NUMBER(b->value))));
+            }
+            break;
+        case IR_NEG:
+            if (a->op == IR_CONST) {
+                return folded(ir, NUMBER_VAL(-AS_NUMBER(a->value)));
+            }
+            break;
+        case IR_LT:
+        case IR_LE:
+        case IR_GT:
+        case IR_GE:
+            if (a->op == IR_CONST && b->op == IR_CONST) {
+                return folded(ir, BOOL_VAL(compare(ins.op, AS_NUMBER(a->value), AS_NUMBER(b->value))));
+            }
+            break;
+        case IR_EQ:
+            if (a->op == IR_CONST && b->op == IR_CONST) {
+                return folded(ir, BOOL_VAL(valuesEqual(a->value, b->value)));
+            }
+            // two numbers compare as doubles, anything else by valuesEqual
+            ins.aux = a->type == IRT_NUMBER && b->type == IRT_NUMBER;
+            break;
+        case IR_NOT:
+            if (a->op == IR_CONST) {
+                return folded(ir, BOOL_VAL(falsey(a->value)));
+            }
+            if (a->type == IRT_NUMBER || a->type == IRT_INSTANCE) {
+                return folded(ir, FALSE_VAL);
+            }
+            ins.aux = a->type == IRT_BOOL;
+            break;
+        case IR_CHECK_NUMBER:
+            if (a->type == IRT_NUMBER) {
+                ir->folded++;
+                return 0;
+            }
+            break;
+        case IR_CHECK_DEFINED:
+            if (a->type != IRT_ANY) {
+                ir->folded++;
+                return 0;
+            }
+            break;
+        case IR_CHECK_VALUE:
+            if (a->op == IR_CONST && a->value == ins.value) {
+                ir->folded++;
+                return 0;
+            }
+            break;
+        case IR_CHECK_SHAPE:
+            // the operand needs no type check
+            ins.aux = a->type == IRT_INSTANCE;
+            break;
+        case IR_CHECK_TRUTHY:
+        case IR_CHECK_FALSEY: {
+            if (a->op == IR_NOT) {
+                ins.op = ins.op == IR_CHECK_TRUTHY ? IR_CHECK_FALSEY : IR_CHECK_TRUTHY;
+                ins.a = a->a;
+                return emit(ir, ins);
+            }
+            const bool truthy = ins.op == IR_CHECK_TRUTHY;
+            if ((a->op == IR_CONST && falsey(a->value) != truthy) ||
+                (truthy && (a->type == IRT_NUMBER || a->type == IRT_INSTANCE))) {
+                ir->folded++;
+                return 0;
+            }
+            // a boolean is compared with true only
+            ins.aux = a->type == IRT_BOOL;
+            break;
+        }
+        case IR_UPVALUE:
+            if (a->op == IR_CONST) {
+                ir->folded++;
+                return pointerConstant(ir, ((ObjClosure *) a->pointer)->upvalues[ins.aux]);
+            }
+            break;
+        default:
+            break;
+    }
+    const IRRef common = findCommon(ir, &ins);
+    if (common != 0) {
+        ir->folded++;
+        return isGuard(ins.op) ? 0 : common;
+    }
+    const IRRef ref = append(ir, ins);
+    refine(ir, &ir->code[ref]);
+    if (isBarrier(ins.op)) {
+        ir->barrier = ref;
+    }
+    return ref;
+}
+
+// --------------------------------------------------------------------------------
+// lifting
+// --------------------------------------------------------------------------------
+
+typedef enum {
+    // not read yet, it holds what it held when the iteration started
+    SLOT_ENTRY,
+    // not known, something outside the trace may have written it
+    SLOT_STALE,
+    // `ref`, and the interpreter's stack holds it as well
+    SLOT_CLEAN,
+    // `ref`, only the trace has it
+    SLOT_DIRTY,
+} SlotState;
+
+typedef struct {
+    uint8_t state;
+    IRRef ref;
+} SlotValue;
+
+typedef struct {
+    // NULL for the loop's frame, its closure is only known when the trace runs
+    ObjClosure *closure;
+    ObjFunction *function;
+    // slot of the callee, above the loop frame's slots
+    int base;
+    // not on the frame stack yet, see VirtualFrame
+    bool virtual;
+    // where the caller resumes
+    const uint8_t *resume;
+} LiftFrame;
+
+typedef struct {
+    IR *ir;
+    // the stack from the loop frame's slots on
+    SlotValue *slots;
+    int capacity;
+    int top;
+    LiftFrame frames[TRACE_DEPTH_MAX + 1];
+    int depth;
+    // the virtual frames on top in ir->frames, -1 once they changed
+    int frameStart;
+} Lifter;
+
+static void ensureSlots(Lifter *l, const int count) {
+    while (l->capacity < count) {
+        const int old = l->capacity;
+        l->capacity = old < 64 ? 64 : old * 2;
+        l->slots = realloc(l->slots, sizeof(SlotValue) * l->capacity);
+        if (l->slots == NULL) {
+            exit(1);
+        }
+        memset(l->slots + old, 0, sizeof(SlotValue) * (l->capacity - old));
+    }
+}
+
+static IRRef slotGet(Lifter *l, const int slot) {
+    SlotValue *value = &l->slots[slot];
+    if (value->state == SLOT_ENTRY || value->state == SLOT_STALE) {
+        IRIns ins = instruction(IR_SLOAD, 0, 0);
+        ins.aux = slot;
+        ins.aux2 = value->state == SLOT_ENTRY;
+        value->ref = append(l->ir, ins);
+        value->state = SLOT_CLEAN;
+    }
+    return value->ref;
+}
+
+static void slotSet(Lifter *l, const int slot, const IRRef ref) {
+    SlotValue *value = &l->slots[slot];
+    if (value->state != SLOT_CLEAN || value->ref != ref) {
+        value->state = SLOT_DIRTY;
+        value->ref = ref;
+    }
+}
+
+static void pushSlot(Lifter *l, const IRRef ref) {
+    ensureSlots(l, l->top + 1);
+    slotSet(l, l->top++, ref);
+}
+
+static IRRef popSlot(Lifter *l) {
+    const IRRef ref = slotGet(l, --l->top);
+    l->slots[l->top].state = SLOT_STALE;
+    return ref;
+}
+
+static IRRef peekSlot(Lifter *l, const int distance) {
+    return slotGet(l, l->top - 1 - distance);
+}
+
+static int virtualFrames(const Lifter *l) {
+    int count = 0;
+    while (count < l->depth && l->frames[l->depth - count].virtual) {
+        count++;
+    }
+    return count;
+}
+
+// a snapshot without slots, for the frames to push at this point
+static int frameSnapshot(Lifter *l, const uint8_t *ip) {
+    IR *ir = l->ir;
+    const int virtuals = virtualFrames(l);
+    if (virtuals > 0 && l->frameStart < 0) {
+        l->frameStart = ir->frameCount;
+        for (int depth = l->depth - virtuals + 1; depth <= l->depth; depth++) {
+            ir->frames = growArray(ir->frames, &ir->frameCapacity, ir->frameCount, sizeof(VirtualFrame));
+            VirtualFrame *frame = &ir->frames[ir->frameCount++];
+            frame->closure = l->frames[depth].closure;
+            frame->base = l->frames[depth].base;
+            frame->ip = l->frames[depth].resume;
+        }
+    }
+    const int index = addSnapshot(ir, ip, l->depth, l->top);
+    ir->snapshots[index].frameStart = virtuals > 0 ? l->frameStart : 0;
+    ir->snapshots[index].virtuals = virtuals;
+    return index;
+}
+
+// the virtual frames were pushed
+static void materialize(Lifter *l) {
+    for (int depth = 1; depth <= l->depth; depth++) {
+        l->frames[depth].virtual = false;
+    }
+    l->frameStart = -1;
+}
+
+// the state to write back at this point, the top frame going on at `ip`
+static int snapshot(Lifter *l, const uint8_t *ip) {
+    IR *ir = l->ir;
+    const int index = frameSnapshot(l, ip);
+    for (int slot = 0; slot < l->top; slot++) {
+        if (l->slots[slot].state == SLOT_DIRTY) {
+            addEntry(ir, slot, l->slots[slot].ref);
+        }
+    }
+    return index;
+}
+
+// the slots were written back
+static void flushed(const Lifter *l) {
+    for (int slot = 0; slot < l->top; slot++) {
+        if (l->slots[slot].state == SLOT_DIRTY) {
+            l->slots[slot].state = SLOT_CLEAN;
+        }
+    }
+}
+
+// slots from `from` on may have been written outside the trace
+static void invalidate(const Lifter *l, const int from) {
+    for (int slot = from; slot < l->capacity; slot++) {
+        l->slots[slot].state = SLOT_STALE;
+    }
+}
+
+static void guard(Lifter *l, IRIns ins, const uint8_t *exit) {
+    const IRRef ref = emit(l->ir, ins);
+    if (ref != 0) {
+        l->ir->code[ref].snapshot = snapshot(l, exit);
+    }
+}
+
+// an instruction that writes the slots back and calls out
+static void callOut(Lifter *l, IRIns ins, const uint8_t *ip) {
+    ins.snapshot = snapshot(l, ip);
+    flushed(l);
+    if (ins.op != IR_FLUSH) {
+        // the callee may report an error or look at the frames
+        materialize(l);
+    }
+    emit(l->ir, ins);
+}
+
+// slots an upvalue may point into have to be written back before it is accessed
+static void flush(Lifter *l, const uint8_t *ip) {
+    callOut(l, instruction(IR_FLUSH, 0, 0), ip);
+}
+
+static uint16_t readShort(const uint8_t *ip) {
+    return (uint16_t) ((ip[0] << 8) | ip[1]);
+}
+
+static IRRef closureOf(Lifter *l) {
+    ObjClosure *closure = l->frames[l->depth].closure;
+    if (closure != NULL) {
+        return pointerConstant(l->ir, closure);
+    }
+    return emit(l->ir, instruction(IR_FRAME_CLOSURE, 0, 0));
+}
+
+static void numberOperands(Lifter *l, const uint8_t *ip, const int count) {
+    for (int i = 0; i < count; i++) {
+        guard(l, instruction(IR_CHECK_NUMBER, peekSlot(l, i), 0), ip);
+    }
+}
+
+static void binary(Lifter *l, const IROp op) {
+    const IRRef b = popSlot(l);
+    const IRRef a = popSlot(l);
+    pushSlot(l, emit(l->ir, instruction(op, a, b)));
+}
+
+/**
+ * a recorded branch on `condition`, which jumps when it is truthy or falsey
+ */
+static void branch(Lifter *l, const IRRef condition, const bool jumpsIfTruthy, const TraceRecord *record,
+                   const uint8_t *next) {
+    const uint8_t *target = next + readShort(record->ip + 1);
+    const IROp op = record->taken == jumpsIfTruthy ? IR_CHECK_TRUTHY : IR_CHECK_FALSEY;
+    guard(l, instruction(op, condition, 0), record->taken ? next : target);
+}
+
+// a small callee that does not call itself gets no frame until the trace needs one
+static bool isInlined(const Lifter *l, const ObjClosure *closure) {
+    if (closure->function->chunk.count > TRACE_INLINE_MAX) {
+        return false;
+    }
+    for (int depth = 0; depth <= l->depth; depth++) {
+        if (l->frames[depth].function == closure->function) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool callFrame(Lifter *l, ObjClosure *closure, const int base, const uint8_t *next) {
+    if (l->depth == TRACE_DEPTH_MAX) {
+        return false;
+    }
+    const bool inlined = isInlined(l, closure);
+    if (inlined) {
+        l->ir->inlined++;
+    } else {
+        IRIns ins = instruction(IR_CALL_FRAME, 0, 0);
+        ins.pointer = closure;
+        ins.aux = base;
+        ins.aux2 = l->depth + 1;
+        ins.ip = next;
+        if (virtualFrames(l) > 0) {
+            // the frames below are pushed first
+            ins.snapshot = frameSnapshot(l, next);
+            materialize(l);
+        }
+        emit(l->ir, ins);
+    }
+    l->depth++;
+    l->frames[l->depth].closure = closure;
+    l->frames[l->depth].function = closure->function;
+    l->frames[l->depth].base = base;
+    l->frames[l->depth].virtual = inlined;
+    l->frames[l->depth].resume = next;
+    l->frameStart = -1;
+    return true;
+}
+
+static bool liftCall(Lifter *l, const TraceRecord *record, const uint8_t *next) {
+    const int argCount = record->ip[1];
+    const int callee = l->top - argCount - 1;
+    IRIns check = instruction(IR_CHECK_VALUE, slotGet(l, callee), 0);
+    check.value = record->callee;
+    guard(l, check, record->ip);
+    if (IS_NATIVE(record->callee)) {
+        IRIns ins = instruction(IR_CALL_NATIVE, 0, 0);
+        ins.aux = argCount;
+        callOut(l, ins, next);
+        invalidate(l, callee);
+        l->top = callee + 1;
+        return true;
+    }
+    if (IS_CLASS(record->callee)) {
+        // whether the class has an initializer depends on its methods
+        IRIns version = instruction(IR_CHECK_VERSION, 0, 0);
+        version.pointer = AS_CLASS(record->callee);
+        version.aux = record->version;
+        guard(l, version, record->ip);
+        IRIns ins = instruction(IR_INSTANTIATE, 0, 0);
+        ins.pointer = AS_CLASS(record->callee);
+        ins.aux = argCount;
+        ins.aux2 = callee;
+        ins.snapshot = snapshot(l, next);
+        // allocating runs no lox code, so the frames stay virtual and the slots as they are
+        l->ir->snapshots[ins.snapshot].virtuals = 0;
+        slotSet(l, callee, emit(l->ir, ins));
+    }
+    return record->closure == NULL || callFrame(l, record->closure, callee, next);
+}
+
+static void fallback(Lifter *l, const TraceRecord *record, const TraceRecord *next) {
+    IRIns ins = instruction(IR_FALLBACK, 0, 0);
+    ins.pointer = record->function;
+    ins.ip = record->ip;
+    callOut(l, ins, record->ip);
+    invalidate(l, 0);
+    l->top = next->top;
+    ensureSlots(l, l->top);
+}
+
+/**
+ * lift one record, the stack is at its height before the instruction
+ * @return false if the trace cannot be lifted
+ */
+static bool liftRecord(Lifter *l, const TraceRecord *record, const TraceRecord *nextRecord) {
+    IR *ir = l->ir;
+    const Chunk *chunk = &record->function->chunk;
+    const uint8_t *ip = record->ip;
+    const uint8_t *next = ip + instructionLength(chunk, (int) (ip - chunk->code));
+    const int base = l->frames[l->depth].base;
+    if (record->link != NULL) {
+        IRIns ins = instruction(IR_LINK, 0, 0);
+        ins.pointer = record->link;
+        ins.ip = record->exit;
+        callOut(l, ins, ip);
+        invalidate(l, 0);
+        l->top = nextRecord->top;
+        ensureSlots(l, l->top);
+        return true;
+    }
+    switch (record->instruction) {
+        case OP_CONSTANT:
+            pushSlot(l, constant(ir, chunk->constants.values[ip[1]]));
+            return true;
+        case OP_NIL:
+            pushSlot(l, constant(ir, NIL_VAL));
+            return true;
+        case OP_TRUE:
+            pushSlot(l, constant(ir, TRUE_VAL));
+            return true;
+        case OP_FALSE:
+            pushSlot(l, constant(ir, FALSE_VAL));
+            return true;
+        case OP_POP:
+            popSlot(l);
+            return true;
+        case OP_GET_LOCAL:
+            pushSlot(l, slotGet(l, base + ip[1]));
+            return true;
+        case OP_SET_LOCAL:
+            slotSet(l, base + ip[1], peekSlot(l, 0));
+            return true;
+        case OP_GET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT: {
+            IRIns load = instruction(IR_GLOAD, 0, 0);
+            load.aux = readShort(ip + 1);
+            const IRRef value = emit(ir, load);
+            guard(l, instruction(IR_CHECK_DEFINED, value, 0), ip);
+            if (record->instruction == OP_GET_GLOBAL_SLOT) {
+                pushSlot(l, value);
+                return true;
+            }
+            IRIns store = instruction(IR_GSTORE, 0, peekSlot(l, 0));
+            store.aux = load.aux;
+            emit(ir, store);
+            return true;
+        }
+        case OP_DEFINE_GLOBAL_SLOT: {
+            IRIns store = instruction(IR_GSTORE, 0, popSlot(l));
+            store.aux = readShort(ip + 1);
+            emit(ir, store);
+            return true;
+        }
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE: {
+            IRIns upvalue = instruction(IR_UPVALUE, closureOf(l), 0);
+            upvalue.aux = ip[1];
+            const IRRef location = emit(ir, upvalue);
+            flush(l, ip);
+            if (record->instruction == OP_GET_UPVALUE) {
+                pushSlot(l, emit(ir, instruction(IR_ULOAD, location, 0)));
+                return true;
+            }
+            const IRRef value = peekSlot(l, 0);
+            emit(ir, instruction(IR_USTORE, location, value));
+            // it may have written a slot
+            invalidate(l, 0);
+            return true;
+        }
+        case OP_GET_PROPERTY: {
+            if (record->shape == NULL) {
+                break;
+            }
+            IRIns check = instruction(IR_CHECK_SHAPE, peekSlot(l, 0), 0);
+            check.pointer = record->shape;
+            guard(l, check, ip);
+            IRIns load = instruction(IR_FLOAD, popSlot(l), 0);
+            load.aux = record->index;
+            pushSlot(l, emit(ir, load));
+            return true;
+        }
+        case OP_SET_PROPERTY: {
+            if (record->shape == NULL) {
+                break;
+            }
+            const IRRef instance = peekSlot(l, 1);
+            IRIns check = instruction(IR_CHECK_SHAPE, instance, 0);
+            check.pointer = record->shape;
+            guard(l, check, ip);
+            if (record->transition != NULL) {
+                // an added field needs room in the instance
+                IRIns capacity = instruction(IR_CHECK_CAPACITY, instance, 0);
+                capacity.aux = record->index;
+                guard(l, capacity, ip);
+                IRIns shape = instruction(IR_SET_SHAPE, instance, 0);
+                shape.pointer = record->transition;
+                emit(ir, shape);
+            }
+            const IRRef value = popSlot(l);
+            IRIns store = instruction(IR_FSTORE, instance, value);
+            store.aux = record->index;
+            emit(ir, store);
+            // the value replaces the instance
+            popSlot(l);
+            pushSlot(l, value);
+            return true;
+        }
+        case OP_EQUAL:
+            binary(l, IR_EQ);
+            return true;
+        case OP_NOT_EQUAL:
+            binary(l, IR_EQ);
+            pushSlot(l, emit(ir, instruction(IR_NOT, popSlot(l), 0)));
+            return true;
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            static const IROp ops[] = {
+                [OP_GREATER] = IR_GT, [OP_GREATER_EQUAL] = IR_GE, [OP_LESS] = IR_LT, [OP_LESS_EQUAL] = IR_LE,
+                [OP_SUBTRACT] = IR_SUB, [OP_MULTIPLY] = IR_MUL, [OP_DIVIDE] = IR_DIV,
+            };
+            numberOperands(l, ip, 2);
+            binary(l, ops[record->instruction]);
+            return true;
+        }
+        case OP_ADD:
+            if (record->strings) {
+                break;
+            }
+            numberOperands(l, ip, 2);
+            binary(l, IR_ADD);
+            return true;
+        case OP_NEGATE:
+            numberOperands(l, ip, 1);
+            pushSlot(l, emit(ir, instruction(IR_NEG, popSlot(l), 0)));
+            return true;
+        case OP_NOT:
+            pushSlot(l, emit(ir, instruction(IR_NOT, popSlot(l), 0)));
+            return true;
+        case OP_PRINT:
+            emit(ir, instruction(IR_PRINT, popSlot(l), 0));
+            return true;
+        case OP_JUMP:
+        case OP_LOOP:
+            // the trace goes on with the recorded target
+            return true;
+        case OP_JUMP_IF_FALSE:
+            branch(l, peekSlot(l, 0), false, record, next);
+            return true;
+        case OP_POP_JUMP_IF_FALSE:
+            branch(l, popSlot(l), false, record, next);
+            return true;
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL: {
+            const IRRef b = popSlot(l);
+            const IRRef a = popSlot(l);
+            branch(l, emit(ir, instruction(IR_EQ, a, b)), record->instruction == OP_JUMP_IF_EQUAL, record, next);
+            return true;
+        }
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL: {
+            static const IROp ops[] = {
+                [OP_JUMP_IF_NOT_GREATER] = IR_GT, [OP_JUMP_IF_NOT_GREATER_EQUAL] = IR_GE,
+                [OP_JUMP_IF_NOT_LESS] = IR_LT, [OP_JUMP_IF_NOT_LESS_EQUAL] = IR_LE,
+            };
+            numberOperands(l, ip, 2);
+            const IRRef b = popSlot(l);
+            const IRRef a = popSlot(l);
+            branch(l, emit(ir, instruction(ops[record->instruction], a, b)), false, record, next);
+            return true;
+        }
+        case OP_CALL:
+            return liftCall(l, record, next);
+        case OP_INVOKE: {
+            const int argCount = ip[2];
+            IRIns check = instruction(IR_CHECK_SHAPE, peekSlot(l, argCount), 0);
+            check.pointer = record->shape;
+            guard(l, check, ip);
+            // the shape of an instance belongs to its class, whose methods are checked by version
+            IRIns version = instruction(IR_CHECK_VERSION, 0, 0);
+            version.pointer = AS_CLASS(record->callee);
+            version.aux = record->version;
+            guard(l, version, ip);
+            return callFrame(l, record->closure, l->top - argCount - 1, next);
+        }
+        case OP_SUPER_INVOKE: {
+            IRIns check = instruction(IR_CHECK_VALUE, peekSlot(l, 0), 0);
+            check.value = record->callee;
+            guard(l, check, ip);
+            IRIns version = instruction(IR_CHECK_VERSION, 0, 0);
+            version.pointer = AS_CLASS(record->callee);
+            version.aux = record->version;
+            guard(l, version, ip);
+            popSlot(l);
+            return callFrame(l, record->closure, l->top - ip[2] - 1, next);
+        }
+        case OP_RETURN: {
+            if (l->depth == 0) {
+                return false;
+            }
+            const IRRef result = popSlot(l);
+            const LiftFrame *frame = &l->frames[l->depth];
+            if (!frame->virtual) {
+                // upvalues of the frame are closed from its written back slots
+                IRIns ins = instruction(IR_RETURN_FRAME, 0, 0);
+                ins.aux = frame->base;
+                ins.aux2 = l->depth;
+                ins.snapshot = snapshot(l, ip);
+                emit(ir, ins);
+            }
+            for (int slot = frame->base; slot < l->top; slot++) {
+                l->slots[slot].state = SLOT_STALE;
+            }
+            l->top = frame->base;
+            l->depth--;
+            l->frameStart = -1;
+            pushSlot(l, result);
+            return true;
+        }
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_INHERIT:
+            return false;
+        default:
+            break;
+    }
+    // closures, upvalues closing, super lookups and generic property accesses run the
+    // template of the baseline jit
+    fallback(l, record, nextRecord);
+    return true;
+}
+
+/**
+ * lift the records of a loop, the last one is its back-edge
+ * @return false if they do not form a loop the IR can express
+ */
+bool buildIR(IR *ir, const TraceRecord *records, const int count) {
+    Lifter l;
+    memset(&l, 0, sizeof(l));
+    l.ir = ir;
+    l.top = records[0].top;
+    l.frameStart = -1;
+    l.frames[0].function = records[0].function;
+    ensureSlots(&l, l.top + 1);
+    bool ok = true;
+    for (int i = 0; i < count - 1 && ok; i++) {
+        const TraceRecord *record = &records[i];
+        ok = record->top == l.top && record->function == l.frames[l.depth].function &&
+             liftRecord(&l, record, &records[i + 1]);
+    }
+    const TraceRecord *last = &records[count - 1];
+    ok = ok && l.depth == 0 && last->instruction == OP_LOOP && last->top == records[0].top;
+    if (ok) {
+        ir->endState = addSnapshot(ir, last->ip, 0, l.top);
+        for (int slot = 0; slot < l.top; slot++) {
+            if (l.slots[slot].state == SLOT_CLEAN || l.slots[slot].state == SLOT_DIRTY) {
+                addEntry(ir, slot, l.slots[slot].ref);
+            }
+        }
+        ir->endDirty = addSnapshot(ir, last->ip, 0, l.top);
+        for (int slot = 0; slot < l.top; slot++) {
+            if (l.slots[slot].state == SLOT_DIRTY) {
+                addEntry(ir, slot, l.slots[slot].ref);
+            }
+        }
+    }
+    free(l.slots);
+    return ok;
+}
+
+// --------------------------------------------------------------------------------
+// loop peeling and dead code elimination
+// --------------------------------------------------------------------------------
+
+/**
+ * copy a snapshot of the first iteration into the loop
+ * @param merge also write back the slots the previous iteration left unwritten
+ */
+static int copySnapshot(IR *ir, const int index, const IRRef *subst, const bool merge) {
+    const Snapshot original = ir->snapshots[index];
+    const int copy = addSnapshot(ir, original.ip, original.depth, original.top);
+    ir->snapshots[copy].frameStart = original.frameStart;
+    ir->snapshots[copy].virtuals = original.virtuals;
+    for (int i = 0; i < original.count; i++) {
+        const SnapshotEntry entry = ir->entries[original.start + i];
+        addEntry(ir, entry.slot, subst[entry.ref]);
+    }
+    if (!merge) {
+        return copy;
+    }
+    const Snapshot dirty = ir->snapshots[ir->endDirty];
+    for (int i = 0; i < dirty.count; i++) {
+        const SnapshotEntry entry = ir->entries[dirty.start + i];
+        bool written = entry.slot >= original.top;
+        for (int j = 0; j < original.count && !written; j++) {
+            written = ir->entries[original.start + j].slot == entry.slot;
+        }
+        if (!written) {
+            addEntry(ir, entry.slot, entry.ref);
+        }
+    }
+    return copy;
+}
+
+/*
+ * a ref of the first iteration used in the loop stands for its value in the
+ * iteration before. unless the loop computes the same ref again, so the value is
+ * invariant, a phi moves the loop's value into it at the back-edge.
+ */
+static void addPhis(IR *ir, const IRRef *subst, const int count) {
+    bool *marked = calloc(count, sizeof(bool));
+    IRRef *refs = malloc(sizeof(IRRef) * count);
+    if (marked == NULL || refs == NULL) {
+        exit(1);
+    }
+    int phis = 0;
+#define USE(ref)                                                                     \
+    do {                                                                             \
+        const IRRef use_ = (ref);                                                    \
+        if (use_ != 0 && use_ < ir->loop && subst[use_] != use_ && !marked[use_]) {  \
+            marked[use_] = true;                                                     \
+            refs[phis++] = use_;                                                     \
+        }                                                                            \
+    } while (false)
+
+    for (int ref = ir->loop + 1; ref < ir->count; ref++) {
+        const IRIns *ins = &ir->code[ref];
+        USE(ins->a);
+        USE(ins->b);
+        if (ins->snapshot >= 0) {
+            const Snapshot *snapshot = &ir->snapshots[ins->snapshot];
+            for (int i = 0; i < snapshot->count; i++) {
+                USE(ir->entries[snapshot->start + i].ref);
+            }
+        }
+    }
+    for (int i = 0; i < phis; i++) {
+        USE(subst[refs[i]]);
+    }
+#undef USE
+    for (int i = 0; i < phis; i++) {
+        append(ir, instruction(IR_PHI, refs[i], subst[refs[i]]));
+    }
+    free(marked);
+    free(refs);
+}
+
+static void peelLoop(IR *ir) {
+    const int count = ir->count;
+    IRRef *subst = calloc(count, sizeof(IRRef));
+    const Snapshot *end = &ir->snapshots[ir->endState];
+    IRRef *slots = calloc(end->top + 1, sizeof(IRRef));
+    if (subst == NULL || slots == NULL) {
+        exit(1);
+    }
+    for (int i = 0; i < end->count; i++) {
+        slots[ir->entries[end->start + i].slot] = ir->entries[end->start + i].ref;
+    }
+    const int top = end->top;
+    ir->loop = append(ir, instruction(IR_LOOP, 0, 0));
+    // until the loop writes its slots back, it has the previous iteration's to write too
+    bool merge = true;
+    for (int ref = 1; ref < count; ref++) {
+        IRIns ins = ir->code[ref];
+        switch (ins.op) {
+            case IR_NOP:
+                continue;
+            case IR_CONST:
+                subst[ref] = (IRRef) ref;
+                continue;
+            case IR_SLOAD:
+                if (ins.aux2 && ins.aux < top && slots[ins.aux] != 0) {
+                    // the slot holds what the previous iteration left in it
+                    subst[ref] = slots[ins.aux];
+                    continue;
+                }
+                ins.aux2 = false;
+                ins.type = opType(IR_SLOAD);
+                subst[ref] = append(ir, ins);
+                continue;
+            default:
+                break;
+        }
+        // guards refined the types of the first iteration only
+        ins.type = opType(ins.op);
+        ins.a = subst[ins.a];
+        ins.b = subst[ins.b];
+        if (ins.snapshot >= 0) {
+            ins.snapshot = copySnapshot(ir, ins.snapshot, subst, merge);
+        }
+        subst[ref] = emit(ir, ins);
+        if (writesState(ins.op)) {
+            merge = false;
+        }
+    }
+    addPhis(ir, subst, count);
+    free(subst);
+    free(slots);
+}
+
+/*
+ * an instance escapes when anything but its own field stores and the snapshots of
+ * guards and allocations use it. one that does not is sunk: the trace never
+ * allocates it, and an exit that needs it builds it from the stores before the guard.
+ * the snapshot of a call out, a phi or a store of the instance elsewhere lets it escape.
+ */
+static void sinkAllocations(IR *ir) {
+    bool *escapes = calloc(ir->count, sizeof(bool));
+    if (escapes == NULL) {
+        exit(1);
+    }
+    for (int ref = 1; ref < ir->count; ref++) {
+        const IRIns *ins = &ir->code[ref];
+        switch (ins->op) {
+            case IR_NOP:
+                continue;
+            case IR_FSTORE:
+                // fields past the inline ones need an allocation of their own
+                escapes[ins->a] = escapes[ins->a] || ins->aux >= INSTANCE_INLINE_FIELDS;
+                escapes[ins->b] = true;
+                break;
+            case IR_SET_SHAPE:
+                break;
+            default:
+                escapes[ins->a] = true;
+                escapes[ins->b] = true;
+                break;
+        }
+        if (ins->snapshot >= 0 && !isGuard(ins->op) && ins->op != IR_INSTANTIATE && ins->op != IR_CALL_FRAME) {
+            const Snapshot *snapshot = &ir->snapshots[ins->snapshot];
+            for (int i = 0; i < snapshot->count; i++) {
+                escapes[ir->entries[snapshot->start + i].ref] = true;
+            }
+        }
+    }
+    for (int ref = 1; ref < ir->count; ref++) {
+        IRIns *ins = &ir->code[ref];
+        if (ins->op == IR_INSTANTIATE && !escapes[ref]) {
+            ins->op = IR_SUNK;
+            ins->snapshot = -1;
+            ir->sunk++;
+        }
+    }
+    free(escapes);
+}
+
+// a phi or a store into a sunk instance is live when the value it updates is
+static bool isDependent(const IR *ir, const IRIns *ins) {
+    return ins->op == IR_PHI ||
+           ((ins->op == IR_FSTORE || ins->op == IR_SET_SHAPE) && ir->code[ins->a].op == IR_SUNK);
+}
+
+// instructions that have to run even if nothing uses their value
+static bool hasEffect(const IR *ir, const IRIns *ins) {
+    if (ins->op == IR_FLUSH) {
+        return ir->snapshots[ins->snapshot].count > 0;
+    }
+    return ins->op >= IR_CHECK_NUMBER && ins->op <= IR_LOOP;
+}
+
+static void eliminateDeadCode(IR *ir) {
+    bool *live = calloc(ir->count, sizeof(bool));
+    if (live == NULL) {
+        exit(1);
+    }
+    bool again;
+    do {
+        // a dependent instruction comes after its value, which may only turn out to be
+        // live once the walk passed it
+        for (int ref = ir->count - 1; ref > 0; ref--) {
+            const IRIns *ins = &ir->code[ref];
+            const bool dependent = isDependent(ir, ins);
+            if (!live[ref]) {
+                if (dependent ? !live[ins->a] : !hasEffect(ir, ins)) {
+                    continue;
+                }
+                live[ref] = true;
+            }
+            if (!dependent) {
+                live[ins->a] = true;
+            }
+            live[ins->b] = true;
+            if (ins->snapshot >= 0) {
+                const Snapshot *snapshot = &ir->snapshots[ins->snapshot];
+                for (int i = 0; i < snapshot->count; i++) {
+                    live[ir->entries[snapshot->start + i].ref] = true;
+                }
+            }
+        }
+        again = false;
+        for (int ref = 1; ref < ir->count; ref++) {
+            again = again || (!live[ref] && isDependent(ir, &ir->code[ref]) && live[ir->code[ref].a]);
+        }
+    } while (again);
+    for (int ref = 1; ref < ir->count; ref++) {
+        if (!live[ref] && ir->code[ref].op != IR_NOP) {
+            ir->code[ref].op = IR_NOP;
+            ir->code[ref].type = IRT_NONE;
+            ir->eliminated++;
+        }
+    }
+    free(live);
+}
+
+void optimizeIR(IR *ir) {
+    peelLoop(ir);
+    sinkAllocations(ir);
+    eliminateDeadCode(ir);
+}
+
+const char *irOpName(const IROp op) {
+    static const char *names[] = {
+        [IR_NOP] = "NOP",
+        [IR_CONST] = "CONST",
+        [IR_SLOAD] = "SLOAD",
+        [IR_GLOAD] = "GLOAD",
+        [IR_FLOAD] = "FLOAD",
+        [IR_FRAME_CLOSURE] = "FCLOSURE",
+        [IR_UPVALUE] = "UPVALUE",
+        [IR_ULOAD] = "ULOAD",
+        [IR_ADD] = "ADD",
+        [IR_SUB] = "SUB",
+        [IR_MUL] = "MUL",
+        [IR_DIV] = "DIV",
+        [IR_NEG] = "NEG",
+        [IR_LT] = "LT",
+        [IR_LE] = "LE",
+        [IR_GT] = "GT",
+        [IR_GE] = "GE",
+        [IR_EQ] = "EQ",
+        [IR_NOT] = "NOT",
+        [IR_CHECK_NUMBER] = "CHECK_NUMBER",
+        [IR_CHECK_DEFINED] = "CHECK_DEFINED",
+        [IR_CHECK_VALUE] = "CHECK_VALUE",
+        [IR_CHECK_SHAPE] = "CHECK_SHAPE",
+        [IR_CHECK_VERSION] = "CHECK_VERSION",
+        [IR_CHECK_CAPACITY] = "CHECK_CAPACITY",
+        [IR_CHECK_TRUTHY] = "CHECK_TRUTHY",
+        [IR_CHECK_FALSEY] = "CHECK_FALSEY",
+        [IR_GSTORE] = "GSTORE",
+        [IR_FSTORE] = "FSTORE",
+        [IR_SET_SHAPE] = "SET_SHAPE",
+        [IR_USTORE] = "USTORE",
+        [IR_FLUSH] = "FLUSH",
+        [IR_CALL_FRAME] = "CALL_FRAME",
+        [IR_RETURN_FRAME] = "RETURN_FRAME",
+        [IR_CALL_NATIVE] = "CALL_NATIVE",
+        [IR_INSTANTIATE] = "INSTANTIATE",
+        [IR_PRINT] = "PRINT",
+        [IR_FALLBACK] = "FALLBACK",
+        [IR_LINK] = "LINK",
+        [IR_LOOP] = "LOOP",
+        [IR_PHI] = "PHI",
+        [IR_SUNK] = "SUNK",
+    };
+    return names[op];
+}
+#endif
@@ -0,0 +1,2506 @@
+#include "jit.h"
+
+#ifdef JIT
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "chunk.h"
+#include "debug.h"
+#include "ir.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+/*
+ * baseline jit: every instruction of a hot function becomes a fixed piece of
+ * x86-64 code, without any optimization across instructions. stack and local
+ * accesses, number arithmetic, comparisons, jumps and cached field loads run
+ * inline, everything else calls back into the runtime helpers of vm.c.
+ *
+ * the native code keeps the frame state in callee saved registers:
+ *   rbx  top of the value stack (vm.stackTop)
+ *   r12  frame->slots
+ *   r13  QNAN, to test for numbers
+ *   r14  the CallFrame
+ *   r15  &vm
+ * before a helper is called, ip and sp are written back like the interpreter
+ * does, so helpers, the gc and runtimeError see the same state.
+ */
+
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// condition codes of jcc and setcc
+enum {
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_S = 0x8,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_ALWAYS = -1,
+};
+
+// x86 opcodes taking a register and a register or memory operand
+enum {
+    X86_ADD = 0x01,
+    X86_ADD_LOAD = 0x03,
+    X86_OR = 0x09,
+    X86_AND = 0x21,
+    X86_CMP = 0x39,
+    X86_CMP_LOAD = 0x3B,
+    X86_MOVSXD = 0x63,
+    X86_TEST = 0x85,
+    X86_STORE = 0x89,
+    X86_LOAD = 0x8B,
+    X86_LEA = 0x8D,
+};
+
+// opcode extensions of the 0x83 group, an instruction with an 8 bit immediate
+enum {
+    X86_ADD_IMM = 0,
+    X86_OR_IMM = 1,
+    X86_SUB_IMM = 5,
+};
+
+/*
+ * a bytecode jump, patched once every instruction has its native offset
+ */
+typedef struct {
+    // position of the rel32 operand
+    int position;
+    // bytecode offset of the target
+    int target;
+} JumpFixup;
+
+/*
+ * a guard of a trace, writing its snapshot back and leaving to the interpreter when it fails
+ */
+typedef struct {
+    // position of the rel32 operand
+    int position;
+    // the guard's IR instruction
+    int guard;
+} TraceExit;
+
+typedef struct {
+    const Chunk *chunk;
+    uint8_t *code;
+    int count;
+    int capacity;
+    uint32_t *entries;
+    JumpFixup *fixups;
+    int fixupCount;
+    int fixupCapacity;
+    // native offset of the shared epilogue, leaving with the status in eax
+    int exit;
+    TraceExit *exits;
+    int exitCount;
+    int exitCapacity;
+} JitCompiler;
+
+// native calls nested on the C stack, see enterCallee
+#define JIT_NESTING_MAX 4096
+
+static int nesting = 0;
+
+typedef int (*JitEntry)(CallFrame *frame, const uint8_t *target);
+
+static void emitByte(JitCompiler *jc, const uint8_t byte) {
+    if (jc->count == jc->capacity) {
+        jc->capacity = jc->capacity < 256 ? 256 : jc->capacity * 2;
+        jc->code = realloc(jc->code, jc->capacity);
+        if (jc->code == NULL) {
+            exit(1);
+        }
+    }
+    jc->code[jc->count++] = byte;
+}
+
+static void emitBytes(JitCompiler *jc, const uint8_t *bytes, const int count) {
+    for (int i = 0; i < count; i++) {
+        emitByte(jc, bytes[i]);
+    }
+}
+
+#define EMIT(jc, ...)                                                \
+    do {                                                             \
+        const uint8_t bytes_[] = {__VA_ARGS__};                      \
+        emitBytes((jc), bytes_, (int) sizeof(bytes_));               \
+    } while (false)
+
+static void emit32(JitCompiler *jc, const uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        emitByte(jc, (uint8_t) (value >> (8 * i)));
+    }
+}
+
+static void emit64(JitCompiler *jc, const uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        emitByte(jc, (uint8_t) (value >> (8 * i)));
+    }
+}
+
+static void emitRex(JitCompiler *jc, const int reg, const int rm) {
+    emitByte(jc, 0x48 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+}
+
+static void emitMemoryOperand(JitCompiler *jc, const bool wide, const uint8_t opcode, const int reg, const int base,
+                              const int32_t disp) {
+    if (wide) {
+        emitRex(jc, reg, base);
+    } else if ((reg | base) & 8) {
+        emitByte(jc, 0x40 | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0));
+    }
+    emitByte(jc, opcode);
+    const bool shortDisp = disp >= -128 && disp <= 127;
+    emitByte(jc, (shortDisp ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        // rsp and r12 need a SIB byte
+        emitByte(jc, 0x24);
+    }
+    if (shortDisp) {
+        emitByte(jc, (uint8_t) disp);
+    } else {
+        emit32(jc, (uint32_t) disp);
+    }
+}
+
+// op reg, [base + disp] (or the other way round, depending on the opcode) on 64 bits
+static void emitMemory(JitCompiler *jc, const uint8_t opcode, const int reg, const int base, const int32_t disp) {
+    emitMemoryOperand(jc, true, opcode, reg, base, disp);
+}
+
+// the same on 32 bits, for the int fields of the runtime structs
+static void emitMemory32(JitCompiler *jc, const uint8_t opcode, const int reg, const int base, const int32_t disp) {
+    emitMemoryOperand(jc, false, opcode, reg, base, disp);
+}
+
+// cmp dword [base + disp], value
+static void emitCompareMemory32(JitCompiler *jc, const int base, const int32_t disp, const int32_t value) {
+    emitMemoryOperand(jc, false, 0x81, 7, base, disp);
+    emit32(jc, (uint32_t) value);
+}
+
+// inc or dec dword [base + disp]
+static void emitIncrement32(JitCompiler *jc, const int base, const int32_t disp, const bool decrement) {
+    emitMemoryOperand(jc, false, 0xFF, decrement ? 1 : 0, base, disp);
+}
+
+// op rm, reg
+static void emitRegister(JitCompiler *jc, const uint8_t opcode, const int reg, const int rm) {
+    emitRex(jc, reg, rm);
+    emitByte(jc, opcode);
+    emitByte(jc, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void emitImmediate(JitCompiler *jc, const int extension, const int reg, const int8_t value) {
+    emitRex(jc, 0, reg);
+    emitByte(jc, 0x83);
+    emitByte(jc, 0xC0 | (extension << 3) | (reg & 7));
+    emitByte(jc, (uint8_t) value);
+}
+
+static void emitMoveImmediate(JitCompiler *jc, const int reg, const uint64_t value) {
+    emitRex(jc, 0, reg);
+    emitByte(jc, 0xB8 + (reg & 7));
+    emit64(jc, value);
+}
+
+static void emitMoveImmediate32(JitCompiler *jc, const int reg, const uint32_t value) {
+    emitByte(jc, 0xB8 + reg);
+    emit32(jc, value);
+}
+
+static void emitCallHelper(JitCompiler *jc, const void *function) {
+    emitMoveImmediate(jc, RAX, (uint64_t) (uintptr_t) function);
+    // call rax
+    EMIT(jc, 0xFF, 0xD0);
+}
+
+/**
+ * jmp or jcc with a 32 bit displacement
+ * @return position of the displacement, for patchJump
+ */
+static int emitJump(JitCompiler *jc, const int condition) {
+    if (condition == CC_ALWAYS) {
+        emitByte(jc, 0xE9);
+    } else {
+        EMIT(jc, 0x0F, 0x80 + condition);
+    }
+    emit32(jc, 0);
+    return jc->count - 4;
+}
+
+static void patchJump(JitCompiler *jc, const int position, const int target) {
+    const int32_t displacement = target - (position + 4);
+    memcpy(jc->code + position, &displacement, sizeof(displacement));
+}
+
+static void patchJumpHere(JitCompiler *jc, const int position) {
+    patchJump(jc, position, jc->count);
+}
+
+static void emitJumpTo(JitCompiler *jc, const int condition, const int target) {
+    patchJump(jc, emitJump(jc, condition), target);
+}
+
+// a jump to the native code of the instruction at bytecode offset `target`
+static void emitBytecodeJump(JitCompiler *jc, const int condition, const int target) {
+    if (jc->fixupCount == jc->fixupCapacity) {
+        jc->fixupCapacity = jc->fixupCapacity < 16 ? 16 : jc->fixupCapacity * 2;
+        jc->fixups = realloc(jc->fixups, sizeof(JumpFixup) * jc->fixupCapacity);
+        if (jc->fixups == NULL) {
+            exit(1);
+        }
+    }
+    jc->fixups[jc->fixupCount].position = emitJump(jc, condition);
+    jc->fixups[jc->fixupCount].target = target;
+    jc->fixupCount++;
+}
+
+// stack slots relative to rbx, 0 is the top value
+static int32_t stackSlot(const int distance) {
+    return (int32_t) (-8 * (distance + 1));
+}
+
+static void emitPush(JitCompiler *jc, const int reg) {
+    emitMemory(jc, X86_STORE, reg, RBX, 0);
+    emitImmediate(jc, X86_ADD_IMM, RBX, 8);
+}
+
+static void emitPushConstant(JitCompiler *jc, const Value value) {
+    emitMoveImmediate(jc, RAX, value);
+    emitPush(jc, RAX);
+}
+
+// jump if the value in `reg` is not a number. clobbers rdx
+static int emitNotNumber(JitCompiler *jc, const int reg) {
+    emitRegister(jc, X86_STORE, reg, RDX);
+    emitRegister(jc, X86_AND, R13, RDX);
+    emitRegister(jc, X86_CMP, R13, RDX);
+    return emitJump(jc, CC_E);
+}
+
+// turn the flag in al into a lox boolean in rax
+static void emitBoolean(JitCompiler *jc) {
+    // movzx eax, al
+    EMIT(jc, 0x0F, 0xB6, 0xC0);
+    // FALSE_VAL is QNAN | 2 and TRUE_VAL is QNAN | 3
+    emitRegister(jc, X86_OR, R13, RAX);
+    emitImmediate(jc, X86_OR_IMM, RAX, 2);
+}
+
+// write ip and sp back, as the interpreter does before it calls out
+static void emitSpill(JitCompiler *jc, const uint8_t *next) {
+    emitMoveImmediate(jc, RAX, (uint64_t) (uintptr_t) next);
+    emitMemory(jc, X86_STORE, RAX, R14, offsetof(CallFrame, ip));
+    emitMemory(jc, X86_STORE, RBX, R15, offsetof(VM, stackTop));
+}
+
+/**
+ * the write barrier of memory.h, for a store into the object in `reg`. the call is
+ * rare: outside a major marking an object is remembered once per minor collection.
+ * keeps `reg` and clobbers the other caller saved registers
+ */
+static void emitWriteBarrier(JitCompiler *jc, const int reg) {
+    // cmp word [reg + isOld], 1: isOld and isRemembered as one word, old and not remembered
+    emitByte(jc, 0x66);
+    emitMemoryOperand(jc, false, 0x81, 7, reg, offsetof(Obj, isOld));
+    EMIT(jc, 0x01, 0x00);
+    const int remember = emitJump(jc, CC_E);
+    emitCompareMemory32(jc, R15, offsetof(VM, gcPhase), GC_MARK);
+    const int skip = emitJump(jc, CC_NE);
+    patchJumpHere(jc, remember);
+    // push reg twice, which keeps the stack aligned for the call
+    for (int i = 0; i < 2; i++) {
+        if (reg & 8) {
+            emitByte(jc, 0x41);
+        }
+        emitByte(jc, 0x50 + (reg & 7));
+    }
+    emitRegister(jc, X86_STORE, reg, RDI);
+    emitCallHelper(jc, writeBarrierSlow);
+    for (int i = 0; i < 2; i++) {
+        if (reg & 8) {
+            emitByte(jc, 0x41);
+        }
+        emitByte(jc, 0x58 + (reg & 7));
+    }
+    patchJumpHere(jc, skip);
+}
+
+// call a helper returning a JitStatus, leave unless it is JIT_NEXT and reload sp
+static void emitHelper(JitCompiler *jc, const void *helper) {
+    emitCallHelper(jc, helper);
+    // test eax, eax
+    EMIT(jc, 0x85, 0xC0);
+    emitJumpTo(jc, CC_NE, jc->exit);
+    emitMemory(jc, X86_LOAD, RBX, R15, offsetof(VM, stackTop));
+}
+
+// a helper that always leaves, with its status
+static void emitHelperExit(JitCompiler *jc, const void *helper) {
+    emitCallHelper(jc, helper);
+    emitJumpTo(jc, CC_ALWAYS, jc->exit);
+}
+
+// --------------------------------------------------------------------------------
+// slow paths, called from the native code with ip and sp spilled
+// --------------------------------------------------------------------------------
+
+static JitStatus numbersError() {
+    runtimeError("Operands must be numbers.");
+    return JIT_ERROR;
+}
+
+static JitStatus numberError() {
+    runtimeError("Operand must be a number.");
+    return JIT_ERROR;
+}
+
+static JitStatus undefinedVariable(const int slot) {
+    runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+    return JIT_ERROR;
+}
+
+static JitStatus opAdd() {
+    if (IS_STRING(vm.stackTop[-1]) && IS_STRING(vm.stackTop[-2])) {
+        concatenate();
+        return JIT_NEXT;
+    }
+    runtimeError("Operands must be two numbers or two strings.");
+    return JIT_ERROR;
+}
+
+static void opPrint(const Value value) {
+    printValue(value);
+    printf("\n");
+}
+
+static JitStatus opGetProperty(ObjString *name, InlineCache *cache) {
+    const Value receiver = vm.stackTop[-1];
+    if (!IS_INSTANCE(receiver)) {
+        runtimeError("Only instances have properties.");
+        return JIT_ERROR;
+    }
+    const ObjInstance *instance = AS_INSTANCE(receiver);
+    const InlineCacheEntry *entry = findCacheEntry(cache, instance->shape, instance->klass);
+    Value method;
+    if (entry != NULL && entry->index >= 0) {
+        vm.stackTop[-1] = instance->fields[entry->index];
+        return JIT_NEXT;
+    }
+    if (entry != NULL) {
+        method = entry->method;
+    } else {
+        const int slot = shapeSlot(instance->shape, name);
+        if (slot != -1) {
+            fillCacheEntry(cache, instance->shape, NULL, instance->klass, slot, NIL_VAL);
+            vm.stackTop[-1] = instance->fields[slot];
+            return JIT_NEXT;
+        }
+        if (!tableGet(&instance->klass->methods, name, &method)) {
+            runtimeError("Undefined property '%s'.", name->chars);
+            return JIT_ERROR;
+        }
+        fillCacheEntry(cache, instance->shape, NULL, instance->klass, -1, method);
+    }
+    // the receiver stays on the stack while the bound method is allocated
+    ObjBoundMethod *bound = bindReceiver(receiver, AS_CLOSURE(method));
+    vm.stackTop[-1] = OBJ_VAL(bound);
+    return JIT_NEXT;
+}
+
+static JitStatus opSetProperty(ObjString *name, InlineCache *cache) {
+    if (!IS_INSTANCE(vm.stackTop[-2])) {
+        runtimeError("Only instances have fields.");
+        return JIT_ERROR;
+    }
+    ObjInstance *instance = AS_INSTANCE(vm.stackTop[-2]);
+    const InlineCacheEntry *entry = findCacheEntry(cache, instance->shape, instance->klass);
+    if (entry != NULL && entry->transition == NULL) {
+        instance->fields[entry->index] = vm.stackTop[-1];
+        writeBarrier((Obj *) instance);
+    } else if (entry != NULL && entry->index < instance->fieldCapacity) {
+        instance->fields[entry->index] = vm.stackTop[-1];
+        instance->shape = (ObjShape *) entry->transition;
+        writeBarrier((Obj *) instance);
+    } else {
+        const ObjShape *shape = instance->shape;
+        const int slot = setField(instance, name, vm.stackTop[-1]);
+        fillCacheEntry(cache, shape, shape != instance->shape ? instance->shape : NULL,
+                       instance->klass, slot, NIL_VAL);
+    }
+    const Value value = pop();
+    vm.stackTop[-1] = value;
+    return JIT_NEXT;
+}
+
+static JitStatus opGetSuper(const ObjString *name) {
+    const ObjClass *superclass = AS_CLASS(pop());
+    return bindMethod(superclass, name) ? JIT_NEXT : JIT_ERROR;
+}
+
+static JitStatus enterFrame(CallFrame *frame) {
+    const JitCode *jit = frame->closure->function->jit;
+    const JitEntry entry = (JitEntry) (void *) jit->code;
+    const int offset = (int) (frame->ip - frame->closure->function->chunk.code);
+    return (JitStatus) entry(frame, jit->code + jit->entries[offset]);
+}
+
+/**
+ * after a call: a frame pushed for a compiled callee runs right away, nested on the
+ * C stack, so a call between compiled functions does not go through run(). anything
+ * else leaves to the interpreter, which resumes this frame after the callee returned.
+ * @param frames vm.frameCount before the call
+ */
+static JitStatus enterCallee(const int frames) {
+    if (vm.frameCount == frames) {
+        // a native or a class without an initializer, the result is on the stack
+        return JIT_NEXT;
+    }
+    CallFrame *callee = &vm.frames[vm.frameCount - 1];
+    if (callee->closure->function->jit == NULL || nesting == JIT_NESTING_MAX) {
+        return JIT_EXIT;
+    }
+    nesting++;
+    const JitStatus status = enterFrame(callee);
+    nesting--;
+    return status == JIT_RETURN ? JIT_NEXT : status;
+}
+
+static JitStatus opCall(const int argCount) {
+    const int frames = vm.frameCount;
+    if (!callValue(vm.stackTop[-1 - argCount], argCount)) {
+        return JIT_ERROR;
+    }
+    return enterCallee(frames);
+}
+
+// where the native code of a tail call goes on, set by opTailCall
+static const uint8_t *tailCallTarget = NULL;
+
+/**
+ * a closure called in tail position takes over the top frame. its native code is jumped
+ * to with the registers as they are, the frame and its slots stay the same. natives and
+ * classes are called as usual, the native code goes on after the instruction
+ */
+static JitStatus opTailCall(const int argCount) {
+    const int frames = vm.frameCount;
+    const Value callee = vm.stackTop[-1 - argCount];
+    if (!tailCall(argCount)) {
+        return JIT_ERROR;
+    }
+    const CallFrame *frame = &vm.frames[frames - 1];
+    if (IS_CLOSURE(callee) || IS_BOUND_METHOD(callee)) {
+        if (frame->closure->function->jit == NULL) {
+            return JIT_EXIT;
+        }
+    } else {
+        const JitStatus status = enterCallee(frames);
+        if (status != JIT_NEXT) {
+            return status;
+        }
+    }
+    const JitCode *jit = frame->closure->function->jit;
+    tailCallTarget = jit->code + jit->entries[frame->ip - frame->closure->function->chunk.code];
+    return JIT_NEXT;
+}
+
+static JitStatus opInvoke(const ObjString *name, const int argCount, InlineCache *cache) {
+    const int frames = vm.frameCount;
+    const Value receiver = vm.stackTop[-1 - argCount];
+    if (IS_INSTANCE(receiver)) {
+        const ObjInstance *instance = AS_INSTANCE(receiver);
+        const InlineCacheEntry *entry = findCacheEntry(cache, instance->shape, instance->klass);
+        if (entry != NULL) {
+            Value callee = entry->method;
+            if (entry->index >= 0) {
+                // the callable field replaces the receiver
+                callee = instance->fields[entry->index];
+                vm.stackTop[-1 - argCount] = callee;
+            }
+            if (!callValue(callee, argCount)) {
+                return JIT_ERROR;
+            }
+            return enterCallee(frames);
+        }
+    }
+    if (!invoke(name, argCount, cache)) {
+        return JIT_ERROR;
+    }
+    return enterCallee(frames);
+}
+
+static JitStatus opSuperInvoke(const ObjString *name, const int argCount) {
+    const ObjClass *superclass = AS_CLASS(pop());
+    const int frames = vm.frameCount;
+    if (!invokeFromClass(superclass, name, argCount)) {
+        return JIT_ERROR;
+    }
+    return enterCallee(frames);
+}
+
+static JitStatus opClosure(ObjFunction *function, const uint8_t *operands) {
+    const CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    ObjClosure *closure = newClosure(function);
+    push(OBJ_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        const uint8_t isLocal = operands[2 * i];
+        const uint8_t index = operands[2 * i + 1];
+        if (isLocal) {
+            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+    }
+    writeBarrier((Obj *) closure);
+    return JIT_NEXT;
+}
+
+static JitStatus opReturn() {
+    const Value result = pop();
+    const CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    closeUpvalues(frame->slots);
+    vm.frameCount--;
+    if (vm.frameCount == 0) {
+        // the script closure
+        pop();
+        return JIT_DONE;
+    }
+    vm.stackTop = frame->slots;
+    push(result);
+    return JIT_RETURN;
+}
+
+// --------------------------------------------------------------------------------
+// instruction templates
+// --------------------------------------------------------------------------------
+
+static uint16_t readShort(const JitCompiler *jc, const int offset) {
+    return (uint16_t) ((jc->chunk->code[offset] << 8) | jc->chunk->code[offset + 1]);
+}
+
+static void emitPrologue(JitCompiler *jc) {
+    // entry(frame, target): save the callee saved registers, 6 pushes and one more
+    // slot keep rsp 16 byte aligned for the helper calls
+    EMIT(jc, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+    emitImmediate(jc, X86_SUB_IMM, RSP, 8);
+    emitRegister(jc, X86_STORE, RDI, R14);
+    emitMoveImmediate(jc, R15, (uint64_t) (uintptr_t) &vm);
+    emitMoveImmediate(jc, R13, QNAN);
+    emitMemory(jc, X86_LOAD, R12, R14, offsetof(CallFrame, slots));
+    emitMemory(jc, X86_LOAD, RBX, R15, offsetof(VM, stackTop));
+    // jmp rsi
+    EMIT(jc, 0xFF, 0xE6);
+
+    jc->exit = jc->count;
+    emitImmediate(jc, X86_ADD_IMM, RSP, 8);
+    EMIT(jc, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B);
+    // ret
+    emitByte(jc, 0xC3);
+}
+
+// load the two operands of a binary instruction, a into rax and b into rcx
+static void emitLoadOperands(JitCompiler *jc) {
+    emitMemory(jc, X86_LOAD, RAX, RBX, stackSlot(1));
+    emitMemory(jc, X86_LOAD, RCX, RBX, stackSlot(0));
+}
+
+// the number operands in rax and rcx, into xmm0 and xmm1
+static void emitNumberOperands(JitCompiler *jc, int *slow) {
+    slow[0] = emitNotNumber(jc, RAX);
+    slow[1] = emitNotNumber(jc, RCX);
+    // movq xmm0, rax; movq xmm1, rcx
+    EMIT(jc, 0x66, 0x48, 0x0F, 0x6E, 0xC0);
+    EMIT(jc, 0x66, 0x48, 0x0F, 0x6E, 0xC9);
+}
+
+// ucomisd of the operands, swapped compares b with a
+static void emitCompare(JitCompiler *jc, const bool swapped) {
+    EMIT(jc, 0x66, 0x0F, 0x2E, swapped ? 0xC8 : 0xC1);
+}
+
+/*
+ * a comparison as ucomisd and a condition. the "a >= b is !(a < b)" rule of the
+ * interpreter holds, so comparisons with NaN give the same result
+ */
+typedef struct {
+    bool swapped;
+    int condition;
+} Comparison;
+
+static Comparison comparison(const uint8_t instruction) {
+    switch (instruction) {
+        case OP_GREATER: return (Comparison) {false, CC_A};
+        case OP_GREATER_EQUAL: return (Comparison) {true, CC_BE};
+        case OP_LESS: return (Comparison) {true, CC_A};
+        case OP_LESS_EQUAL: return (Comparison) {false, CC_BE};
+        // the compare-and-branch forms give the condition to jump on
+        case OP_JUMP_IF_NOT_GREATER: return (Comparison) {false, CC_BE};
+        case OP_JUMP_IF_NOT_GREATER_EQUAL: return (Comparison) {true, CC_A};
+        case OP_JUMP_IF_NOT_LESS: return (Comparison) {true, CC_BE};
+        case OP_JUMP_IF_NOT_LESS_EQUAL: return (Comparison) {false, CC_A};
+        default: return (Comparison) {false, CC_ALWAYS};
+    }
+}
+
+// the slow path of a number instruction, only reached with an operand of another type
+static void emitNumberSlowPath(JitCompiler *jc, const int *slow, const int count, const uint8_t *next,
+                               const void *helper) {
+    const int done = emitJump(jc, CC_ALWAYS);
+    for (int i = 0; i < count; i++) {
+        patchJumpHere(jc, slow[i]);
+    }
+    emitSpill(jc, next);
+    emitHelper(jc, helper);
+    patchJumpHere(jc, done);
+}
+
+static void emitArithmetic(JitCompiler *jc, const uint8_t instruction, const uint8_t *next) {
+    int slow[2];
+    emitLoadOperands(jc);
+    emitNumberOperands(jc, slow);
+    switch (instruction) {
+        case OP_ADD: EMIT(jc, 0xF2, 0x0F, 0x58, 0xC1); break;
+        case OP_SUBTRACT: EMIT(jc, 0xF2, 0x0F, 0x5C, 0xC1); break;
+        case OP_MULTIPLY: EMIT(jc, 0xF2, 0x0F, 0x59, 0xC1); break;
+        default: EMIT(jc, 0xF2, 0x0F, 0x5E, 0xC1); break;
+    }
+    // movq rax, xmm0
+    EMIT(jc, 0x66, 0x48, 0x0F, 0x7E, 0xC0);
+    emitMemory(jc, X86_STORE, RAX, RBX, stackSlot(1));
+    emitImmediate(jc, X86_SUB_IMM, RBX, 8);
+    emitNumberSlowPath(jc, slow, 2, next, instruction == OP_ADD ? (void *) opAdd : (void *) numbersError);
+}
+
+static void emitComparison(JitCompiler *jc, const uint8_t instruction, const uint8_t *next) {
+    int slow[2];
+    const Comparison compare = comparison(instruction);
+    emitLoadOperands(jc);
+    emitNumberOperands(jc, slow);
+    emitCompare(jc, compare.swapped);
+    // setcc al
+    EMIT(jc, 0x0F, 0x90 + compare.condition, 0xC0);
+    emitBoolean(jc);
+    emitMemory(jc, X86_STORE, RAX, RBX, stackSlot(1));
+    emitImmediate(jc, X86_SUB_IMM, RBX, 8);
+    emitNumberSlowPath(jc, slow, 2, next, numbersError);
+}
+
+static void emitCompareJump(JitCompiler *jc, const uint8_t instruction, const uint8_t *next, const int target) {
+    int slow[2];
+    const Comparison compare = comparison(instruction);
+    emitLoadOperands(jc);
+    emitNumberOperands(jc, slow);
+    emitImmediate(jc, X86_SUB_IMM, RBX, 16);
+    emitCompare(jc, compare.swapped);
+    emitBytecodeJump(jc, compare.condition, target);
+    // only errors, so the slow path never falls through
+    const int done = emitJump(jc, CC_ALWAYS);
+    for (int i = 0; i < 2; i++) {
+        patchJumpHere(jc, slow[i]);
+    }
+    emitSpill(jc, next);
+    emitHelperExit(jc, numbersError);
+    patchJumpHere(jc, done);
+}
+
+// valuesEqual of the two operands into al, popping both
+static void emitEqual(JitCompiler *jc) {
+    emitMemory(jc, X86_LOAD, RDI, RBX, stackSlot(1));
+    emitMemory(jc, X86_LOAD, RSI, RBX, stackSlot(0));
+    emitImmediate(jc, X86_SUB_IMM, RBX, 16);
+    emitCallHelper(jc, valuesEqual);
+}
+
+// jump to `target` if the value in rax is nil or false
+static void emitJumpIfFalsey(JitCompiler *jc, const int target) {
+    emitMoveImmediate(jc, RCX, NIL_VAL);
+    emitRegister(jc, X86_CMP, RCX, RAX);
+    emitBytecodeJump(jc, CC_E, target);
+    emitMoveImmediate(jc, RCX, FALSE_VAL);
+    emitRegister(jc, X86_CMP, RCX, RAX);
+    emitBytecodeJump(jc, CC_E, target);
+}
+
+/**
+ * untag the object in rax and check its type
+ * @param slow receives the two jumps taken for another value
+ */
+static void emitObjectOfType(JitCompiler *jc, const ObjType type, int *slow) {
+    emitMoveImmediate(jc, RDX, SIGN_BIT | QNAN);
+    emitRegister(jc, X86_STORE, RAX, RCX);
+    emitRegister(jc, X86_AND, RDX, RCX);
+    emitRegister(jc, X86_CMP, RDX, RCX);
+    slow[0] = emitJump(jc, CC_NE);
+    // not rdx; and rax, rdx
+    EMIT(jc, 0x48, 0xF7, 0xD2);
+    emitRegister(jc, X86_AND, RDX, RAX);
+    emitCompareMemory32(jc, RAX, offsetof(Obj, type), type);
+    slow[1] = emitJump(jc, CC_NE);
+}
+
+static void emitGetProperty(JitCompiler *jc, ObjString *name, InlineCache *cache, const uint8_t *next) {
+    int slow[4];
+    // the field of the first cached shape is loaded inline
+    emitMemory(jc, X86_LOAD, RAX, RBX, stackSlot(0));
+    emitObjectOfType(jc, OBJ_INSTANCE, slow);
+    emitMemory(jc, X86_LOAD, RCX, RAX, offsetof(ObjInstance, shape));
+    emitMoveImmediate(jc, RDX, (uint64_t) (uintptr_t) &cache->entries[0]);
+    emitMemory(jc, X86_CMP_LOAD, RCX, RDX, offsetof(InlineCacheEntry, shape));
+    slow[2] = emitJump(jc, CC_NE);
+    emitMemory(jc, X86_MOVSXD, RCX, RDX, offsetof(InlineCacheEntry, index));
+    emitRegister(jc, X86_TEST, RCX, RCX);
+    slow[3] = emitJump(jc, CC_S);
+    emitMemory(jc, X86_LOAD, RAX, RAX, offsetof(ObjInstance, fields));
+    // mov rax, [rax + rcx * 8]
+    EMIT(jc, 0x48, 0x8B, 0x04, 0xC8);
+    emitMemory(jc, X86_STORE, RAX, RBX, stackSlot(0));
+    const int done = emitJump(jc, CC_ALWAYS);
+    for (int i = 0; i < 4; i++) {
+        patchJumpHere(jc, slow[i]);
+    }
+    emitSpill(jc, next);
+    emitMoveImmediate(jc, RDI, (uint64_t) (uintptr_t) name);
+    emitMoveImmediate(jc, RSI, (uint64_t) (uintptr_t) cache);
+    emitHelper(jc, opGetProperty);
+    patchJumpHere(jc, done);
+}
+
+static void emitSetProperty(JitCompiler *jc, ObjString *name, InlineCache *cache, const uint8_t *next) {
+    int slow[5];
+    // stores to the first cached shape run inline, an added field needs room in the instance
+    emitMemory(jc, X86_LOAD, RAX, RBX, stackSlot(1));
+    emitObjectOfType(jc, OBJ_INSTANCE, slow);
+    emitWriteBarrier(jc, RAX);
+    emitMemory(jc, X86_LOAD, RCX, RAX, offsetof(ObjInstance, shape));
+    emitMoveImmediate(jc, RDX, (uint64_t) (uintptr_t) &cache->entries[0]);
+    emitMemory(jc, X86_CMP_LOAD, RCX, RDX, offsetof(InlineCacheEntry, shape));
+    slow[2] = emitJump(jc, CC_NE);
+    emitMemory(jc, X86_MOVSXD, RCX, RDX, offsetof(InlineCacheEntry, index));
+    emitRegister(jc, X86_TEST, RCX, RCX);
+    slow[3] = emitJump(jc, CC_S);
+    emitMemory(jc, X86_LOAD, RSI, RDX, offsetof(InlineCacheEntry, transition));
+    emitRegister(jc, X86_TEST, RSI, RSI);
+    const int store = emitJump(jc, CC_E);
+    emitMemory32(jc, X86_CMP_LOAD, RCX, RAX, offsetof(ObjInstance, fieldCapacity));
+    slow[4] = emitJump(jc, CC_GE);
+    emitMemory(jc, X86_STORE, RSI, RAX, offsetof(ObjInstance, shape));
+    patchJumpHere(jc, store);
+    emitMemory(jc, X86_LOAD, RAX, RAX, offsetof(ObjInstance, fields));
+    emitMemory(jc, X86_LOAD, RDX, RBX, stackSlot(0));
+    // mov [rax + rcx * 8], rdx
+    EMIT(jc, 0x48, 0x89, 0x14, 0xC8);
+    // the value replaces the instance
+    emitMemory(jc, X86_STORE, RDX, RBX, stackSlot(1));
+    emitImmediate(jc, X86_SUB_IMM, RBX, 8);
+    const int done = emitJump(jc, CC_ALWAYS);
+    for (int i = 0; i < 5; i++) {
+        patchJumpHere(jc, slow[i]);
+    }
+    emitSpill(jc, next);
+    emitMoveImmediate(jc, RDI, (uint64_t) (uintptr_t) name);
+    emitMoveImmediate(jc, RSI, (uint64_t) (uintptr_t) cache);
+    emitHelper(jc, opSetProperty);
+    patchJumpHere(jc, done);
+}
+
+/**
+ * call the closure in rax, ip and sp already spilled. a compiled callee with the right
+ * arity gets its frame pushed here and its native code called directly, like
+ * enterCallee does; anything else takes the slow path.
+ * @param slow receives the three jumps to the slow path
+ */
+static void emitCallClosure(JitCompiler *jc, const int argCount, int *slow) {
+    emitMemory(jc, X86_LOAD, RCX, RAX, offsetof(ObjClosure, function));
+    emitCompareMemory32(jc, RCX, offsetof(ObjFunction, arity), argCount);
+    slow[0] = emitJump(jc, CC_NE);
+    emitMemory(jc, X86_LOAD, RSI, RCX, offsetof(ObjFunction, jit));
+    emitRegister(jc, X86_TEST, RSI, RSI);
+    slow[1] = emitJump(jc, CC_E);
+    emitMoveImmediate(jc, RDX, (uint64_t) (uintptr_t) &nesting);
+    emitCompareMemory32(jc, RDX, 0, JIT_NESTING_MAX);
+    slow[2] = emitJump(jc, CC_GE);
+    emitIncrement32(jc, RDX, 0, false);
+    // the new frame, the frame stack commits more pages when it faults
+    emitMemory(jc, X86_MOVSXD, RDI, R15, offsetof(VM, frameCount));
+    // imul rdi, rdi, sizeof(CallFrame)
+    EMIT(jc, 0x48, 0x6B, 0xFF, (uint8_t) sizeof(CallFrame));
+    emitMemory(jc, X86_ADD_LOAD, RDI, R15, offsetof(VM, frames));
+    emitIncrement32(jc, R15, offsetof(VM, frameCount), false);
+    emitMemory(jc, X86_STORE, RAX, RDI, offsetof(CallFrame, closure));
+    emitMemory(jc, X86_LOAD, RDX, RCX, offsetof(ObjFunction, chunk) + offsetof(Chunk, code));
+    emitMemory(jc, X86_STORE, RDX, RDI, offsetof(CallFrame, ip));
+    emitMemory(jc, X86_LEA, RDX, RBX, stackSlot(argCount));
+    emitMemory(jc, X86_STORE, RDX, RDI, offsetof(CallFrame, slots));
+    // entry(frame, code + entries[0])
+    emitMemory(jc, X86_LOAD, RAX, RSI, offsetof(JitCode, code));
+    emitMemory(jc, X86_LOAD, RSI, RSI, offsetof(JitCode, entries));
+    emitMemory32(jc, X86_LOAD, RSI, RSI, 0);
+    emitRegister(jc, X86_ADD, RAX, RSI);
+    // call rax
+    EMIT(jc, 0xFF, 0xD0);
+    emitMoveImmediate(jc, RCX, (uint64_t) (uintptr_t) &nesting);
+    emitIncrement32(jc, RCX, 0, true);
+    // cmp eax, JIT_RETURN
+    EMIT(jc, 0x83, 0xF8, JIT_RETURN);
+    emitJumpTo(jc, CC_NE, jc->exit);
+    emitMemory(jc, X86_LOAD, RBX, R15, offsetof(VM, stackTop));
+}
+
+static void emitCall(JitCompiler *jc, const int argCount, const uint8_t *next) {
+    int slow[5];
+    emitSpill(jc, next);
+    emitMemory(jc, X86_LOAD, RAX, RBX, stackSlot(argCount));
+    emitObjectOfType(jc, OBJ_CLOSURE, slow);
+    emitCallClosure(jc, argCount, slow + 2);
+    const int done = emitJump(jc, CC_ALWAYS);
+    for (int i = 0; i < 5; i++) {
+        patchJumpHere(jc, slow[i]);
+    }
+    emitMoveImmediate32(jc, RDI, argCount);
+    emitHelper(jc, opCall);
+    patchJumpHere(jc, done);
+}
+
+static void emitInvoke(JitCompiler *jc, ObjString *name, const int argCount, InlineCache *cache, const uint8_t *next) {
+    int slow[8];
+    emitSpill(jc, next);
+    // a method cached for the receiver's shape as the first entry is called inline
+    emitMemory(jc, X86_LOAD, RAX, RBX, stackSlot(argCount));
+    emitObjectOfType(jc, OBJ_INSTANCE, slow);
+    emitMoveImmediate(jc, RDX, (uint64_t) (uintptr_t) &cache->entries[0]);
+    emitMemory(jc, X86_LOAD, RCX, RAX, offsetof(ObjInstance, shape));
+    emitMemory(jc, X86_CMP_LOAD, RCX, RDX, offsetof(InlineCacheEntry, shape));
+    slow[2] = emitJump(jc, CC_NE);
+    emitCompareMemory32(jc, RDX, offsetof(InlineCacheEntry, index), 0);
+    slow[3] = emitJump(jc, CC_GE);
+    emitMemory(jc, X86_LOAD, RCX, RAX, offsetof(ObjInstance, klass));
+    emitMemory32(jc, X86_LOAD, RCX, RCX, offsetof(ObjClass, version));
+    emitMemory32(jc, X86_CMP_LOAD, RCX, RDX, offsetof(InlineCacheEntry, version));
+    slow[4] = emitJump(jc, CC_NE);
+    emitMemory(jc, X86_LOAD, RAX, RDX, offsetof(InlineCacheEntry, method));
+    emitMoveImmediate(jc, RCX, ~(SIGN_BIT | QNAN));
+    emitRegister(jc, X86_AND, RCX, RAX);
+    emitCallClosure(jc, argCount, slow + 5);
+    const int done = emitJump(jc, CC_ALWAYS);
+    for (int i = 0; i < 8; i++) {
+        patchJumpHere(jc, slow[i]);
+    }
+    emitMoveImmediate(jc, RDI, (uint64_t) (uintptr_t) name);
+    emitMoveImmediate32(jc, RSI, argCount);
+    emitMoveImmediate(jc, RDX, (uint64_t) (uintptr_t) cache);
+    emitHelper(jc, opInvoke);
+    patchJumpHere(jc, done);
+}
+
+static void emitReturn(JitCompiler *jc, const uint8_t *next) {
+    int slow[2];
+    emitMemory(jc, X86_LOAD, RAX, RBX, stackSlot(0));
+    // upvalues to close, or the script returning, take the helper
+    emitMemory(jc, X86_LOAD, RCX, R15, offsetof(VM, openUpvalues));
+    emitRegister(jc, X86_TEST, RCX, RCX);
+    const int noUpvalues = emitJump(jc, CC_E);
+    emitMemory(jc, X86_LOAD, RCX, RCX, offsetof(ObjUpvalue, location));
+    emitRegister(jc, X86_CMP, R12, RCX);
+    slow[0] = emitJump(jc, CC_AE);
+    patchJumpHere(jc, noUpvalues);
+    emitCompareMemory32(jc, R15, offsetof(VM, frameCount), 1);
+    slow[1] = emitJump(jc, CC_E);
+    emitIncrement32(jc, R15, offsetof(VM, frameCount), true);
+    // the result replaces the callee
+    emitMemory(jc, X86_STORE, RAX, R12, 0);
+    emitMemory(jc, X86_LEA, RCX, R12, 8);
+    emitMemory(jc, X86_STORE, RCX, R15, offsetof(VM, stackTop));
+    emitMoveImmediate32(jc, RAX, JIT_RETURN);
+    emitJumpTo(jc, CC_ALWAYS, jc->exit);
+    for (int i = 0; i < 2; i++) {
+        patchJumpHere(jc, slow[i]);
+    }
+    emitSpill(jc, next);
+    emitHelperExit(jc, opReturn);
+}
+
+static void emitGlobalValues(JitCompiler *jc, const int reg) {
+    // the array grows when a later script declares more globals, so it is loaded every time
+    emitMemory(jc, X86_LOAD, reg, R15, offsetof(VM, globalValues) + offsetof(ValueArray, values));
+}
+
+// jump to the undefined variable error if the global in rax is not defined
+static void emitCheckDefined(JitCompiler *jc, const int slot, const uint8_t *next) {
+    emitMoveImmediate(jc, RDX, UNDEFINED_VAL);
+    emitRegister(jc, X86_CMP, RDX, RAX);
+    const int defined = emitJump(jc, CC_NE);
+    emitSpill(jc, next);
+    emitMoveImmediate32(jc, RDI, slot);
+    emitHelperExit(jc, undefinedVariable);
+    patchJumpHere(jc, defined);
+}
+
+/**
+ * emit the template of the instruction at `offset`
+ */
+static void emitInstruction(JitCompiler *jc, const int offset) {
+    const Chunk *chunk = jc->chunk;
+    const uint8_t *code = chunk->code;
+    const int next = offset + instructionLength(chunk, offset);
+    const uint8_t *nextIp = code + next;
+    const uint8_t instruction = plainInstruction(code[offset]);
+    switch (instruction) {
+        case OP_CONSTANT:
+            emitPushConstant(jc, chunk->constants.values[code[offset + 1]]);
+            return;
+        case OP_NIL:
+            emitPushConstant(jc, NIL_VAL);
+            return;
+        case OP_TRUE:
+            emitPushConstant(jc, TRUE_VAL);
+            return;
+        case OP_FALSE:
+            emitPushConstant(jc, FALSE_VAL);
+            return;
+        case OP_POP:
+            emitImmediate(jc, X86_SUB_IMM, RBX, 8);
+            return;
+        case OP_GET_LOCAL:
+            emitMemory(jc, X86_LOAD, RAX, R12, 8 * code[offset + 1]);
+            emitPush(jc, RAX);
+            return;
+        case OP_SET_LOCAL:
+            emitMemory(jc, X86_LOAD, RAX, RBX, stackSlot(0));
+            emitMemory(jc, X86_STORE, RAX, R12, 8 * code[offset + 1]);
+            return;
+        case OP_GET_GLOBAL_SLOT: {
+            const uint16_t slot = readShort(jc, offset + 1);
+            emitGlobalValues(jc, RCX);
+            emitMemory(jc, X86_LOAD, RAX, RCX, 8 * slot);
+            emitCheckDefined(jc, slot, nextIp);
+            emitPush(jc, RAX);
+            return;
+        }
+        case OP_DEFINE_GLOBAL_SLOT: {
+            const uint16_t slot = readShort(jc, offset + 1);
+            emitGlobalValues(jc, RCX);
+            emitMemory(jc, X86_LOAD, RAX, RBX, stackSlot(0));
+            emitMemory(jc, X86_STORE, RAX, RCX, 8 * slot);
+            emitImmediate(jc, X86_SUB_IMM, RBX, 8);
+            return;
+        }
+        case OP_SET_GLOBAL_SLOT: {
+            const uint16_t slot = readShort(jc, offset + 1);
+            emitGlobalValues(jc, RCX);
+            emitMemory(jc, X86_LOAD, RAX, RCX, 8 * slot);
+            emitCheckDefined(jc, slot, nextIp);
+            emitMemory(jc, X86_LOAD, RAX, RBX, stackSlot(0));
+            emitMemory(jc, X86_STORE, RAX, RCX, 8 * slot);
+            return;
+        }
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            emitMemory(jc, X86_LOAD, RAX, R14, offsetof(CallFrame, closure));
+            emitMemory(jc, X86_LOAD, RAX, RAX, offsetof(ObjClosure, upvalues));
+            emitMemory(jc, X86_LOAD, RAX, RAX, 8 * code[offset + 1]);
+            if (instruction == OP_SET_UPVALUE) {
+                emitWriteBarrier(jc, RAX);
+            }
+            emitMemory(jc, X86_LOAD, RAX, RAX, offsetof(ObjUpvalue, location));
+            if (instruction == OP_GET_UPVALUE) {
+                emitMemory(jc, X86_LOAD, RAX, RAX, 0);
+                emitPush(jc, RAX);
+            } else {
+                emitMemory(jc, X86_LOAD, RCX, RBX, stackSlot(0));
+                emitMemory(jc, X86_STORE, RCX, RAX, 0);
+            }
+            return;
+        case OP_GET_PROPERTY:
+            emitGetProperty(jc, AS_STRING(chunk->constants.values[code[offset + 1]]),
+                            &chunk->caches[readShort(jc, offset + 2)], nextIp);
+            return;
+        case OP_SET_PROPERTY:
+            emitSetProperty(jc, AS_STRING(chunk->constants.values[code[offset + 1]]),
+                            &chunk->caches[readShort(jc, offset + 2)], nextIp);
+            return;
+        case OP_GET_SUPER:
+            emitSpill(jc, nextIp);
+            emitMoveImmediate(jc, RDI, (uint64_t) (uintptr_t) AS_STRING(chunk->constants.values[code[offset + 1]]));
+            emitHelper(jc, opGetSuper);
+            return;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            emitEqual(jc);
+            if (instruction == OP_NOT_EQUAL) {
+                // xor al, 1
+                EMIT(jc, 0x34, 0x01);
+            }
+            emitBoolean(jc);
+            emitPush(jc, RAX);
+            return;
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+            emitComparison(jc, instruction, nextIp);
+            return;
+        case OP_ADD:
+            if (code[offset] == OP_ADD_STRING) {
+                // the interpreter has only seen strings here
+                emitSpill(jc, nextIp);
+                emitHelper(jc, opAdd);
+                return;
+            }
+            emitArithmetic(jc, OP_ADD, nextIp);
+            return;
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            emitArithmetic(jc, instruction, nextIp);
+            return;
+        case OP_NEGATE: {
+            int slow[1];
+            emitMemory(jc, X86_LOAD, RAX, RBX, stackSlot(0));
+            slow[0] = emitNotNumber(jc, RAX);
+            // btc rax, 63
+            EMIT(jc, 0x48, 0x0F, 0xBA, 0xF8, 0x3F);
+            emitMemory(jc, X86_STORE, RAX, RBX, stackSlot(0));
+            emitNumberSlowPath(jc, slow, 1, nextIp, numberError);
+            return;
+        }
+        case OP_NOT:
+            emitMemory(jc, X86_LOAD, RAX, RBX, stackSlot(0));
+            emitMoveImmediate(jc, RCX, NIL_VAL);
+            emitRegister(jc, X86_CMP, RCX, RAX);
+            // sete dl
+            EMIT(jc, 0x0F, 0x94, 0xC2);
+            emitMoveImmediate(jc, RCX, FALSE_VAL);
+            emitRegister(jc, X86_CMP, RCX, RAX);
+            // sete al; or al, dl
+            EMIT(jc, 0x0F, 0x94, 0xC0);
+            EMIT(jc, 0x08, 0xD0);
+            emitBoolean(jc);
+            emitMemory(jc, X86_STORE, RAX, RBX, stackSlot(0));
+            return;
+        case OP_PRINT:
+            emitMemory(jc, X86_LOAD, RDI, RBX, stackSlot(0));
+            emitImmediate(jc, X86_SUB_IMM, RBX, 8);
+            emitCallHelper(jc, opPrint);
+            return;
+        case OP_JUMP:
+            emitBytecodeJump(jc, CC_ALWAYS, next + readShort(jc, offset + 1));
+            return;
+        case OP_JUMP_IF_FALSE:
+            emitMemory(jc, X86_LOAD, RAX, RBX, stackSlot(0));
+            emitJumpIfFalsey(jc, next + readShort(jc, offset + 1));
+            return;
+        case OP_POP_JUMP_IF_FALSE:
+            emitMemory(jc, X86_LOAD, RAX, RBX, stackSlot(0));
+            emitImmediate(jc, X86_SUB_IMM, RBX, 8);
+            emitJumpIfFalsey(jc, next + readShort(jc, offset + 1));
+            return;
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+            emitEqual(jc);
+            // test al, al
+            EMIT(jc, 0x84, 0xC0);
+            emitBytecodeJump(jc, instruction == OP_JUMP_IF_EQUAL ? CC_NE : CC_E, next + readShort(jc, offset + 1));
+            return;
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+            emitCompareJump(jc, instruction, nextIp, next + readShort(jc, offset + 1));
+            return;
+        case OP_LOOP:
+            emitBytecodeJump(jc, CC_ALWAYS, next - readShort(jc, offset + 1));
+            return;
+        case OP_CALL:
+            emitCall(jc, code[offset + 1], nextIp);
+            return;
+        case OP_TAIL_CALL:
+            emitSpill(jc, nextIp);
+            emitMoveImmediate32(jc, RDI, code[offset + 1]);
+            emitHelper(jc, opTailCall);
+            // jmp [tailCallTarget]
+            emitMoveImmediate(jc, RAX, (uint64_t) (uintptr_t) &tailCallTarget);
+            EMIT(jc, 0xFF, 0x20);
+            return;
+        case OP_INVOKE:
+            emitInvoke(jc, AS_STRING(chunk->constants.values[code[offset + 1]]), code[offset + 2],
+                       &chunk->caches[readShort(jc, offset + 3)], nextIp);
+            return;
+        case OP_SUPER_INVOKE:
+            emitSpill(jc, nextIp);
+            emitMoveImmediate(jc, RDI, (uint64_t) (uintptr_t) AS_STRING(chunk->constants.values[code[offset + 1]]));
+            emitMoveImmediate32(jc, RSI, code[offset + 2]);
+            emitHelper(jc, opSuperInvoke);
+            return;
+        case OP_CLOSURE:
+            emitSpill(jc, nextIp);
+            emitMoveImmediate(jc, RDI, (uint64_t) (uintptr_t) AS_FUNCTION(chunk->constants.values[code[offset + 1]]));
+            emitMoveImmediate(jc, RSI, (uint64_t) (uintptr_t) (code + offset + 2));
+            emitHelper(jc, opClosure);
+            return;
+        case OP_CLOSE_UPVALUE:
+            // lea rdi, [rbx - 8]
+            emitMemory(jc, X86_LEA, RDI, RBX, stackSlot(0));
+            emitCallHelper(jc, closeUpvalues);
+            emitImmediate(jc, X86_SUB_IMM, RBX, 8);
+            return;
+        case OP_RETURN:
+            emitReturn(jc, nextIp);
+            return;
+        default:
+            // class definitions are left to the interpreter, it runs this instruction and
+            // hands the frame back at its next back-edge or return
+            emitSpill(jc, code + offset);
+            emitMoveImmediate32(jc, RAX, JIT_DEOPT);
+            emitJumpTo(jc, CC_ALWAYS, jc->exit);
+    }
+}
+
+static void freeCompiler(const JitCompiler *jc) {
+    free(jc->code);
+    free(jc->entries);
+    free(jc->fixups);
+    free(jc->exits);
+}
+
+/**
+ * copy the code to pages that are written once, then only executable
+ * @return NULL if the pages could not be mapped
+ */
+static uint8_t *installCode(const JitCompiler *jc) {
+    uint8_t *code = mmap(NULL, jc->count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        return NULL;
+    }
+    memcpy(code, jc->code, jc->count);
+    if (mprotect(code, jc->count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, jc->count);
+        return NULL;
+    }
+    return code;
+}
+
+/**
+ * translate the function to native code. instructions the jit does not handle
+ * leave the frame to the interpreter when they are reached
+ */
+void jitCompile(ObjFunction *function) {
+    const Chunk *chunk = &function->chunk;
+    JitCompiler jc;
+    memset(&jc, 0, sizeof(jc));
+    jc.chunk = chunk;
+    jc.entries = malloc(sizeof(uint32_t) * chunk->count);
+    if (jc.entries == NULL) {
+        exit(1);
+    }
+    // the interpreter never resumes a frame inside an instruction
+    memset(jc.entries, 0xFF, sizeof(uint32_t) * chunk->count);
+
+    emitPrologue(&jc);
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        jc.entries[offset] = (uint32_t) jc.count;
+        emitInstruction(&jc, offset);
+    }
+    for (int i = 0; i < jc.fixupCount; i++) {
+        patchJump(&jc, jc.fixups[i].position, (int) jc.entries[jc.fixups[i].target]);
+    }
+
+    uint8_t *code = installCode(&jc);
+    if (code == NULL) {
+        freeCompiler(&jc);
+        return;
+    }
+    JitCode *jit = malloc(sizeof(JitCode));
+    if (jit == NULL) {
+        exit(1);
+    }
+    jit->code = code;
+    jit->size = jc.count;
+    jit->entries = jc.entries;
+    jc.entries = NULL;
+    function->jit = jit;
+    freeCompiler(&jc);
+}
+
+/**
+ * run the compiled function of the top frame from its ip, until it leaves the frame
+ */
+JitStatus jitRun(CallFrame *frame) {
+    // calls nested before a stack overflow unwound them are gone
+    nesting = 0;
+    return enterFrame(frame);
+}
+
+void jitFree(ObjFunction *function) {
+#ifdef TRACE_JIT
+    while (function->traces != NULL) {
+        Trace *trace = function->traces;
+        function->traces = trace->next;
+        if (trace->code != NULL) {
+            munmap(trace->code, trace->size);
+        }
+        free(trace->objects);
+        free(trace);
+    }
+#endif
+    JitCode *jit = function->jit;
+    if (jit == NULL) {
+        return;
+    }
+    munmap(jit->code, jit->size);
+    free(jit->entries);
+    free(jit);
+    function->jit = NULL;
+}
+
+#ifdef TRACE_JIT
+// --------------------------------------------------------------------------------
+// trace jit
+// --------------------------------------------------------------------------------
+
+/*
+ * a hot loop is recorded while the interpreter runs one iteration of it: run()
+ * reports every instruction before executing it, with the values it is about to
+ * work on. the recording is a straight path through the loop, called functions
+ * included, and is lifted into the SSA form of ir.c, where
+ *   - each branch becomes a guard that it goes the recorded way,
+ *   - the number checks of the arithmetic are guards, dropped once a value is known,
+ *   - fields are loaded and stored at their slot in the recorded shape,
+ *   - the frame of a call is pushed inline and the trace goes on with the callee's code,
+ *   - the trace of an inner loop runs as a whole.
+ * the optimizer folds constants, shares common subexpressions and forwards stores,
+ * and peels one iteration off the loop so that what does not change in it only runs
+ * in the peeled copy. a guard that fails writes its snapshot back and leaves to the
+ * interpreter, which goes on at that instruction with every frame of the trace in place.
+ */
+
+// back-edge counters, loops that hash to the same one share it
+#define TRACE_COUNTERS 64
+
+typedef struct {
+    Trace *trace;
+    // frame of the loop, deeper frames belong to calls made in the trace
+    CallFrame *frame;
+    const uint8_t *header;
+    TraceRecord *records;
+    int count;
+    int capacity;
+    // opcode byte of a superinstruction run by the generic handler of its first
+    // component, which may quicken the byte
+    uint8_t *restore;
+    uint8_t restoreByte;
+} Recorder;
+
+static Recorder recorder;
+
+static uint8_t counters[TRACE_COUNTERS];
+
+static uint8_t *loopCounter(const uint8_t *header) {
+    return &counters[((uintptr_t) header >> 1) % TRACE_COUNTERS];
+}
+
+static Trace *findTrace(const ObjFunction *function, const int header) {
+    for (Trace *trace = function->traces; trace != NULL; trace = trace->next) {
+        if (trace->header == header) {
+            return trace;
+        }
+    }
+    return NULL;
+}
+
+static JitStatus runTrace(CallFrame *frame, const Trace *trace) {
+    const JitEntry entry = (JitEntry) (void *) trace->code;
+    return (JitStatus) entry(frame, trace->code + trace->start);
+}
+
+static void restoreSuperinstruction() {
+    if (recorder.restore != NULL) {
+        *recorder.restore = recorder.restoreByte;
+        recorder.restore = NULL;
+    }
+}
+
+static void stopRecording() {
+    restoreSuperinstruction();
+    free(recorder.records);
+    recorder.records = NULL;
+    recorder.count = 0;
+    recorder.capacity = 0;
+    recorder.trace = NULL;
+    vm.recording = false;
+}
+
+/**
+ * abandon the recording, the loop is recorded again once it is hot again
+ */
+void traceAbort() {
+    if (!vm.recording) {
+        return;
+    }
+    recorder.trace->aborts++;
+    *loopCounter(recorder.header) = 0;
+    stopRecording();
+}
+
+// --------------------------------------------------------------------------------
+// trace code generation
+// --------------------------------------------------------------------------------
+
+/*
+ * every value of the IR lives in its own 8 byte slot of the native stack frame,
+ * slots are reused once their value is dead. r12 and r14 stay on the loop's frame,
+ * the frame of an inlined call is addressed from r14 by its depth.
+ */
+typedef struct {
+    JitCompiler *jc;
+    const IR *ir;
+    // rsp offset of each value's slot
+    int32_t *slots;
+    int frameSize;
+    // number of uses of each value
+    int *uses;
+    // native offset of the loop
+    int loop;
+} TraceCompiler;
+
+static JitStatus opInstantiate(ObjClass *klass, const int argCount) {
+    // the class stays in the callee slot while the instance is allocated
+    vm.stackTop[-1 - argCount] = OBJ_VAL(newInstance(klass));
+    return JIT_NEXT;
+}
+
+static int32_t frameOffset(const int depth) {
+    return (int32_t) (depth * sizeof(CallFrame));
+}
+
+static void addExit(JitCompiler *jc, const int position, const int guard) {
+    if (jc->exitCount == jc->exitCapacity) {
+        jc->exitCapacity = jc->exitCapacity < 16 ? 16 : jc->exitCapacity * 2;
+        jc->exits = realloc(jc->exits, sizeof(TraceExit) * jc->exitCapacity);
+        if (jc->exits == NULL) {
+            exit(1);
+        }
+    }
+    jc->exits[jc->exitCount].position = position;
+    jc->exits[jc->exitCount].guard = guard;
+    jc->exitCount++;
+}
+
+// leave the trace through the snapshot of `ins` if `condition` holds
+static void emitExit(const TraceCompiler *tc, const int condition, const IRIns *ins) {
+    addExit(tc->jc, emitJump(tc->jc, condition), (int) (ins - tc->ir->code));
+}
+
+static void emitLoadRef(const TraceCompiler *tc, const int reg, const IRRef ref) {
+    const IRIns *ins = &tc->ir->code[ref];
+    if (ins->op == IR_CONST) {
+        emitMoveImmediate(tc->jc, reg, ins->type == IRT_POINTER ? (uint64_t) (uintptr_t) ins->pointer : ins->value);
+    } else {
+        emitMemory(tc->jc, X86_LOAD, reg, RSP, tc->slots[ref]);
+    }
+}
+
+static void emitStoreRef(const TraceCompiler *tc, const int reg, const IRRef ref) {
+    emitMemory(tc->jc, X86_STORE, reg, RSP, tc->slots[ref]);
+}
+
+static void emitUntag(JitCompiler *jc, const int reg) {
+    emitMoveImmediate(jc, RCX, ~(SIGN_BIT | QNAN));
+    emitRegister(jc, X86_AND, RCX, reg);
+}
+
+// the instance operand in rax, untagged
+static void emitLoadInstance(const TraceCompiler *tc, const IRRef ref) {
+    emitLoadRef(tc, RAX, ref);
+    emitUntag(tc->jc, RAX);
+}
+
+// push the virtual frames of the snapshot, the ip of the top one is written with the state
+static void emitFrames(const TraceCompiler *tc, const Snapshot *snapshot) {
+    JitCompiler *jc = tc->jc;
+    for (int i = 0; i < snapshot->virtuals; i++) {
+        const VirtualFrame *frame = &tc->ir->frames[snapshot->frameStart + i];
+        const int depth = snapshot->depth - snapshot->virtuals + 1 + i;
+        emitMoveImmediate(jc, RAX, (uint64_t) (uintptr_t) frame->ip);
+        emitMemory(jc, X86_STORE, RAX, R14, frameOffset(depth - 1) + offsetof(CallFrame, ip));
+        emitMoveImmediate(jc, RAX, (uint64_t) (uintptr_t) frame->closure);
+        emitMemory(jc, X86_STORE, RAX, R14, frameOffset(depth) + offsetof(CallFrame, closure));
+        emitMemory(jc, X86_LEA, RAX, R12, 8 * frame->base);
+        emitMemory(jc, X86_STORE, RAX, R14, frameOffset(depth) + offsetof(CallFrame, slots));
+    }
+    if (snapshot->virtuals > 0) {
+        // add dword [r15 + frameCount], virtuals
+        emitMemoryOperand(jc, false, 0x81, 0, R15, offsetof(VM, frameCount));
+        emit32(jc, (uint32_t) snapshot->virtuals);
+    }
+}
+
+/**
+ * write the snapshot's slots back
+ * @param state also the virtual frames, sp and the ip of the top frame, as the interpreter has them
+ */
+static void emitSnapshot(const TraceCompiler *tc, const int index, const bool state) {
+    JitCompiler *jc = tc->jc;
+    const Snapshot *snapshot = &tc->ir->snapshots[index];
+    for (int i = 0; i < snapshot->count; i++) {
+        const SnapshotEntry *entry = &tc->ir->entries[snapshot->start + i];
+        if (tc->ir->code[entry->ref].op == IR_SUNK) {
+            // a valid value for the collector, the exit builds the instance later
+            emitMoveImmediate(jc, RAX, NIL_VAL);
+        } else {
+            emitLoadRef(tc, RAX, entry->ref);
+        }
+        emitMemory(jc, X86_STORE, RAX, R12, 8 * entry->slot);
+    }
+    if (!state) {
+        return;
+    }
+    emitFrames(tc, snapshot);
+    emitMemory(jc, X86_LEA, RAX, R12, 8 * snapshot->top);
+    emitMemory(jc, X86_STORE, RAX, R15, offsetof(VM, stackTop));
+    emitMoveImmediate(jc, RAX, (uint64_t) (uintptr_t) snapshot->ip);
+    emitMemory(jc, X86_STORE, RAX, R14, frameOffset(snapshot->depth) + offsetof(CallFrame, ip));
+}
+
+static void opMaterialize(ObjClass *klass, ObjShape *shape, const int fieldCount, Value *slot) {
+    // the fields are on the stack while the instance is allocated
+    ObjInstance *instance = newInstance(klass);
+    instance->shape = shape;
+    vm.stackTop -= fieldCount;
+    memcpy(instance->fields, vm.stackTop, sizeof(Value) * fieldCount);
+    *slot = OBJ_VAL(instance);
+}
+
+/*
+ * a sunk instance of a snapshot, with the shape and fields the stores before the
+ * guard gave it
+ */
+typedef struct {
+    const IRIns *allocation;
+    int slot;
+    // slot of the same instance built for an earlier entry, -1 for none
+    int copy;
+    ObjShape *shape;
+    IRRef fields[INSTANCE_INLINE_FIELDS];
+} SunkInstance;
+
+/**
+ * build the sunk instances of the snapshot of `guard`. sp is written back already, the
+ * fields of all of them go on the stack first so that every allocation sees them
+ */
+static void emitMaterialize(const TraceCompiler *tc, const int guard) {
+    JitCompiler *jc = tc->jc;
+    const IR *ir = tc->ir;
+    const Snapshot *snapshot = &ir->snapshots[ir->code[guard].snapshot];
+    SunkInstance *instances = malloc(sizeof(SunkInstance) * (snapshot->count + 1));
+    if (instances == NULL) {
+        exit(1);
+    }
+    int count = 0;
+    int top = snapshot->top;
+    for (int i = 0; i < snapshot->count; i++) {
+        const SnapshotEntry *entry = &ir->entries[snapshot->start + i];
+        const IRIns *allocation = &ir->code[entry->ref];
+        if (allocation->op != IR_SUNK) {
+            continue;
+        }
+        SunkInstance *instance = &instances[count++];
+        memset(instance, 0, sizeof(SunkInstance));
+        instance->allocation = allocation;
+        instance->slot = entry->slot;
+        instance->copy = -1;
+        for (int j = 0; j < count - 1 && instance->copy < 0; j++) {
+            if (instances[j].allocation == allocation) {
+                instance->copy = instances[j].slot;
+            }
+        }
+        if (instance->copy >= 0) {
+            continue;
+        }
+        instance->shape = ((ObjClass *) allocation->pointer)->rootShape;
+        for (int ref = entry->ref + 1; ref < guard; ref++) {
+            const IRIns *store = &ir->code[ref];
+            if (store->op == IR_SET_SHAPE && store->a == entry->ref) {
+                instance->shape = store->pointer;
+            } else if (store->op == IR_FSTORE && store->a == entry->ref) {
+                instance->fields[store->aux] = store->b;
+            }
+        }
+        for (int field = 0; field < instance->shape->fieldCount; field++) {
+            if (instance->fields[field] == 0) {
+                emitMoveImmediate(jc, RAX, NIL_VAL);
+            } else {
+                emitLoadRef(tc, RAX, instance->fields[field]);
+            }
+            emitMemory(jc, X86_STORE, RAX, R12, 8 * top++);
+        }
+    }
+    if (count > 0) {
+        emitMemory(jc, X86_LEA, RAX, R12, 8 * top);
+        emitMemory(jc, X86_STORE, RAX, R15, offsetof(VM, stackTop));
+    }
+    // the last fields are on top
+    for (int i = count - 1; i >= 0; i--) {
+        const SunkInstance *instance = &instances[i];
+        if (instance->copy >= 0) {
+            continue;
+        }
+        emitMoveImmediate(jc, RDI, (uint64_t) (uintptr_t) instance->allocation->pointer);
+        emitMoveImmediate(jc, RSI, (uint64_t) (uintptr_t) instance->shape);
+        emitMoveImmediate32(jc, RDX, instance->shape->fieldCount);
+        emitMemory(jc, X86_LEA, RCX, R12, 8 * instance->slot);
+        emitCallHelper(jc, opMaterialize);
+    }
+    for (int i = 0; i < count; i++) {
+        if (instances[i].copy >= 0) {
+            emitMemory(jc, X86_LOAD, RAX, R12, 8 * instances[i].copy);
+            emitMemory(jc, X86_STORE, RAX, R12, 8 * instances[i].slot);
+        }
+    }
+    free(instances);
+}
+
+static void emitExitStubs(const TraceCompiler *tc) {
+    JitCompiler *jc = tc->jc;
+    for (int i = 0; i < jc->exitCount; i++) {
+        const int guard = jc->exits[i].guard;
+        patchJumpHere(jc, jc->exits[i].position);
+        emitSnapshot(tc, tc->ir->code[guard].snapshot, true);
+        emitMaterialize(tc, guard);
+        emitMoveImmediate32(jc, RAX, JIT_EXIT);
+        emitJumpTo(jc, CC_ALWAYS, jc->exit);
+    }
+}
+
+// the two number operands into xmm0 and xmm1
+static void emitLoadNumbers(const TraceCompiler *tc, const IRIns *ins) {
+    emitLoadRef(tc, RAX, ins->a);
+    emitLoadRef(tc, RCX, ins->b);
+    // movq xmm0, rax; movq xmm1, rcx
+    EMIT(tc->jc, 0x66, 0x48, 0x0F, 0x6E, 0xC0);
+    EMIT(tc->jc, 0x66, 0x48, 0x0F, 0x6E, 0xC9);
+}
+
+/**
+ * set the flags for a comparison or IR_EQ
+ * @return the condition code that holds if its result is true
+ */
+static int emitCondition(const TraceCompiler *tc, const IRIns *ins) {
+    JitCompiler *jc = tc->jc;
+    if (ins->op == IR_EQ) {
+        if (ins->aux) {
+            emitLoadNumbers(tc, ins);
+            // ucomisd xmm0, xmm1; sete al; setnp cl; and al, cl
+            EMIT(jc, 0x66, 0x0F, 0x2E, 0xC1);
+            EMIT(jc, 0x0F, 0x94, 0xC0);
+            EMIT(jc, 0x0F, 0x9B, 0xC1);
+            EMIT(jc, 0x20, 0xC8);
+        } else {
+            emitLoadRef(tc, RDI, ins->a);
+            emitLoadRef(tc, RSI, ins->b);
+            emitCallHelper(jc, valuesEqual);
+            // test al, al
+            EMIT(jc, 0x84, 0xC0);
+        }
+        return CC_NE;
+    }
+    static const uint8_t instructions[] = {
+        [IR_LT] = OP_LESS, [IR_LE] = OP_LESS_EQUAL, [IR_GT] = OP_GREATER, [IR_GE] = OP_GREATER_EQUAL,
+    };
+    const Comparison compare = comparison(instructions[ins->op]);
+    emitLoadNumbers(tc, ins);
+    emitCompare(jc, compare.swapped);
+    return compare.condition;
+}
+
+// a comparison only used by the guard right after it is compiled into the guard's jump
+static bool fusedCondition(const TraceCompiler *tc, const IRRef ref) {
+    const IRIns *ins = &tc->ir->code[ref];
+    if (ins->op < IR_LT || ins->op > IR_EQ || tc->uses[ref] != 1 || ref + 1 >= tc->ir->count) {
+        return false;
+    }
+    const IRIns *guard = &tc->ir->code[ref + 1];
+    return (guard->op == IR_CHECK_TRUTHY || guard->op == IR_CHECK_FALSEY) && guard->a == ref;
+}
+
+static void emitTruthGuard(const TraceCompiler *tc, const IRIns *ins) {
+    JitCompiler *jc = tc->jc;
+    const bool truthy = ins->op == IR_CHECK_TRUTHY;
+    if (fusedCondition(tc, ins->a)) {
+        const int condition = emitCondition(tc, &tc->ir->code[ins->a]);
+        // the opposite condition code has the low bit flipped
+        emitExit(tc, truthy ? condition ^ 1 : condition, ins);
+        return;
+    }
+    emitLoadRef(tc, RAX, ins->a);
+    if (ins->aux) {
+        emitMoveImmediate(jc, RCX, TRUE_VAL);
+        emitRegister(jc, X86_CMP, RCX, RAX);
+        emitExit(tc, truthy ? CC_NE : CC_E, ins);
+        return;
+    }
+    emitMoveImmediate(jc, RCX, NIL_VAL);
+    emitRegister(jc, X86_CMP, RCX, RAX);
+    if (truthy) {
+        emitExit(tc, CC_E, ins);
+        emitMoveImmediate(jc, RCX, FALSE_VAL);
+        emitRegister(jc, X86_CMP, RCX, RAX);
+        emitExit(tc, CC_E, ins);
+    } else {
+        const int falsey = emitJump(jc, CC_E);
+        emitMoveImmediate(jc, RCX, FALSE_VAL);
+        emitRegister(jc, X86_CMP, RCX, RAX);
+        emitExit(tc, CC_NE, ins);
+        patchJumpHere(jc, falsey);
+    }
+}
+
+static void emitShapeCheck(const TraceCompiler *tc, const IRIns *ins) {
+    JitCompiler *jc = tc->jc;
+    if (ins->aux) {
+        emitLoadInstance(tc, ins->a);
+    } else {
+        int slow[2];
+        emitLoadRef(tc, RAX, ins->a);
+        emitObjectOfType(jc, OBJ_INSTANCE, slow);
+        addExit(jc, slow[0], (int) (ins - tc->ir->code));
+        addExit(jc, slow[1], (int) (ins - tc->ir->code));
+    }
+    emitMoveImmediate(jc, RCX, (uint64_t) (uintptr_t) ins->pointer);
+    emitMemory(jc, X86_CMP_LOAD, RCX, RAX, offsetof(ObjInstance, shape));
+    emitExit(tc, CC_NE, ins);
+}
+
+// push the frame of an inlined call
+static void emitCallFrame(const TraceCompiler *tc, const IRIns *ins) {
+    JitCompiler *jc = tc->jc;
+    const ObjClosure *closure = ins->pointer;
+    const int32_t caller = frameOffset(ins->aux2 - 1);
+    const int32_t callee = frameOffset(ins->aux2);
+    if (ins->snapshot >= 0) {
+        emitFrames(tc, &tc->ir->snapshots[ins->snapshot]);
+    }
+    emitMoveImmediate(jc, RAX, (uint64_t) (uintptr_t) ins->ip);
+    emitMemory(jc, X86_STORE, RAX, R14, caller + offsetof(CallFrame, ip));
+    // the frame stack commits more pages when the new frame faults
+    emitIncrement32(jc, R15, offsetof(VM, frameCount), false);
+    emitMoveImmediate(jc, RAX, (uint64_t) (uintptr_t) closure);
+    emitMemory(jc, X86_STORE, RAX, R14, callee + offsetof(CallFrame, closure));
+    emitMoveImmediate(jc, RAX, (uint64_t) (uintptr_t) closure->function->chunk.code);
+    emitMemory(jc, X86_STORE, RAX, R14, callee + offsetof(CallFrame, ip));
+    emitMemory(jc, X86_LEA, RAX, R12, 8 * ins->aux);
+    emitMemory(jc, X86_STORE, RAX, R14, callee + offsetof(CallFrame, slots));
+}
+
+// pop the frame of an inlined call, closing its upvalues from the written back slots
+static void emitReturnFrame(const TraceCompiler *tc, const IRIns *ins) {
+    JitCompiler *jc = tc->jc;
+    emitMemory(jc, X86_LOAD, RCX, R15, offsetof(VM, openUpvalues));
+    emitRegister(jc, X86_TEST, RCX, RCX);
+    const int noUpvalues = emitJump(jc, CC_E);
+    emitMemory(jc, X86_LOAD, RCX, RCX, offsetof(ObjUpvalue, location));
+    emitMemory(jc, X86_LEA, RDX, R12, 8 * ins->aux);
+    emitRegister(jc, X86_CMP, RDX, RCX);
+    const int notOurs = emitJump(jc, CC_B);
+    emitSnapshot(tc, ins->snapshot, false);
+    emitMemory(jc, X86_LEA, RDI, R12, 8 * ins->aux);
+    emitCallHelper(jc, closeUpvalues);
+    patchJumpHere(jc, noUpvalues);
+    patchJumpHere(jc, notOurs);
+    emitIncrement32(jc, R15, offsetof(VM, frameCount), true);
+}
+
+// run the baseline template of the instruction, on the frame it belongs to
+static void emitFallback(const TraceCompiler *tc, const IRIns *ins) {
+    JitCompiler *jc = tc->jc;
+    const Snapshot *snapshot = &tc->ir->snapshots[ins->snapshot];
+    const ObjFunction *function = ins->pointer;
+    emitSnapshot(tc, ins->snapshot, true);
+    emitMemory(jc, X86_LEA, RBX, R12, 8 * snapshot->top);
+    if (snapshot->depth > 0) {
+        emitMemory(jc, X86_LEA, R14, R14, frameOffset(snapshot->depth));
+        emitMemory(jc, X86_LOAD, R12, R14, offsetof(CallFrame, slots));
+    }
+    jc->chunk = &function->chunk;
+    emitInstruction(jc, (int) (ins->ip - function->chunk.code));
+    if (snapshot->depth > 0) {
+        emitMemory(jc, X86_LEA, R14, R14, -frameOffset(snapshot->depth));
+        emitMemory(jc, X86_LOAD, R12, R14, offsetof(CallFrame, slots));
+    }
+}
+
+// run the trace of an inner loop, and go on if it left the loop where it did while recording
+static void emitLink(const TraceCompiler *tc, const IRIns *ins) {
+    JitCompiler *jc = tc->jc;
+    const Trace *inner = ins->pointer;
+    const int32_t frame = frameOffset(tc->ir->snapshots[ins->snapshot].depth);
+    emitSnapshot(tc, ins->snapshot, true);
+    emitMemory(jc, X86_LEA, RDI, R14, frame);
+    emitMoveImmediate(jc, RSI, (uint64_t) (uintptr_t) (inner->code + inner->start));
+    emitCallHelper(jc, inner->code);
+    // cmp eax, JIT_EXIT
+    EMIT(jc, 0x83, 0xF8, JIT_EXIT);
+    emitJumpTo(jc, CC_NE, jc->exit);
+    // the state is written back, so anything else leaves with JIT_EXIT as it is
+    emitMemory(jc, X86_MOVSXD, RCX, R15, offsetof(VM, frameCount));
+    // imul rcx, rcx, sizeof(CallFrame)
+    EMIT(jc, 0x48, 0x6B, 0xC9, (uint8_t) sizeof(CallFrame));
+    emitMemory(jc, X86_ADD_LOAD, RCX, R15, offsetof(VM, frames));
+    emitMemory(jc, X86_LEA, RCX, RCX, -(int32_t) sizeof(CallFrame));
+    emitMemory(jc, X86_LEA, RDX, R14, frame);
+    emitRegister(jc, X86_CMP, RDX, RCX);
+    emitJumpTo(jc, CC_NE, jc->exit);
+    emitMemory(jc, X86_LOAD, RCX, R14, frame + offsetof(CallFrame, ip));
+    emitMoveImmediate(jc, RDX, (uint64_t) (uintptr_t) ins->ip);
+    emitRegister(jc, X86_CMP, RDX, RCX);
+    emitJumpTo(jc, CC_NE, jc->exit);
+}
+
+// the back-edge: the phis move the loop's values into the refs of the first iteration
+static void emitPhis(const TraceCompiler *tc, const int32_t temporaries) {
+    JitCompiler *jc = tc->jc;
+    const IR *ir = tc->ir;
+    bool *left = calloc(ir->count, sizeof(bool));
+    if (left == NULL) {
+        exit(1);
+    }
+    for (int ref = ir->loop; ref < ir->count; ref++) {
+        if (ir->code[ref].op == IR_PHI) {
+            left[ir->code[ref].a] = true;
+        }
+    }
+    // values a phi overwrites are saved first, they all move at once
+    int32_t temporary = temporaries;
+    for (int ref = ir->loop; ref < ir->count; ref++) {
+        const IRIns *ins = &ir->code[ref];
+        if (ins->op == IR_PHI && left[ins->b]) {
+            emitLoadRef(tc, RAX, ins->b);
+            emitMemory(jc, X86_STORE, RAX, RSP, temporary);
+            temporary += 8;
+        }
+    }
+    temporary = temporaries;
+    for (int ref = ir->loop; ref < ir->count; ref++) {
+        const IRIns *ins = &ir->code[ref];
+        if (ins->op != IR_PHI) {
+            continue;
+        }
+        if (left[ins->b]) {
+            emitMemory(jc, X86_LOAD, RAX, RSP, temporary);
+            temporary += 8;
+        } else {
+            emitLoadRef(tc, RAX, ins->b);
+        }
+        emitStoreRef(tc, RAX, ins->a);
+    }
+    free(left);
+}
+
+static void emitTraceInstruction(TraceCompiler *tc, const IRRef ref) {
+    JitCompiler *jc = tc->jc;
+    const IRIns *ins = &tc->ir->code[ref];
+    switch (ins->op) {
+        case IR_SLOAD:
+            emitMemory(jc, X86_LOAD, RAX, R12, 8 * ins->aux);
+            break;
+        case IR_GLOAD:
+            emitGlobalValues(jc, RCX);
+            emitMemory(jc, X86_LOAD, RAX, RCX, 8 * ins->aux);
+            break;
+        case IR_FLOAD:
+            emitLoadInstance(tc, ins->a);
+            emitMemory(jc, X86_LOAD, RAX, RAX, offsetof(ObjInstance, fields));
+            emitMemory(jc, X86_LOAD, RAX, RAX, 8 * ins->aux);
+            break;
+        case IR_FRAME_CLOSURE:
+            emitMemory(jc, X86_LOAD, RAX, R14, offsetof(CallFrame, closure));
+            break;
+        case IR_UPVALUE:
+            emitLoadRef(tc, RAX, ins->a);
+            emitMemory(jc, X86_LOAD, RAX, RAX, offsetof(ObjClosure, upvalues));
+            emitMemory(jc, X86_LOAD, RAX, RAX, 8 * ins->aux);
+            break;
+        case IR_ULOAD:
+            emitLoadRef(tc, RAX, ins->a);
+            emitMemory(jc, X86_LOAD, RAX, RAX, offsetof(ObjUpvalue, location));
+            emitMemory(jc, X86_LOAD, RAX, RAX, 0);
+            break;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV: {
+            static const uint8_t opcodes[] = {[IR_ADD] = 0x58, [IR_SUB] = 0x5C, [IR_MUL] = 0x59, [IR_DIV] = 0x5E};
+            emitLoadNumbers(tc, ins);
+            EMIT(jc, 0xF2, 0x0F, opcodes[ins->op], 0xC1);
+            // movq rax, xmm0
+            EMIT(jc, 0x66, 0x48, 0x0F, 0x7E, 0xC0);
+            break;
+        }
+        case IR_NEG:
+            emitLoadRef(tc, RAX, ins->a);
+            // btc rax, 63
+            EMIT(jc, 0x48, 0x0F, 0xBA, 0xF8, 0x3F);
+            break;
+        case IR_LT:
+        case IR_LE:
+        case IR_GT:
+        case IR_GE:
+        case IR_EQ:
+            if (fusedCondition(tc, ref)) {
+                return;
+            }
+            // setcc al
+            EMIT(jc, 0x0F, 0x90 + emitCondition(tc, ins), 0xC0);
+            emitBoolean(jc);
+            break;
+        case IR_NOT:
+            emitLoadRef(tc, RAX, ins->a);
+            if (ins->aux) {
+                // true and false differ in the low bit: xor rax, 1
+                EMIT(jc, 0x48, 0x83, 0xF0, 0x01);
+                break;
+            }
+            emitMoveImmediate(jc, RCX, NIL_VAL);
+            emitRegister(jc, X86_CMP, RCX, RAX);
+            // sete dl
+            EMIT(jc, 0x0F, 0x94, 0xC2);
+            emitMoveImmediate(jc, RCX, FALSE_VAL);
+            emitRegister(jc, X86_CMP, RCX, RAX);
+            // sete al; or al, dl
+            EMIT(jc, 0x0F, 0x94, 0xC0);
+            EMIT(jc, 0x08, 0xD0);
+            emitBoolean(jc);
+            break;
+        case IR_CHECK_NUMBER:
+            emitLoadRef(tc, RAX, ins->a);
+            addExit(jc, emitNotNumber(jc, RAX), ref);
+            return;
+        case IR_CHECK_DEFINED:
+            emitLoadRef(tc, RAX, ins->a);
+            emitMoveImmediate(jc, RDX, UNDEFINED_VAL);
+            emitRegister(jc, X86_CMP, RDX, RAX);
+            emitExit(tc, CC_E, ins);
+            return;
+        case IR_CHECK_VALUE:
+            emitLoadRef(tc, RAX, ins->a);
+            emitMoveImmediate(jc, RCX, ins->value);
+            emitRegister(jc, X86_CMP, RCX, RAX);
+            emitExit(tc, CC_NE, ins);
+            return;
+        case IR_CHECK_SHAPE:
+            emitShapeCheck(tc, ins);
+            return;
+        case IR_CHECK_VERSION:
+            emitMoveImmediate(jc, RAX, (uint64_t) (uintptr_t) ins->pointer);
+            emitCompareMemory32(jc, RAX, offsetof(ObjClass, version), ins->aux);
+            emitExit(tc, CC_NE, ins);
+            return;
+        case IR_CHECK_CAPACITY:
+            emitLoadInstance(tc, ins->a);
+            emitCompareMemory32(jc, RAX, offsetof(ObjInstance, fieldCapacity), ins->aux);
+            emitExit(tc, CC_LE, ins);
+            return;
+        case IR_CHECK_TRUTHY:
+        case IR_CHECK_FALSEY:
+            emitTruthGuard(tc, ins);
+            return;
+        case IR_GSTORE:
+            emitGlobalValues(jc, RCX);
+            emitLoadRef(tc, RAX, ins->b);
+            emitMemory(jc, X86_STORE, RAX, RCX, 8 * ins->aux);
+            return;
+        case IR_FSTORE:
+            if (tc->ir->code[ins->a].op == IR_SUNK) {
+                return;
+            }
+            emitLoadInstance(tc, ins->a);
+            emitWriteBarrier(jc, RAX);
+            emitMemory(jc, X86_LOAD, RAX, RAX, offsetof(ObjInstance, fields));
+            emitLoadRef(tc, RCX, ins->b);
+            emitMemory(jc, X86_STORE, RCX, RAX, 8 * ins->aux);
+            return;
+        case IR_SET_SHAPE:
+            if (tc->ir->code[ins->a].op == IR_SUNK) {
+                return;
+            }
+            emitLoadInstance(tc, ins->a);
+            emitWriteBarrier(jc, RAX);
+            emitMoveImmediate(jc, RCX, (uint64_t) (uintptr_t) ins->pointer);
+            emitMemory(jc, X86_STORE, RCX, RAX, offsetof(ObjInstance, shape));
+            return;
+        case IR_USTORE:
+            emitLoadRef(tc, RAX, ins->a);
+            emitWriteBarrier(jc, RAX);
+            emitMemory(jc, X86_LOAD, RAX, RAX, offsetof(ObjUpvalue, location));
+            emitLoadRef(tc, RCX, ins->b);
+            emitMemory(jc, X86_STORE, RCX, RAX, 0);
+            return;
+        case IR_FLUSH:
+            emitSnapshot(tc, ins->snapshot, false);
+            return;
+        case IR_CALL_FRAME:
+            emitCallFrame(tc, ins);
+            return;
+        case IR_RETURN_FRAME:
+            emitReturnFrame(tc, ins);
+            return;
+        case IR_CALL_NATIVE:
+            emitSnapshot(tc, ins->snapshot, true);
+            emitMoveImmediate32(jc, RDI, ins->aux);
+            emitCallHelper(jc, opCall);
+            // test eax, eax
+            EMIT(jc, 0x85, 0xC0);
+            emitJumpTo(jc, CC_NE, jc->exit);
+            return;
+        case IR_INSTANTIATE:
+            emitSnapshot(tc, ins->snapshot, true);
+            emitMoveImmediate(jc, RDI, (uint64_t) (uintptr_t) ins->pointer);
+            emitMoveImmediate32(jc, RSI, ins->aux);
+            emitCallHelper(jc, opInstantiate);
+            emitMemory(jc, X86_LOAD, RAX, R12, 8 * ins->aux2);
+            break;
+        case IR_PRINT:
+            emitLoadRef(tc, RDI, ins->a);
+            emitCallHelper(jc, opPrint);
+            return;
+        case IR_FALLBACK:
+            emitFallback(tc, ins);
+            return;
+        case IR_LINK:
+            emitLink(tc, ins);
+            return;
+        case IR_LOOP:
+            tc->loop = jc->count;
+            return;
+        default:
+            // constants are loaded where they are used, phis at the back-edge
+            return;
+    }
+    emitStoreRef(tc, RAX, ref);
+}
+
+/**
+ * give every value a slot of the native frame, values of the first iteration the
+ * loop uses live to the back-edge
+ * @return the number of slots
+ */
+static int allocateSlots(TraceCompiler *tc) {
+    const IR *ir = tc->ir;
+    int *lastUse = calloc(ir->count, sizeof(int));
+    IRRef *owners = malloc(sizeof(IRRef) * ir->count);
+    if (lastUse == NULL || owners == NULL) {
+        exit(1);
+    }
+#define USE(ref, at)                          \
+    do {                                      \
+        lastUse[ref] = (at);                  \
+        tc->uses[ref]++;                      \
+    } while (false)
+
+    for (int ref = 1; ref < ir->count; ref++) {
+        const IRIns *ins = &ir->code[ref];
+        if (ins->op == IR_PHI) {
+            USE(ins->a, ir->count);
+            USE(ins->b, ir->count);
+            continue;
+        }
+        USE(ins->a, ref);
+        USE(ins->b, ref);
+        if (ins->snapshot >= 0 && ins->op != IR_NOP) {
+            const Snapshot *snapshot = &ir->snapshots[ins->snapshot];
+            for (int i = 0; i < snapshot->count; i++) {
+                USE(ir->entries[snapshot->start + i].ref, ref);
+            }
+        }
+    }
+#undef USE
+    for (int ref = 1; ref < ir->loop; ref++) {
+        if (lastUse[ref] > ir->loop) {
+            lastUse[ref] = ir->count;
+        }
+    }
+    int count = 0;
+    for (int ref = 1; ref < ir->count; ref++) {
+        const IRIns *ins = &ir->code[ref];
+        if (!irHasValue(ins) || ins->op == IR_CONST || ins->op == IR_SUNK) {
+            continue;
+        }
+        int slot = 0;
+        while (slot < count && owners[slot] != 0 && lastUse[owners[slot]] >= ref) {
+            slot++;
+        }
+        if (slot == count) {
+            count++;
+        }
+        owners[slot] = (IRRef) ref;
+        tc->slots[ref] = 8 * slot;
+    }
+    free(lastUse);
+    free(owners);
+    return count;
+}
+
+// the objects of a trace being assembled
+typedef struct {
+    Obj **objects;
+    int count;
+    int capacity;
+} ObjectList;
+
+static void addObject(ObjectList *list, Obj *object) {
+    if (object == NULL) {
+        return;
+    }
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+        list->objects = realloc(list->objects, sizeof(Obj *) * list->capacity);
+        if (list->objects == NULL) {
+            exit(1);
+        }
+    }
+    list->objects[list->count++] = object;
+}
+
+// objects the code refers to, kept alive with the function
+static void addObjects(Trace *trace, const IR *ir) {
+    ObjectList list = {NULL, 0, 0};
+    for (int ref = 1; ref < ir->count; ref++) {
+        const IRIns *ins = &ir->code[ref];
+        switch (ins->op) {
+            case IR_CONST:
+                if (ins->type == IRT_POINTER) {
+                    addObject(&list, ins->pointer);
+                } else if (IS_OBJ(ins->value)) {
+                    addObject(&list, AS_OBJ(ins->value));
+                }
+                break;
+            case IR_CHECK_VALUE:
+                if (IS_OBJ(ins->value)) {
+                    addObject(&list, AS_OBJ(ins->value));
+                }
+                break;
+            case IR_CHECK_SHAPE:
+            case IR_CHECK_VERSION:
+            case IR_SET_SHAPE:
+            case IR_CALL_FRAME:
+            case IR_INSTANTIATE:
+            case IR_FALLBACK:
+                addObject(&list, ins->pointer);
+                break;
+            default:
+                break;
+        }
+    }
+    // the trace is already on the list of its function, where the marker may be reading it
+    trace->objects = list.objects;
+    PUBLISH(trace->objectCount, list.count);
+}
+
+static bool assembleTrace(Trace *trace, const IR *ir) {
+    JitCompiler jc;
+    memset(&jc, 0, sizeof(jc));
+    TraceCompiler tc;
+    tc.jc = &jc;
+    tc.ir = ir;
+    tc.loop = 0;
+    tc.slots = calloc(ir->count, sizeof(int32_t));
+    tc.uses = calloc(ir->count, sizeof(int));
+    if (tc.slots == NULL || tc.uses == NULL) {
+        exit(1);
+    }
+    const int slots = allocateSlots(&tc);
+    int phis = 0;
+    for (int ref = ir->loop; ref < ir->count; ref++) {
+        phis += ir->code[ref].op == IR_PHI;
+    }
+    // an even number of slots keeps rsp 16 byte aligned
+    tc.frameSize = 8 * ((slots + phis + 1) & ~1);
+
+    emitPrologue(&jc);
+    // the trace's own epilogue frees its slots first
+    const int shared = jc.exit;
+    jc.exit = jc.count;
+    // add rsp, frameSize
+    emitRex(&jc, 0, RSP);
+    EMIT(&jc, 0x81, 0xC4);
+    emit32(&jc, (uint32_t) tc.frameSize);
+    emitJumpTo(&jc, CC_ALWAYS, shared);
+
+    const int start = jc.count;
+    // sub rsp, frameSize
+    emitRex(&jc, 0, RSP);
+    EMIT(&jc, 0x81, 0xEC);
+    emit32(&jc, (uint32_t) tc.frameSize);
+    for (int ref = 1; ref < ir->count; ref++) {
+        emitTraceInstruction(&tc, (IRRef) ref);
+    }
+    emitPhis(&tc, 8 * slots);
+    emitJumpTo(&jc, CC_ALWAYS, tc.loop);
+    emitExitStubs(&tc);
+    free(tc.slots);
+    free(tc.uses);
+
+    uint8_t *code = installCode(&jc);
+    freeCompiler(&jc);
+    if (code == NULL) {
+        return false;
+    }
+    addObjects(trace, ir);
+    trace->code = code;
+    trace->size = jc.count;
+    trace->start = (uint32_t) start;
+    return true;
+}
+
+static void compileTrace(Trace *trace) {
+    IR ir;
+    initIR(&ir);
+    bool compiled = buildIR(&ir, recorder.records, recorder.count);
+    if (compiled) {
+        optimizeIR(&ir);
+#ifdef DEBUG_PRINT_IR
+        const ObjFunction *function = recorder.records[0].function;
+        char name[128];
+        snprintf(name, sizeof(name), "trace %s:%d", function->name != NULL ? function->name->chars : "<script>",
+                 trace->header);
+        printIR(&ir, name);
+#endif
+        compiled = assembleTrace(trace, &ir);
+        // the objects of the trace are kept alive by the function owning the loop
+        writeBarrier((Obj *) recorder.frame->closure->function);
+    }
+    freeIR(&ir);
+    if (!compiled) {
+        trace->aborts = TRACE_ATTEMPTS;
+    }
+}
+
+// --------------------------------------------------------------------------------
+// recording
+// --------------------------------------------------------------------------------
+
+static uint16_t readShortAt(const uint8_t *ip) {
+    return (uint16_t) ((ip[0] << 8) | ip[1]);
+}
+
+static TraceRecord *addRecord(CallFrame *frame) {
+    if (recorder.count == recorder.capacity) {
+        recorder.capacity = recorder.capacity < 64 ? 64 : recorder.capacity * 2;
+        recorder.records = realloc(recorder.records, sizeof(TraceRecord) * recorder.capacity);
+        if (recorder.records == NULL) {
+            exit(1);
+        }
+    }
+    TraceRecord *record = &recorder.records[recorder.count++];
+    memset(record, 0, sizeof(TraceRecord));
+    record->ip = frame->ip;
+    record->function = frame->closure->function;
+    record->instruction = plainInstruction(*frame->ip);
+    record->top = (int) (vm.stackTop - recorder.frame->slots);
+    record->callee = NIL_VAL;
+    return record;
+}
+
+/**
+ * a closure called with `argCount` arguments gets its frame pushed
+ * @return false if the call would fail
+ */
+static bool recordClosure(TraceRecord *record, ObjClosure *closure, const int argCount) {
+    record->closure = closure;
+    return closure->function->arity == argCount;
+}
+
+static bool recordCall(TraceRecord *record, const int argCount) {
+    const Value callee = vm.stackTop[-1 - argCount];
+    record->callee = callee;
+    if (IS_NATIVE(callee)) {
+        return true;
+    }
+    if (IS_CLOSURE(callee)) {
+        return recordClosure(record, AS_CLOSURE(callee), argCount);
+    }
+    if (IS_CLASS(callee)) {
+        const ObjClass *klass = AS_CLASS(callee);
+        record->version = klass->version;
+        if (klass->initializer != NULL) {
+            return recordClosure(record, klass->initializer, argCount);
+        }
+        return argCount == 0;
+    }
+    // bound methods are left to the interpreter
+    return false;
+}
+
+static bool recordInvoke(TraceRecord *record) {
+    const ObjString *name = AS_STRING(record->function->chunk.constants.values[record->ip[1]]);
+    const int argCount = record->ip[2];
+    const Value receiver = vm.stackTop[-1 - argCount];
+    if (!IS_INSTANCE(receiver)) {
+        return false;
+    }
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    Value method;
+    if (shapeSlot(instance->shape, name) != -1 || !tableGet(&instance->klass->methods, name, &method)) {
+        // callable fields are left to the interpreter
+        return false;
+    }
+    record->shape = instance->shape;
+    record->callee = OBJ_VAL(instance->klass);
+    record->version = instance->klass->version;
+    return recordClosure(record, AS_CLOSURE(method), argCount);
+}
+
+static bool recordSuperInvoke(TraceRecord *record) {
+    const ObjString *name = AS_STRING(record->function->chunk.constants.values[record->ip[1]]);
+    const ObjClass *superclass = AS_CLASS(vm.stackTop[-1]);
+    Value method;
+    if (!tableGet(&superclass->methods, name, &method)) {
+        return false;
+    }
+    record->callee = vm.stackTop[-1];
+    record->version = superclass->version;
+    return recordClosure(record, AS_CLOSURE(method), record->ip[2]);
+}
+
+static bool recordGetProperty(TraceRecord *record) {
+    const ObjString *name = AS_STRING(record->function->chunk.constants.values[record->ip[1]]);
+    if (!IS_INSTANCE(vm.stackTop[-1])) {
+        return false;
+    }
+    ObjInstance *instance = AS_INSTANCE(vm.stackTop[-1]);
+    const int slot = shapeSlot(instance->shape, name);
+    if (slot != -1) {
+        record->shape = instance->shape;
+        record->index = slot;
+    }
+    // a bound method is created by the generic template
+    return true;
+}
+
+static bool recordSetProperty(TraceRecord *record) {
+    ObjString *name = AS_STRING(record->function->chunk.constants.values[record->ip[1]]);
+    if (!IS_INSTANCE(vm.stackTop[-2])) {
+        return false;
+    }
+    ObjInstance *instance = AS_INSTANCE(vm.stackTop[-2]);
+    const int slot = shapeSlot(instance->shape, name);
+    Value transition;
+    if (slot != -1) {
+        record->shape = instance->shape;
+        record->index = slot;
+    } else if (tableGet(&instance->shape->transitions, name, &transition)) {
+        record->shape = instance->shape;
+        record->transition = AS_SHAPE(transition);
+        record->index = instance->shape->fieldCount;
+    }
+    // a transition taken for the first time is left to the generic template
+    return true;
+}
+
+static bool numberOperands() {
+    return IS_NUMBER(vm.stackTop[-1]) && IS_NUMBER(vm.stackTop[-2]);
+}
+
+/**
+ * what the instruction of `record` is about to do
+ * @return false if the trace cannot follow it
+ */
+static bool recordInstruction(TraceRecord *record, const int depth) {
+    const Value *top = vm.stackTop;
+    switch (record->instruction) {
+        case OP_ADD:
+            record->strings = IS_STRING(top[-1]) && IS_STRING(top[-2]);
+            return record->strings || numberOperands();
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+            return numberOperands();
+        case OP_NEGATE:
+            return IS_NUMBER(top[-1]);
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+            record->taken = IS_NIL(top[-1]) || (IS_BOOL(top[-1]) && !AS_BOOL(top[-1]));
+            return true;
+        case OP_JUMP_IF_NOT_EQUAL:
+            record->taken = !valuesEqual(top[-2], top[-1]);
+            return true;
+        case OP_JUMP_IF_EQUAL:
+            record->taken = valuesEqual(top[-2], top[-1]);
+            return true;
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL: {
+            if (!numberOperands()) {
+                return false;
+            }
+            const double a = AS_NUMBER(top[-2]);
+            const double b = AS_NUMBER(top[-1]);
+            switch (record->instruction) {
+                case OP_JUMP_IF_NOT_GREATER: record->taken = !(a > b); break;
+                case OP_JUMP_IF_NOT_GREATER_EQUAL: record->taken = a < b; break;
+                case OP_JUMP_IF_NOT_LESS: record->taken = !(a < b); break;
+                default: record->taken = a > b; break;
+            }
+            return true;
+        }
+        case OP_LOOP:
+            // any other backward jump, like the one from the increment clause of a for
+            // loop to its condition, is followed as it is. an inner loop without a trace
+            // is unrolled until the recording gets too long
+            return true;
+        case OP_GET_PROPERTY:
+            return recordGetProperty(record);
+        case OP_SET_PROPERTY:
+            return recordSetProperty(record);
+        case OP_CALL:
+            return recordCall(record, record->ip[1]) && (record->closure == NULL || depth < TRACE_DEPTH_MAX);
+        case OP_INVOKE:
+            return depth < TRACE_DEPTH_MAX && recordInvoke(record);
+        case OP_SUPER_INVOKE:
+            return depth < TRACE_DEPTH_MAX && recordSuperInvoke(record);
+        case OP_RETURN:
+            // leaving the loop's frame ends the loop
+            return depth > 0;
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_INHERIT:
+            return false;
+        default:
+            return true;
+    }
+}
+
+// run the trace of an inner loop as part of the recording
+static JitStatus recordLink(CallFrame *frame, Trace *inner) {
+    TraceRecord *record = addRecord(frame);
+    record->link = inner;
+    const JitStatus status = runTrace(frame, inner);
+    if (status != JIT_EXIT || !vm.recording) {
+        traceAbort();
+        return status;
+    }
+    if (&vm.frames[vm.frameCount - 1] != frame) {
+        // it left inside a call it made
+        traceAbort();
+        return JIT_EXIT;
+    }
+    record->exit = frame->ip;
+    return JIT_EXIT;
+}
+
+/**
+ * the back-edge of a loop, with frame->ip on the header: run its trace, or count
+ * towards recording one
+ * @return JIT_NEXT if the interpreter goes on at the header, else how the trace left
+ */
+JitStatus traceLoop(CallFrame *frame) {
+    if (vm.recording) {
+        // the recorder has seen this back-edge already
+        return JIT_NEXT;
+    }
+    ObjFunction *function = frame->closure->function;
+    const int header = (int) (frame->ip - function->chunk.code);
+    Trace *trace = findTrace(function, header);
+    if (trace != NULL && trace->code != NULL) {
+        return runTrace(frame, trace);
+    }
+    if (trace != NULL && trace->aborts >= TRACE_ATTEMPTS) {
+        return JIT_NEXT;
+    }
+    uint8_t *counter = loopCounter(frame->ip);
+    if (++*counter < TRACE_THRESHOLD) {
+        return JIT_NEXT;
+    }
+    *counter = 0;
+    if (trace == NULL) {
+        trace = malloc(sizeof(Trace));
+        if (trace == NULL) {
+            exit(1);
+        }
+        memset(trace, 0, sizeof(Trace));
+        trace->header = header;
+        trace->next = function->traces;
+        PUBLISH(function->traces, trace);
+    }
+    recorder.trace = trace;
+    recorder.frame = frame;
+    recorder.header = frame->ip;
+    vm.recording = true;
+    return JIT_NEXT;
+}
+
+/**
+ * record the instruction at frame->ip, before the interpreter runs it
+ * @return JIT_NEXT to run it, else how the trace of an inner loop left that the
+ * recorder ran instead
+ */
+JitStatus traceRecord(CallFrame *frame) {
+    restoreSuperinstruction();
+    const ObjFunction *function = frame->closure->function;
+    const int depth = (int) (frame - recorder.frame);
+    if (recorder.count == TRACE_MAX) {
+        traceAbort();
+        return JIT_NEXT;
+    }
+    if (depth > 0 || frame->ip != recorder.header) {
+        Trace *inner = findTrace(function, (int) (frame->ip - function->chunk.code));
+        if (inner != NULL && inner->code != NULL) {
+            return recordLink(frame, inner);
+        }
+    }
+    TraceRecord *record = addRecord(frame);
+    if (record->instruction == OP_LOOP && depth == 0 &&
+        frame->ip + 3 - readShortAt(frame->ip + 1) == recorder.header) {
+        // back at the header, the loop is complete
+        compileTrace(recorder.trace);
+        stopRecording();
+        return JIT_NEXT;
+    }
+    if (!recordInstruction(record, depth)) {
+        traceAbort();
+        return JIT_NEXT;
+    }
+    if (*frame->ip != record->instruction) {
+        recorder.restore = frame->ip;
+        recorder.restoreByte = *frame->ip;
+    }
+    return JIT_NEXT;
+}
+
+void markTraces(const ObjFunction *function) {
+    for (const Trace *trace = ACQUIRE(function->traces); trace != NULL; trace = trace->next) {
+        const int count = ACQUIRE(trace->objectCount);
+        for (int i = 0; i < count; i++) {
+            markObject(trace->objects[i]);
+        }
+    }
+}
+
+void markRecorderRoots() {
+    for (int i = 0; i < recorder.count; i++) {
+        const TraceRecord *record = &recorder.records[i];
+        markObject((Obj *) record->function);
+        markValue(record->callee);
+        markObject((Obj *) record->closure);
+        markObject((Obj *) record->shape);
+        markObject((Obj *) record->transition);
+    }
+}
+#endif
+#endif
@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -61,17 +63,76 @@ static void runFile(const char *path) {
     }
 }
 
-int main(const int argc, const char *args[]) {
+static void usage() {
+    fprintf(stderr, "Usage: clox [--jit] [--gc-slice n] [--gc-concurrent] [--gc-threads n] [--gc-background-free] [path]\n");
+    exit(64);
+}
+
+// the value after the switch at `*index`, which moves over it
+static const char *switchValue(const int argc, const char *args[], int *index) {
+    if (*index + 1 >= argc) {
+        usage();
+    }
+    return args[++*index];
+}
+
+// a switch value that must be a whole number of at least `min`
+static int switchNumber(const int argc, const char *args[], int *index, const long min) {
+    const char *value = switchValue(argc, args, index);
+    char *end;
+    errno = 0;
+    const long number = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || errno == ERANGE || number < min || number > INT_MAX) {
+        usage();
+    }
+    return (int) number;
+}
+
+int main(int argc, const char *args[]) {
     setbuf(stdout,NULL);
     // initial virtual machine
     initVM();
-    if (argc == 1) {
+    // the switches come in any order, the path is the one other argument
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(args[i], "--jit") == 0) {
+#ifdef JIT
+            vm.jit = true;
+#else
+            fprintf(stderr, "The jit is not supported on this platform, running interpreted.\n");
+#endif
+        } else if (strcmp(args[i], "--gc-slice") == 0) {
+            vm.gcSliceWork = switchNumber(argc, args, &i, 0);
+        } else if (strcmp(args[i], "--gc-concurrent") == 0) {
+#ifdef CONCURRENT_GC
+            vm.gcConcurrent = true;
+#else
+            fprintf(stderr, "Concurrent marking is not supported on this platform, marking incrementally.\n");
+#endif
+        } else if (strcmp(args[i], "--gc-threads") == 0) {
+            const int threads = switchNumber(argc, args, &i, 1);
+#ifdef CONCURRENT_GC
+            vm.gcThreads = threads > GC_THREADS_MAX ? GC_THREADS_MAX : threads;
+#else
+            (void) threads;
+            fprintf(stderr, "Parallel marking is not supported on this platform, marking with one thread.\n");
+#endif
+        } else if (strcmp(args[i], "--gc-background-free") == 0) {
+#ifdef CONCURRENT_GC
+            vm.gcBackgroundFree = true;
+#else
+            fprintf(stderr, "Freeing in the background is not supported on this platform.\n");
+#endif
+        } else if (path == NULL) {
+            path = args[i];
+        } else {
+            usage();
+        }
+    }
+    if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        runFile(args[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(path);
     }
     // free virtual machine resouces
     freeVM();
@@ -1,28 +1,293 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 
+#ifdef CONCURRENT_GC
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #include "debug.h"
 #endif
 
+#ifdef GC_STATS
+#include <stdio.h>
+#include <time.h>
+#endif
+
 #define GC_HEAP_GROW_FACTOR 2
+// objects are allocated from blocks of this size, aligned to it
+#define BLOCK_SIZE (64 * 1024)
+// bytes allocated between two minor collections, young objects and what they own
+#define NURSERY_SIZE (1024 * 1024)
+// cell sizes are multiples of this, one size class for each
+#define CELL_GRANULE 16
+// the largest cell, every object fits in one
+#define CELL_MAX 256
+#define SIZE_CLASSES (CELL_MAX / CELL_GRANULE)
+// empty blocks kept for reuse
+#define FREE_BLOCKS_MAX (NURSERY_SIZE / BLOCK_SIZE)
+// a major collection does a slice of its work whenever this many bytes were allocated
+#define GC_SLICE_BYTES (32 * 1024)
+// most cells swept when a size class runs out of free cells during GC_SWEEP
+#define LAZY_SWEEP_MAX 4096
+
+/*
+ * a block holds objects of one size class, in cells of the same size. a fresh block is
+ * bumped, the cells freed later go on its free list. objects never move, so a block is
+ * kept until all its objects are freed, then it can take another size class
+ */
+typedef struct Block {
+    // the blocks of the size class, or the free blocks
+    struct Block *next;
+    struct Block *prev;
+    // the next block allocated from since the last collection
+    struct Block *nextNursery;
+    Obj *freeCells;
+    // cells above top were never allocated
+    uint8_t *top;
+    // objects in the block
+    int live;
+    int sizeClass;
+    int cellSize;
+    // on the nursery list, its young objects are swept by the next minor collection
+    bool inNursery;
+    // holds old objects, its size counts in vm.bytesAllocated
+    bool hasOld;
+    // the sweep of the major collection in progress is done with the block
+    bool swept;
+} Block;
+
+// cells start after the header, 16 byte aligned
+#define BLOCK_HEADER_SIZE ((sizeof(Block) + 15) & ~(size_t) 15)
+
+// a cell on the free list of its block
+typedef struct {
+    Obj obj;
+    Obj *next;
+} FreeCell;
+
+typedef struct {
+    // the block cells are allocated from
+    Block *current;
+    // every block of the class, the newest first
+    Block *blocks;
+    // the next block to look for free cells in once `current` is full
+    Block *cursor;
+    // the next block the major sweep frees dead objects in
+    Block *sweepCursor;
+} SizeClass;
+
+static SizeClass sizeClasses[SIZE_CLASSES];
+// blocks allocated from since the last collection, the ones young objects can be in
+static Block *nursery = NULL;
+static Block *freeBlocks = NULL;
+static int freeBlockCount = 0;
+// the collection in progress only frees young objects
+static bool minorCollection = false;
+// bytes allocated since the last slice of a major collection
+static size_t sliceBytes = 0;
+
+#ifdef GC_STATS
+// major collections, the time from their start to the end of their marking, the longest pause
+static int majorCollections = 0;
+static double markStart = 0;
+static double markSeconds = 0;
+static double longestPause = 0;
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+static void endPause(const double start) {
+    const double pause = now() - start;
+    if (pause > longestPause) {
+        longestPause = pause;
+    }
+}
+
+void printGCStats() {
+    fprintf(stderr, "== gc ==\n");
+    fprintf(stderr, "%d major collections, %.3fs marking, longest pause %.3fms\n",
+            majorCollections, markSeconds, longestPause * 1000);
+}
+#endif
+
+#ifdef CONCURRENT_GC
+/*
+ * the background marker of GC_MARK_CONCURRENT. it holds markerLock while it blackens
+ * objects, the mutator takes the lock to stop it between two of them. it then owns the
+ * gray stack, and may free what the marker could be reading
+ */
+static pthread_t marker;
+static pthread_mutex_t markerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markerResumed = PTHREAD_COND_INITIALIZER;
+// started and not joined yet
+static bool markerRunning = false;
+// the mutator holds markerLock
+static bool markerPaused = false;
+// set by the mutator before it takes the lock, the marker then waits for markerResumed
+static bool pauseRequested = false;
+// the marker quits before its work is done, under markerLock
+static bool markerStopped = false;
+// the gray stack ran empty, the mutator finishes the marking at its next slice
+static bool markerDone = false;
+// arrays freed while the marker may be reading them, released when it is joined
+static void **deferred = NULL;
+static int deferredCount = 0;
+static int deferredCapacity = 0;
+// old objects stored into since the marking began, scanned again at its final pause
+static Obj **dirty = NULL;
+static int dirtyCount = 0;
+static int dirtyCapacity = 0;
+
+/*
+ * with vm.gcThreads > 1 the gray objects are blackened by that many threads at once, each
+ * with a deque of its own. its owner pushes and pops at the bottom, the others steal from
+ * the top when they run out. vm.grayStack takes what a full deque cannot hold
+ */
+#define GRAY_DEQUE_SIZE 4096
+// objects a thread takes from vm.grayStack at a time
+#define GRAY_BATCH 32
+
+typedef struct {
+    Obj *objects[GRAY_DEQUE_SIZE];
+    int64_t top;
+    int64_t bottom;
+} GrayDeque;
+
+static GrayDeque *deques = NULL;
+// the deque of the marking thread, NULL outside a parallel marking
+static __thread GrayDeque *localDeque = NULL;
+// guards vm.grayStack while threads mark in parallel
+static pthread_mutex_t grayLock = PTHREAD_MUTEX_INITIALIZER;
+// threads that help the one running traceParallel(), vm.gcThreads - 1 of them
+static pthread_t *helpers = NULL;
+static int helperCount = 0;
+static pthread_mutex_t roundLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t roundStarted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t roundFinished = PTHREAD_COND_INITIALIZER;
+// counts the parallel markings, a helper joins each new one
+static int round = 0;
+static int finishedHelpers = 0;
+static bool helpersQuit = false;
+// threads that hold or look for gray objects, the marking is done when none do
+static int busyThreads = 0;
+// the marking stops early for the mutator, see pauseMarker
+static bool roundPausable = false;
+static bool roundStopping = false;
+
+/*
+ * with vm.gcBackgroundFree the arrays owned by the dead old objects sweep() finds are
+ * freed by a thread of their own. the sweep reclaims the cells, and queues the arrays
+ * for the freer under freeLock
+ */
+static pthread_t freer;
+static bool freerRunning = false;
+static bool freerQuit = false;
+static pthread_mutex_t freeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t arraysQueued = PTHREAD_COND_INITIALIZER;
+// the sweep is running, reallocate() adds what it frees to `dying`
+static bool queueFrees = false;
+static void **dying = NULL;
+static int dyingCount = 0;
+static int dyingCapacity = 0;
+// arrays for the freer, under freeLock
+static void **queued = NULL;
+static int queuedCount = 0;
+static int queuedCapacity = 0;
+
+static void deferFree(void *pointer) {
+    if (deferredCount == deferredCapacity) {
+        deferredCapacity = GROW_CAPACITY(deferredCapacity);
+        deferred = (void **) realloc(deferred, deferredCapacity * sizeof(void *));
+        if (deferred == NULL) {
+            exit(1);
+        }
+    }
+    deferred[deferredCount++] = pointer;
+}
+
+// an array of a dead object, for the freer thread
+static void queueFree(void *pointer) {
+    if (dyingCount == dyingCapacity) {
+        dyingCapacity = GROW_CAPACITY(dyingCapacity);
+        dying = (void **) realloc(dying, dyingCapacity * sizeof(void *));
+        if (dying == NULL) {
+            exit(1);
+        }
+    }
+    dying[dyingCount++] = pointer;
+}
+#endif
 
 static void freeObject(Obj *object);
 
+static void collectSlice(int budget);
+
+static Block *sweepBlock(SizeClass *sizeClass, int *work);
+
+static void collectIfNeeded(const size_t size) {
+    vm.youngBytes += size;
+    sliceBytes += size;
+#ifdef DEBUG_STRESS_GC
+    collectYoung();
+    sliceBytes = GC_SLICE_BYTES;
+#endif
+    if (vm.youngBytes > NURSERY_SIZE) {
+        collectYoung();
+    }
+    if (vm.gcPhase != GC_IDLE && sliceBytes >= GC_SLICE_BYTES) {
+        sliceBytes = 0;
+#ifdef GC_STATS
+        const double start = now();
+#endif
+        collectSlice(vm.gcSliceWork);
+#ifdef GC_STATS
+        endPause(start);
+#endif
+    }
+}
+
 void *reallocate(void *pointer, const size_t oldSize, const size_t newSize) {
+#ifdef CONCURRENT_GC
+    if (queueFrees && newSize == 0) {
+        // an array of a dead object, the freer thread frees it
+        vm.bytesAllocated -= oldSize;
+        if (pointer != NULL) {
+            queueFree(pointer);
+        }
+        return NULL;
+    }
+#endif
     vm.bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
-        collectGarbage();
-#endif
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
+        collectIfNeeded(newSize - oldSize);
+    }
+
+#ifdef CONCURRENT_GC
+    if (markerRunning && !markerPaused && pointer != NULL) {
+        // the marker may be reading the old array, which stays as it is until the marker is joined
+        void *result = NULL;
+        if (newSize > 0) {
+            result = malloc(newSize);
+            if (result == NULL) {
+                exit(1);
+            }
+            memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
         }
+        deferFree(pointer);
+        return result;
     }
+#endif
 
     if (newSize == 0) {
         free(pointer);
@@ -37,6 +302,203 @@ void *reallocate(void *pointer, const size_t oldSize, const size_t newSize) {
     return result;
 }
 
+static Block *blockOf(const Obj *object) {
+    return (Block *) ((uintptr_t) object & ~(uintptr_t) (BLOCK_SIZE - 1));
+}
+
+static uint8_t *firstCell(Block *block) {
+    return (uint8_t *) block + BLOCK_HEADER_SIZE;
+}
+
+static bool hasFreeCell(const Block *block) {
+    return block->freeCells != NULL || block->top + block->cellSize <= (uint8_t *) block + BLOCK_SIZE;
+}
+
+// a free or new block of `sizeClass`, with nothing to sweep
+static Block *newBlock(SizeClass *sizeClass) {
+    Block *block = freeBlocks;
+    if (block != NULL) {
+        freeBlocks = block->next;
+        freeBlockCount--;
+    } else {
+#ifdef _MSC_VER
+        block = (Block *) _aligned_malloc(BLOCK_SIZE, BLOCK_SIZE);
+#else
+        block = (Block *) aligned_alloc(BLOCK_SIZE, BLOCK_SIZE);
+#endif
+        if (block == NULL) {
+            exit(1);
+        }
+    }
+    block->sizeClass = (int) (sizeClass - sizeClasses);
+    block->cellSize = (block->sizeClass + 1) * CELL_GRANULE;
+    block->freeCells = NULL;
+    block->top = firstCell(block);
+    block->live = 0;
+    block->inNursery = false;
+    block->hasOld = false;
+    block->swept = true;
+    block->prev = NULL;
+    block->next = sizeClass->blocks;
+    if (block->next != NULL) {
+        block->next->prev = block;
+    }
+    sizeClass->blocks = block;
+    return block;
+}
+
+static void freeBlock(Block *block) {
+#ifdef _MSC_VER
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+}
+
+// an empty block leaves its size class for the free list
+static void releaseBlock(Block *block) {
+    SizeClass *sizeClass = &sizeClasses[block->sizeClass];
+    if (sizeClass->cursor == block) {
+        sizeClass->cursor = block->next;
+    }
+    if (sizeClass->sweepCursor == block) {
+        sizeClass->sweepCursor = block->next;
+    }
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        sizeClass->blocks = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    if (block->hasOld) {
+        vm.bytesAllocated -= BLOCK_SIZE;
+    }
+    if (freeBlockCount < FREE_BLOCKS_MAX) {
+        block->next = freeBlocks;
+        freeBlocks = block;
+        freeBlockCount++;
+    } else {
+        freeBlock(block);
+    }
+}
+
+/**
+ * after a minor collection every object left is old. blocks of the nursery without
+ * any are released, except the ones being allocated from, which start over
+ */
+static void resetNursery() {
+    Block *block = nursery;
+    nursery = NULL;
+    while (block != NULL) {
+        Block *next = block->nextNursery;
+        block->inNursery = false;
+        if (block->live > 0 && !block->hasOld) {
+            block->hasOld = true;
+            vm.bytesAllocated += BLOCK_SIZE;
+        }
+        if (block == sizeClasses[block->sizeClass].current) {
+            if (block->live == 0) {
+                block->freeCells = NULL;
+                block->top = firstCell(block);
+                if (block->hasOld) {
+                    vm.bytesAllocated -= BLOCK_SIZE;
+                    block->hasOld = false;
+                }
+            }
+            block->inNursery = true;
+            block->nextNursery = nursery;
+            nursery = block;
+        } else if (block->live == 0) {
+            releaseBlock(block);
+        }
+        block = next;
+    }
+    // the collection may have left free cells in any block
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        sizeClasses[i].cursor = sizeClasses[i].blocks;
+    }
+}
+
+// a free cell of `block`, NULL if it is full
+static Obj *takeCell(Block *block) {
+    Obj *cell = block->freeCells;
+    if (cell != NULL) {
+        block->freeCells = ((FreeCell *) cell)->next;
+    } else if (block->top + block->cellSize <= (uint8_t *) block + BLOCK_SIZE) {
+        cell = (Obj *) block->top;
+        block->top += block->cellSize;
+    } else {
+        return NULL;
+    }
+    block->live++;
+    return cell;
+}
+
+/**
+ * a cell of `sizeClass` once the block it allocates from is full. the next block of the
+ * class with free cells is allocated from, while a major collection sweeps the blocks
+ * are swept on demand, and a new block is taken last
+ */
+static Obj *takeCellSlow(SizeClass *sizeClass) {
+    Block *block = NULL;
+    while (block == NULL && sizeClass->cursor != NULL) {
+        Block *next = sizeClass->cursor;
+        sizeClass->cursor = next->next;
+        if (next != sizeClass->current && hasFreeCell(next)) {
+            block = next;
+        }
+    }
+    for (int work = 0; block == NULL && vm.gcPhase == GC_SWEEP && work < LAZY_SWEEP_MAX &&
+                       sizeClass->sweepCursor != NULL;) {
+        block = sweepBlock(sizeClass, &work);
+    }
+    if (block == NULL) {
+        block = newBlock(sizeClass);
+    }
+    sizeClass->current = block;
+    // its young objects are found by the next minor collection
+    if (!block->inNursery) {
+        block->inNursery = true;
+        block->nextNursery = nursery;
+        nursery = block;
+    }
+    return takeCell(block);
+}
+
+/**
+ * a new young object, in a cell of the size class its size rounds up to. young and old
+ * objects share the blocks, minor collections find the young ones by their isOld in the
+ * blocks allocated from since the last collection
+ */
+Obj *allocateObject(const size_t size, const ObjType type) {
+    collectIfNeeded(size);
+    SizeClass *sizeClass = &sizeClasses[(size - 1) / CELL_GRANULE];
+    Obj *object = NULL;
+    if (sizeClass->current != NULL) {
+        object = takeCell(sizeClass->current);
+    }
+    if (object == NULL) {
+        object = takeCellSlow(sizeClass);
+    }
+    object->type = type;
+    object->isMarked = false;
+    object->isOld = false;
+    object->isRemembered = false;
+    object->isFree = false;
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate %zu for %s\n", (void *) object, size, translateType(type));
+#endif
+    return object;
+}
+
+// the cell of an object, after what it owns was freed. the sweep links it into the free list
+static void releaseObject(Obj *object) {
+    object->isFree = true;
+    blockOf(object)->live--;
+}
+
 void markValue(const Value value) {
     if (IS_OBJ(value)) {
         markObject(AS_OBJ(value));
@@ -44,7 +506,8 @@ void markValue(const Value value) {
 }
 
 static void markArray(const ValueArray *array) {
-    for (int i = 0; i < array->count; i++) {
+    const int count = ACQUIRE(array->count);
+    for (int i = 0; i < count; i++) {
         markValue(array->values[i]);
     }
 }
@@ -70,6 +533,8 @@ static void blackenObject(Obj *object) {
             const ObjClass *class = (ObjClass *) object;
             markObject((Obj *) class->name);
             markTable(&class->methods);
+            markObject((Obj *) class->rootShape);
+            markObject((Obj *) class->initializer);
             break;
         }
         case OBJ_CLOSURE: {
@@ -84,12 +549,36 @@ static void blackenObject(Obj *object) {
             const ObjFunction *function = (ObjFunction *) object;
             markObject((Obj *) function->name);
             markArray(&function->chunk.constants);
+            // cached shapes must not be freed and reused while an entry still points at them
+            const int cacheCount = ACQUIRE(function->chunk.cacheCount);
+            for (int i = 0; i < cacheCount; i++) {
+                const InlineCache *cache = &function->chunk.caches[i];
+                for (int j = 0; j < INLINE_CACHE_WAYS; j++) {
+                    markObject(cache->entries[j].shape);
+                    markObject(cache->entries[j].transition);
+                    markValue(cache->entries[j].method);
+                }
+            }
+#ifdef TRACE_JIT
+            markTraces(function);
+#endif
             break;
         }
         case OBJ_INSTANCE: {
             const ObjInstance *instance = (ObjInstance *) object;
+            ObjShape *shape = ACQUIRE(instance->shape);
             markObject((Obj *) instance->klass);
-            markTable(&instance->fields);
+            markObject((Obj *) shape);
+            for (int i = 0; i < shape->fieldCount; i++) {
+                markValue(instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_SHAPE: {
+            const ObjShape *shape = (ObjShape *) object;
+            markObject((Obj *) shape->parent);
+            markObject((Obj *) shape->name);
+            markTable(&shape->transitions);
             break;
         }
         case OBJ_UPVALUE:
@@ -98,29 +587,181 @@ static void blackenObject(Obj *object) {
     }
 }
 
+static void pushGrayStack(Obj *object) {
+    if (vm.grayCapacity < (vm.grayCount + 1)* sizeof(Obj *)) {
+        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        vm.grayStack = (Obj **) realloc(vm.grayStack, vm.grayCapacity * sizeof(Obj *));
+        if (vm.grayStack == NULL) {
+            exit(1);
+        }
+    }
+    vm.grayStack[vm.grayCount++] = object;
+}
+
+#ifdef CONCURRENT_GC
+static void pushDeque(GrayDeque *deque, Obj *object) {
+    const int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    const int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= GRAY_DEQUE_SIZE) {
+        pthread_mutex_lock(&grayLock);
+        pushGrayStack(object);
+        pthread_mutex_unlock(&grayLock);
+        return;
+    }
+    __atomic_store_n(&deque->objects[bottom % GRAY_DEQUE_SIZE], object, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+}
+
+static Obj *popDeque(GrayDeque *deque) {
+    const int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    Obj *object = __atomic_load_n(&deque->objects[bottom % GRAY_DEQUE_SIZE], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // the last one, a thief may be taking it too
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            object = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return object;
+}
+
+static Obj *stealDeque(GrayDeque *deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    const int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) {
+        return NULL;
+    }
+    Obj *object = __atomic_load_n(&deque->objects[top % GRAY_DEQUE_SIZE], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return object;
+}
+#endif
+
+static void pushGray(Obj *object) {
+#ifdef CONCURRENT_GC
+    if (localDeque != NULL) {
+        pushDeque(localDeque, object);
+        return;
+    }
+#endif
+    pushGrayStack(object);
+}
+
 void markObject(Obj *object) {
     if (object == NULL) {
         return;
     }
+#ifdef CONCURRENT_GC
+    // other marking threads may be setting it
+    if (__atomic_load_n(&object->isMarked, __ATOMIC_RELAXED)) {
+        return;
+    }
+#else
     if (object->isMarked) {
         return;
     }
+#endif
+    // a minor collection takes old objects as live, the remembered ones are its roots.
+    // a major one leaves young objects to the minor collection that ends its marking
+    if (minorCollection ? object->isOld : !object->isOld) {
+        return;
+    }
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void *) object);
     printValue(OBJ_VAL(object));
     printf("\n");
 #endif
 
+#ifdef CONCURRENT_GC
+    if (localDeque != NULL) {
+        // only the thread that sets the mark bit blackens the object
+        if (__atomic_exchange_n(&object->isMarked, true, __ATOMIC_RELAXED)) {
+            return;
+        }
+        pushDeque(localDeque, object);
+        return;
+    }
+#endif
     object->isMarked = true;
+    pushGray(object);
+}
 
-    if (vm.grayCapacity < (vm.grayCount + 1)* sizeof(Obj *)) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack = (Obj **) realloc(vm.grayStack, vm.grayCapacity * sizeof(Obj *));
-        if (vm.grayStack == NULL) {
+static void rememberObject(Obj *object) {
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj **) realloc(vm.remembered, vm.rememberedCapacity * sizeof(Obj *));
+        if (vm.remembered == NULL) {
             exit(1);
         }
     }
-    vm.grayStack[vm.grayCount++] = object;
+    object->isRemembered = true;
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+void writeBarrierSlow(Obj *object) {
+    if (!object->isOld) {
+        return;
+    }
+    if (!object->isRemembered) {
+        rememberObject(object);
+    }
+    if (vm.gcPhase == GC_MARK && object->isMarked) {
+        // black objects are traced again, they may have got a white one. it stays
+        // unmarked while it is gray, so more stores do not push it again
+        object->isMarked = false;
+        pushGray(object);
+    }
+}
+
+#ifdef CONCURRENT_GC
+static void addDirty(Obj *object) {
+    if (dirtyCount == dirtyCapacity) {
+        dirtyCapacity = GROW_CAPACITY(dirtyCapacity);
+        dirty = (Obj **) realloc(dirty, dirtyCapacity * sizeof(Obj *));
+        if (dirty == NULL) {
+            exit(1);
+        }
+    }
+    dirty[dirtyCount++] = object;
+}
+
+// the marker may have blackened the dirty objects before their last store
+static void rescanDirty() {
+    for (int i = 0; i < dirtyCount; i++) {
+        if (dirty[i]->isMarked) {
+            blackenObject(dirty[i]);
+        }
+    }
+    dirtyCount = 0;
+}
+#endif
+
+/**
+ * every object is old after a collection, so none can point at a young one. while the
+ * marker runs the remembered objects are the ones stored into, they become dirty
+ */
+static void forgetRemembered() {
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.remembered[i]->isRemembered = false;
+#ifdef CONCURRENT_GC
+        if (vm.gcPhase == GC_MARK_CONCURRENT) {
+            addDirty(vm.remembered[i]);
+        }
+#endif
+    }
+    vm.rememberedCount = 0;
 }
 
 static void markRoots() {
@@ -138,113 +779,760 @@ static void markRoots() {
         markObject((Obj *) upvalue);
     }
     // mark the globals
-    markTable(&vm.globals);
+    markArray(&vm.globalValues);
+    markArray(&vm.globalNames);
+    markTable(&vm.globalSlots);
     // mark the compiler state
     markCompilerRoots();
+#ifdef TRACE_JIT
+    markRecorderRoots();
+#endif
     markObject((Obj *) vm.initString);
+    if (minorCollection) {
+        // scanned for the young objects they point at, they are not marked themselves
+        for (int i = 0; i < vm.rememberedCount; i++) {
+            pushGray(vm.remembered[i]);
+        }
+    }
 }
 
-static void traceReferences() {
-    while (vm.grayCount > 0) {
+/**
+ * blacken gray objects until the gray stack is down to `base`
+ * @param budget most objects to blacken, 0 for no limit
+ * @return true if the stack is down to `base`
+ */
+static bool traceReferences(const int base, const int budget) {
+    for (int work = 0; vm.grayCount > base; work++) {
+        if (budget > 0 && work == budget) {
+            return false;
+        }
         Obj *object = vm.grayStack[--vm.grayCount];
+        if (!minorCollection) {
+            // objects made gray again by the write barrier are unmarked
+            object->isMarked = true;
+        }
+        blackenObject(object);
+    }
+    return true;
+}
+
+#ifdef CONCURRENT_GC
+// whether some thread may still have gray objects for the others, read without locks
+static bool grayVisible() {
+    if (__atomic_load_n(&vm.grayCount, __ATOMIC_RELAXED) > 0) {
+        return true;
+    }
+    for (int i = 0; i < vm.gcThreads; i++) {
+        if (__atomic_load_n(&deques[i].top, __ATOMIC_RELAXED) <
+            __atomic_load_n(&deques[i].bottom, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// a batch of vm.grayStack onto the deque of the thread, or one stolen from another thread
+static Obj *takeGray(const int index) {
+    Obj *object = NULL;
+    pthread_mutex_lock(&grayLock);
+    if (vm.grayCount > 0) {
+        object = vm.grayStack[--vm.grayCount];
+        for (int i = 1; i < GRAY_BATCH && vm.grayCount > 0; i++) {
+            pushDeque(&deques[index], vm.grayStack[--vm.grayCount]);
+        }
+    }
+    pthread_mutex_unlock(&grayLock);
+    for (int i = 1; object == NULL && i < vm.gcThreads; i++) {
+        object = stealDeque(&deques[(index + i) % vm.gcThreads]);
+    }
+    return object;
+}
+
+/**
+ * the next gray object for a thread that ran out of its own
+ * @return NULL when every thread ran out, or the marking stops for the mutator
+ */
+static Obj *findGray(const int index) {
+    Obj *object = takeGray(index);
+    if (object != NULL) {
+        return object;
+    }
+    // idle threads hold no gray objects, so once all are idle there are none left
+    __atomic_sub_fetch(&busyThreads, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        if (__atomic_load_n(&roundStopping, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&busyThreads, __ATOMIC_SEQ_CST) == 0) {
+            return NULL;
+        }
+        if (grayVisible()) {
+            __atomic_add_fetch(&busyThreads, 1, __ATOMIC_SEQ_CST);
+            object = takeGray(index);
+            if (object != NULL) {
+                return object;
+            }
+            __atomic_sub_fetch(&busyThreads, 1, __ATOMIC_SEQ_CST);
+        }
+        sched_yield();
+    }
+}
+
+// blacken gray objects on the thread `index` of a parallel marking
+static void markInParallel(const int index) {
+    GrayDeque *deque = &deques[index];
+    localDeque = deque;
+    for (;;) {
+        Obj *object = popDeque(deque);
+        if (object == NULL) {
+            object = findGray(index);
+            if (object == NULL) {
+                break;
+            }
+        }
+        // objects made gray again by the write barrier are unmarked
+        __atomic_store_n(&object->isMarked, true, __ATOMIC_RELAXED);
         blackenObject(object);
+        if (roundPausable && __atomic_load_n(&pauseRequested, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&roundStopping, true, __ATOMIC_RELAXED);
+        }
+        if (__atomic_load_n(&roundStopping, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    localDeque = NULL;
+}
+
+static void *runHelper(void *arg) {
+    const int index = (int) (intptr_t) arg;
+    int joined = 0;
+    pthread_mutex_lock(&roundLock);
+    for (;;) {
+        while (round == joined && !helpersQuit) {
+            pthread_cond_wait(&roundStarted, &roundLock);
+        }
+        if (helpersQuit) {
+            break;
+        }
+        joined = round;
+        pthread_mutex_unlock(&roundLock);
+        markInParallel(index);
+        pthread_mutex_lock(&roundLock);
+        if (++finishedHelpers == helperCount) {
+            pthread_cond_signal(&roundFinished);
+        }
+    }
+    pthread_mutex_unlock(&roundLock);
+    return NULL;
+}
+
+// the deques and the helper threads, started by the first parallel marking
+static bool startHelpers() {
+    deques = (GrayDeque *) calloc(vm.gcThreads, sizeof(GrayDeque));
+    helpers = (pthread_t *) malloc(sizeof(pthread_t) * (vm.gcThreads - 1));
+    if (deques == NULL || helpers == NULL) {
+        exit(1);
+    }
+    for (int i = 1; i < vm.gcThreads; i++) {
+        if (pthread_create(&helpers[i - 1], NULL, runHelper, (void *) (intptr_t) i) != 0) {
+            // mark with the threads there are
+            vm.gcThreads = i;
+            break;
+        }
+        helperCount++;
+    }
+    return helperCount > 0;
+}
+
+static void stopHelpers() {
+    pthread_mutex_lock(&roundLock);
+    helpersQuit = true;
+    pthread_cond_broadcast(&roundStarted);
+    pthread_mutex_unlock(&roundLock);
+    for (int i = 0; i < helperCount; i++) {
+        pthread_join(helpers[i], NULL);
+    }
+    free(helpers);
+    free(deques);
+}
+
+/**
+ * blacken the gray objects with vm.gcThreads threads, the calling one and the helpers
+ * @param pausable stop early when the mutator wants to pause the background marker.
+ *                 the objects left on the deques go back to vm.grayStack
+ */
+static void traceParallel(const bool pausable) {
+    for (int i = 0; i < vm.gcThreads; i++) {
+        deques[i].top = 0;
+        deques[i].bottom = 0;
+    }
+    roundPausable = pausable;
+    roundStopping = false;
+    busyThreads = vm.gcThreads;
+    pthread_mutex_lock(&roundLock);
+    finishedHelpers = 0;
+    round++;
+    pthread_cond_broadcast(&roundStarted);
+    pthread_mutex_unlock(&roundLock);
+    markInParallel(0);
+    pthread_mutex_lock(&roundLock);
+    while (finishedHelpers < helperCount) {
+        pthread_cond_wait(&roundFinished, &roundLock);
+    }
+    pthread_mutex_unlock(&roundLock);
+    for (int i = 0; i < vm.gcThreads; i++) {
+        for (int64_t j = deques[i].top; j < deques[i].bottom; j++) {
+            pushGrayStack(deques[i].objects[j % GRAY_DEQUE_SIZE]);
+        }
+    }
+}
+#endif
+
+/**
+ * blacken every gray object of a major collection, in parallel with vm.gcThreads > 1
+ * @param pausable the caller is the background marker, which stops for the mutator
+ */
+static void traceAll(const bool pausable) {
+#ifdef CONCURRENT_GC
+    if (vm.gcThreads > 1 && (helperCount > 0 || startHelpers())) {
+        traceParallel(pausable);
+        return;
+    }
+#endif
+    if (pausable) {
+        traceReferences(0, 1);
+    } else {
+        traceReferences(0, 0);
+    }
+}
+
+// drops the bound methods about to be freed from vm.boundMethods
+static void removeWhiteBoundMethods() {
+    for (int i = 0; i < BOUND_METHODS_MAX; i++) {
+        const ObjBoundMethod *bound = vm.boundMethods[i];
+        if (bound != NULL && !bound->obj.isMarked && !(minorCollection && bound->obj.isOld)) {
+            vm.boundMethods[i] = NULL;
+        }
+    }
+}
+
+#ifdef CONCURRENT_GC
+static void *runFreer(void *unused) {
+    (void) unused;
+    // the array the queue is swapped with
+    void **spare = NULL;
+    int spareCapacity = 0;
+    pthread_mutex_lock(&freeLock);
+    for (;;) {
+        while (queuedCount == 0 && !freerQuit) {
+            pthread_cond_wait(&arraysQueued, &freeLock);
+        }
+        if (queuedCount == 0) {
+            break;
+        }
+        void **arrays = queued;
+        const int count = queuedCount;
+        const int capacity = queuedCapacity;
+        queued = spare;
+        queuedCount = 0;
+        queuedCapacity = spareCapacity;
+        // the sweep queues more meanwhile
+        pthread_mutex_unlock(&freeLock);
+        for (int i = 0; i < count; i++) {
+            free(arrays[i]);
+        }
+        spare = arrays;
+        spareCapacity = capacity;
+        pthread_mutex_lock(&freeLock);
     }
+    pthread_mutex_unlock(&freeLock);
+    free(spare);
+    return NULL;
 }
 
-static void sweep() {
-    Obj *previous = NULL;
-    Obj *object = vm.objects;
-    while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-        } else {
-            Obj *unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
+// hands the arrays the sweep freed to the freer thread, starting it first
+static void queueArrays() {
+    if (dyingCount == 0) {
+        return;
+    }
+    if (!freerRunning) {
+        if (pthread_create(&freer, NULL, runFreer, NULL) != 0) {
+            // free them here from now on
+            vm.gcBackgroundFree = false;
+            for (int i = 0; i < dyingCount; i++) {
+                free(dying[i]);
+            }
+            dyingCount = 0;
+            return;
+        }
+        freerRunning = true;
+    }
+    pthread_mutex_lock(&freeLock);
+    if (queuedCount + dyingCount > queuedCapacity) {
+        while (queuedCount + dyingCount > queuedCapacity) {
+            queuedCapacity = GROW_CAPACITY(queuedCapacity);
+        }
+        queued = (void **) realloc(queued, queuedCapacity * sizeof(void *));
+        if (queued == NULL) {
+            exit(1);
+        }
+    }
+    memcpy(queued + queuedCount, dying, dyingCount * sizeof(void *));
+    queuedCount += dyingCount;
+    pthread_cond_signal(&arraysQueued);
+    pthread_mutex_unlock(&freeLock);
+    dyingCount = 0;
+}
+
+static void stopFreer() {
+    pthread_mutex_lock(&freeLock);
+    freerQuit = true;
+    pthread_cond_signal(&arraysQueued);
+    pthread_mutex_unlock(&freeLock);
+    pthread_join(freer, NULL);
+    freerRunning = false;
+}
+#endif
+
+/**
+ * sweep the block at the sweep cursor of `sizeClass`, freeing the old objects the last
+ * major marking left unmarked. with vm.gcBackgroundFree what they own is freed by the
+ * freer thread. an empty block is released, unless it is on the nursery list
+ * @param work the cells looked at are added to it
+ * @return the block if it has free cells now, NULL if it is full or was released
+ */
+static Block *sweepBlock(SizeClass *sizeClass, int *work) {
+    Block *block = sizeClass->sweepCursor;
+    sizeClass->sweepCursor = block->next;
+#ifdef CONCURRENT_GC
+    queueFrees = vm.gcBackgroundFree;
+#endif
+    // the free cells are linked again, in address order
+    Obj **link = &block->freeCells;
+    for (uint8_t *cell = firstCell(block); cell < block->top; cell += block->cellSize) {
+        Obj *object = (Obj *) cell;
+        // young objects were allocated after the marking
+        if (!object->isFree && object->isOld) {
+            if (object->isMarked) {
+                object->isMarked = false;
             } else {
-                vm.objects = object;
+                freeObject(object);
             }
-            freeObject(unreached);
         }
+        if (object->isFree) {
+            *link = object;
+            link = &((FreeCell *) object)->next;
+        }
+    }
+    *link = NULL;
+#ifdef CONCURRENT_GC
+    queueFrees = false;
+    queueArrays();
+#endif
+    *work += (int) ((block->top - firstCell(block)) / block->cellSize);
+    block->swept = true;
+    if (block->live == 0) {
+        if (!block->inNursery) {
+            releaseBlock(block);
+            return NULL;
+        }
+        // the next minor collection releases the blocks of the nursery, until then they are bumped
+        block->freeCells = NULL;
+        block->top = firstCell(block);
     }
+    return hasFreeCell(block) ? block : NULL;
 }
 
-void collectGarbage() {
+/**
+ * a slice of the sweep of a major collection, through the blocks of each size class
+ * @param budget most cells to look at, 0 for no limit
+ * @return true if every block was swept
+ */
+static bool sweep(const int budget) {
+    int work = 0;
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        SizeClass *sizeClass = &sizeClasses[i];
+        while (sizeClass->sweepCursor != NULL) {
+            if (budget > 0 && work >= budget) {
+                return false;
+            }
+            sweepBlock(sizeClass, &work);
+        }
+    }
+    return true;
+}
+
+// frees the unmarked young objects in the blocks of the nursery and promotes the others
+static void sweepYoung() {
+    for (Block *block = nursery; block != NULL; block = block->nextNursery) {
+        Obj **link = &block->freeCells;
+        for (uint8_t *cell = firstCell(block); cell < block->top; cell += block->cellSize) {
+            Obj *object = (Obj *) cell;
+            if (!object->isFree && !object->isOld && object->isMarked) {
+                object->isOld = true;
+                if (vm.gcPhase == GC_MARK || vm.gcPhase == GC_MARK_CONCURRENT) {
+                    // promoted while a major collection marks, so traced by it
+                    pushGray(object);
+                } else {
+                    // a block the major collection did not sweep yet keeps marked objects
+                    object->isMarked = vm.gcPhase == GC_SWEEP && !block->swept;
+                }
+            } else if (!object->isFree && !object->isOld) {
+                if (object->type == OBJ_STRING) {
+                    tableDelete(&vm.strings, (ObjString *) object);
+                }
+                freeObject(object);
+            }
+            if (object->isFree) {
+                *link = object;
+                link = &((FreeCell *) object)->next;
+            }
+        }
+        *link = NULL;
+    }
+}
+
+#ifdef CONCURRENT_GC
+// the background marker, it blackens gray objects until there are none
+static void *runMarker(void *unused) {
+    (void) unused;
+    pthread_mutex_lock(&markerLock);
+    while (!markerStopped && vm.grayCount > 0) {
+        if (__atomic_load_n(&pauseRequested, __ATOMIC_RELAXED)) {
+            pthread_cond_wait(&markerResumed, &markerLock);
+            continue;
+        }
+        traceAll(true);
+    }
+    __atomic_store_n(&markerDone, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&markerLock);
+    return NULL;
+}
+
+// marks the gray objects on a background thread, or in slices if it cannot be started
+static void startMarker() {
+    vm.gcPhase = GC_MARK_CONCURRENT;
+    markerStopped = false;
+    markerDone = false;
+    if (pthread_create(&marker, NULL, runMarker, NULL) != 0) {
+        vm.gcPhase = GC_MARK;
+        return;
+    }
+    markerRunning = true;
+}
+
+// stop the marker between two objects, the mutator then has the heap to itself
+static void pauseMarker() {
+    if (!markerRunning) {
+        return;
+    }
+    __atomic_store_n(&pauseRequested, true, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&markerLock);
+    markerPaused = true;
+}
+
+static void resumeMarker() {
+    if (!markerRunning) {
+        return;
+    }
+    markerPaused = false;
+    __atomic_store_n(&pauseRequested, false, __ATOMIC_RELAXED);
+    pthread_cond_signal(&markerResumed);
+    pthread_mutex_unlock(&markerLock);
+}
+
+// wait for the marker to finish or stop, then free what it might have been reading
+static void joinMarker() {
+    if (!markerRunning) {
+        return;
+    }
+    pthread_join(marker, NULL);
+    markerRunning = false;
+    for (int i = 0; i < deferredCount; i++) {
+        free(deferred[i]);
+    }
+    deferredCount = 0;
+}
+#endif
+
+static void runMinorCollection() {
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
-    const size_t before = vm.bytesAllocated;
+    printf("-- minor gc begin\n");
+    const size_t young = vm.youngBytes;
 #endif
+#ifdef CONCURRENT_GC
+    pauseMarker();
+#endif
+    minorCollection = true;
+    // a major marking in progress keeps its gray objects below
+    const int base = vm.grayCount;
+    markRoots();
+    traceReferences(base, 0);
+    forgetRemembered();
+    removeWhiteBoundMethods();
+    minorCollection = false;
+    sweepYoung();
+    resetNursery();
+    vm.youngBytes = 0;
+#ifdef CONCURRENT_GC
+    resumeMarker();
+#endif
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   %zu young bytes, %zu bytes old\n", young, vm.bytesAllocated);
+#endif
+}
+
+// the last pause of a major marking, the mutator changed what the slices saw
+static void finishMarking() {
+    // the young objects alive now are promoted gray, the roots are scanned again
+    runMinorCollection();
     markRoots();
-    traceReferences();
+#ifdef CONCURRENT_GC
+    rescanDirty();
+#endif
+    traceAll(false);
     tableRemoveWhite(&vm.strings);
-    sweep();
+    removeWhiteBoundMethods();
+    // every block is swept, the ones taken for new objects from now on have nothing to sweep
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        for (Block *block = sizeClasses[i].blocks; block != NULL; block = block->next) {
+            block->swept = false;
+        }
+        sizeClasses[i].sweepCursor = sizeClasses[i].blocks;
+    }
+    vm.gcPhase = GC_SWEEP;
+#ifdef GC_STATS
+    markSeconds += now() - markStart;
+#endif
+#ifdef DEBUG_LOG_GC
+    printf("-- gc mark end\n");
+#endif
+}
+
+static void finishSweeping() {
+    vm.gcPhase = GC_IDLE;
     vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+    printf("   %zu bytes, next at %zu\n", vm.bytesAllocated, vm.nextGC);
+#endif
+}
+
+/**
+ * a slice of the major collection in progress
+ * @param budget objects to mark or sweep, 0 to finish the collection
+ */
+static void collectSlice(const int budget) {
+#ifdef CONCURRENT_GC
+    if (vm.gcPhase == GC_MARK_CONCURRENT) {
+        // the marker does the marking, the slices wait until it is done
+        if (__atomic_load_n(&markerDone, __ATOMIC_ACQUIRE)) {
+            joinMarker();
+            finishMarking();
+        }
+        return;
+    }
+#endif
+    if (vm.gcPhase == GC_MARK && budget == 0) {
+        traceAll(false);
+        finishMarking();
+        return;
+    }
+    if (vm.gcPhase == GC_MARK && traceReferences(0, budget)) {
+        finishMarking();
+        return;
+    }
+    if (vm.gcPhase == GC_SWEEP && sweep(budget)) {
+        finishSweeping();
+    }
+}
+
+// start a major collection, marking the old objects reachable from the roots
+static void startCollection() {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+    // everything allocated before is old, later allocations are left to minor collections
+    runMinorCollection();
+#ifdef GC_STATS
+    majorCollections++;
+    markStart = now();
+#endif
+    vm.gcPhase = GC_MARK;
+    markRoots();
+#ifdef CONCURRENT_GC
+    if (vm.gcConcurrent) {
+        startMarker();
+    }
 #endif
 }
 
+/**
+ * minor collection: marks and sweeps only the young objects, from the roots and the
+ * remembered old objects. the survivors are promoted. a major collection is started
+ * when the old generation got too large, it then runs in slices of vm.gcSliceWork
+ * objects as the mutator allocates, or all at once if that is 0. with vm.gcConcurrent
+ * a background thread does the marking, and only the sweep is done in slices
+ */
+void collectYoung() {
+#ifdef GC_STATS
+    const double start = now();
+#endif
+    runMinorCollection();
+    // the old generation grows only here
+    if (vm.gcPhase == GC_IDLE && vm.bytesAllocated > vm.nextGC) {
+        startCollection();
+        if (vm.gcSliceWork == 0 && vm.gcPhase == GC_MARK) {
+            collectGarbage();
+        }
+    }
+#ifdef GC_STATS
+    endPause(start);
+#endif
+}
+
+// a whole major collection, or the rest of the one in progress
+void collectGarbage() {
+    if (vm.gcPhase == GC_IDLE) {
+        startCollection();
+    }
+#ifdef CONCURRENT_GC
+    if (vm.gcPhase == GC_MARK_CONCURRENT) {
+        joinMarker();
+        finishMarking();
+    }
+#endif
+    while (vm.gcPhase != GC_IDLE) {
+        collectSlice(0);
+    }
+}
+
 static void freeObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
     printf("%p free type %s\n", (void *) object, translateType(object->type));
 #endif
     switch (object->type) {
         case OBJ_BOUND_METHOD: {
-            FREE(ObjBoundMethod, object);
+            releaseObject(object);
             break;
         }
         case OBJ_CLASS: {
             const ObjClass *class = (ObjClass *) object;
             freeTable(&class->methods);
-            FREE(ObjClass, object);
+            releaseObject(object);
             break;
         }
         case OBJ_CLOSURE: {
             const ObjClosure *closure = (ObjClosure *) object;
             FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            releaseObject(object);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *) object;
+#ifdef JIT
+            jitFree(function);
+#endif
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+            releaseObject(object);
             break;
         }
         case OBJ_INSTANCE: {
-            ObjInstance *instance = (ObjInstance *) object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            const ObjInstance *instance = (ObjInstance *) object;
+            if (instance->fields != instance->inlineFields) {
+                FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+            }
+            releaseObject(object);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *) object;
+            freeTable(&shape->transitions);
+            releaseObject(object);
             break;
         }
         case OBJ_NATIVE: {
-            FREE(ObjNative, object);
+            releaseObject(object);
             break;
         }
         case OBJ_STRING: {
             const ObjString *string = (ObjString *) object;
             FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            releaseObject(object);
             break;
         }
         case OBJ_UPVALUE: {
-            FREE(ObjUpvalue, object);
+            releaseObject(object);
             break;
         }
     }
 }
 
+static void freeBlockList(Block *block) {
+    while (block != NULL) {
+        Block *next = block->next;
+        freeBlock(block);
+        block = next;
+    }
+}
+
+Obj *nextObject(const Obj *object) {
+    int index = 0;
+    Block *block = NULL;
+    uint8_t *cell = NULL;
+    if (object != NULL) {
+        block = blockOf(object);
+        index = block->sizeClass;
+        cell = (uint8_t *) object + block->cellSize;
+    }
+    for (; index < SIZE_CLASSES; index++) {
+        if (block == NULL) {
+            block = sizeClasses[index].blocks;
+        }
+        for (; block != NULL; block = block->next, cell = NULL) {
+            if (cell == NULL) {
+                cell = firstCell(block);
+            }
+            for (; cell < block->top; cell += block->cellSize) {
+                if (!((Obj *) cell)->isFree) {
+                    return (Obj *) cell;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
 void freeObjects() {
-    Obj *object = vm.objects;
-    while (object != NULL) {
-        Obj *next = object->next;
+#ifdef CONCURRENT_GC
+    if (markerRunning) {
+        pauseMarker();
+        markerStopped = true;
+        resumeMarker();
+        joinMarker();
+    }
+    if (helperCount > 0) {
+        stopHelpers();
+    }
+    if (freerRunning) {
+        stopFreer();
+    }
+    free(dirty);
+    free(deferred);
+    free(dying);
+    free(queued);
+#endif
+    // what the objects own, then the blocks
+    for (Obj *object = nextObject(NULL); object != NULL; object = nextObject(object)) {
         freeObject(object);
-        object = next;
     }
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        freeBlockList(sizeClasses[i].blocks);
+    }
+    memset(sizeClasses, 0, sizeof(sizeClasses));
     free(vm.grayStack);
+    free(vm.remembered);
+    freeBlockList(freeBlocks);
+    nursery = NULL;
+    freeBlocks = NULL;
+    freeBlockCount = 0;
 }
@@ -13,19 +13,6 @@
 #define ALLOCATE_OBJ(type, objectType) \
         (type*) allocateObject(sizeof(type), objectType)
 
-
-static Obj *allocateObject(const size_t size, const ObjType type) {
-    Obj *object = (Obj *) reallocate(NULL, 0, size);
-    object->type = type;
-    object->isMarked = false;
-    object->next = vm.objects;
-    vm.objects = object;
-#ifdef DEBUG_LOG_GC
-    printf("%p allocate %zu for %s\n", (void *) object, size, translateType(type));
-#endif
-    return object;
-}
-
 ObjBoundMethod *newBoundMethod(const Value receiver, ObjClosure *method) {
     ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
@@ -37,6 +24,14 @@ ObjClass *newClass(ObjString *name) {
     ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
+    klass->version = 0;
+    klass->rootShape = NULL;
+    klass->initializer = NULL;
+    klass->instanceFields = 0;
+    push(OBJ_VAL(klass));
+    klass->rootShape = newShape(NULL, NULL);
+    writeBarrier((Obj *) klass);
+    pop();
     return klass;
 }
 
@@ -57,14 +52,37 @@ ObjFunction *newFunction() {
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+#ifdef JIT
+    function->calls = 0;
+    function->backEdges = 0;
+    function->jit = NULL;
+#endif
+#ifdef TRACE_JIT
+    function->traces = NULL;
+#endif
     initChunk(&function->chunk);
     return function;
 }
 
 ObjInstance *newInstance(ObjClass *klass) {
-    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    // room for as many fields as earlier instances of the class got, so they never spill
+    int capacity = INSTANCE_INLINE_FIELDS;
+    if (klass->instanceFields > capacity) {
+        capacity = klass->instanceFields < INSTANCE_INLINE_FIELDS_MAX
+                       ? klass->instanceFields
+                       : INSTANCE_INLINE_FIELDS_MAX;
+    }
+    ObjInstance *instance = (ObjInstance *) allocateObject(
+        sizeof(ObjInstance) + sizeof(Value) * capacity, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = klass->rootShape;
+    instance->fields = instance->inlineFields;
+    instance->fieldCapacity = capacity;
+    instance->inlineCapacity = capacity;
+    // jit code sets the shape before the value of an added field, the marker reads it between
+    for (int i = 0; i < capacity; i++) {
+        instance->inlineFields[i] = NIL_VAL;
+    }
     return instance;
 }
 
@@ -74,6 +92,84 @@ ObjNative *newNative(const NativeFn function) {
     return native;
 }
 
+ObjShape *newShape(ObjShape *parent, ObjString *name) {
+    ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    initTable(&shape->transitions);
+    return shape;
+}
+
+/**
+ * slot of the field `name`
+ * @return -1 if the shape has no such field
+ */
+int shapeSlot(const ObjShape *shape, const ObjString *name) {
+    for (; shape->name != NULL; shape = shape->parent) {
+        if (shape->name == name) {
+            return shape->fieldCount - 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * the shape reached from `shape` by adding the field `name`, shared by every
+ * instance that takes the same transition
+ */
+static ObjShape *addField(ObjShape *shape, ObjString *name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) {
+        return AS_SHAPE(next);
+    }
+    ObjShape *child = newShape(shape, name);
+    push(OBJ_VAL(child));
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    writeBarrier((Obj *) shape);
+    pop();
+    return child;
+}
+
+/**
+ * store a field, adding it if the instance has none with this name
+ * @return the slot of the field
+ */
+int setField(ObjInstance *instance, ObjString *name, const Value value) {
+    int slot = shapeSlot(instance->shape, name);
+    if (slot != -1) {
+        instance->fields[slot] = value;
+        writeBarrier((Obj *) instance);
+        return slot;
+    }
+    ObjShape *shape = addField(instance->shape, name);
+    slot = shape->fieldCount - 1;
+    // every shape of the class is created here first, so this sees its largest instance
+    if (shape->fieldCount > instance->klass->instanceFields) {
+        instance->klass->instanceFields = shape->fieldCount;
+    }
+    if (slot >= instance->fieldCapacity) {
+        const int capacity = GROW_CAPACITY(instance->fieldCapacity);
+        if (instance->fields == instance->inlineFields) {
+            Value *fields = ALLOCATE(Value, capacity);
+            memcpy(fields, instance->inlineFields, sizeof(Value) * instance->inlineCapacity);
+            instance->fields = fields;
+        } else {
+            instance->fields = GROW_ARRAY(Value, instance->fields, instance->fieldCapacity, capacity);
+        }
+        for (int i = instance->fieldCapacity; i < capacity; i++) {
+            instance->fields[i] = NIL_VAL;
+        }
+        instance->fieldCapacity = capacity;
+    }
+    instance->fields[slot] = value;
+    // the marker reads the fields up to the count of the shape, the array is grown first
+    PUBLISH(instance->shape, shape);
+    // after the fields are grown, the instance may be promoted while that allocates
+    writeBarrier((Obj *) instance);
+    return slot;
+}
+
 static ObjString *allocateString(char *chars, int length, uint32_t hash) {
     ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
     string->length = length;
@@ -152,6 +248,9 @@ void printObject(const Value value) {
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
+        case OBJ_SHAPE:
+            printf("shape(%d fields)", AS_SHAPE(value)->fieldCount);
+            break;
         case OBJ_STRING:
             printf("%s", AS_CSTRING(value));
             break;
@@ -39,7 +39,7 @@ static Entry *findEntry(Entry *entries, const int capacity, const ObjString *key
         } else if (entry->key == key) {
             return entry;
         }
-        index = key->hash & (capacity - 1);
+        index = (index + 1) & (capacity - 1);
     }
 }
 
@@ -63,7 +63,7 @@ static void adjustCapacity(Table *table, const int capacity) {
     // 释放旧的内存
     FREE_ARRAY(Entry, table->entries, table->capacity);
     table->entries = entries;
-    table->capacity = capacity;
+    PUBLISH(table->capacity, capacity);
 }
 
 bool tableGet(const Table *table, const ObjString *key, Value *value) {
@@ -139,8 +139,11 @@ void tableRemoveWhite(const Table *table) {
 }
 
 void markTable(const Table *table) {
-    for (int i = 0; i < table->capacity; ++i) {
-        const Entry *entry = &table->entries[i];
+    // the background marker may see the old, smaller array with the new capacity otherwise
+    const int capacity = ACQUIRE(table->capacity);
+    const Entry *entries = table->entries;
+    for (int i = 0; i < capacity; ++i) {
+        const Entry *entry = &entries[i];
         markObject((Obj *) entry->key);
         markValue(entry->value);
     }
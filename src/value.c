@@ -19,7 +19,7 @@ void writeValueArray(ValueArray *array, Value value) {
     }
 
     array->values[array->count] = value;
-    array->count++;
+    PUBLISH(array->count, array->count + 1);
 }
 
 void freeValueArray(ValueArray *array) {
@@ -37,6 +37,8 @@ void printValue(Value value) {
         printf("%g", AS_NUMBER(value));
     } else if (IS_OBJ(value)) {
         printObject(value);
+    } else if (IS_UNDEFINED(value)) {
+        printf("<undefined>");
     } else {
         printf("<unknown>");
     }
@@ -55,16 +57,27 @@ void printValue(Value value) {
         case VAL_OBJ:
             printObject(value);
             break;
+        case VAL_UNDEFINED:
+            printf("<undefined>");
+            break;
     }
 #endif
 }
 
+// bound methods are reused from vm.boundMethods or not, depending on what it held, so
+// two of them are equal when they bind the same method to the same receiver
+static bool boundMethodsEqual(const Value a, const Value b) {
+    return IS_BOUND_METHOD(a) && IS_BOUND_METHOD(b) &&
+           AS_OBJ(AS_BOUND_METHOD(a)->receiver) == AS_OBJ(AS_BOUND_METHOD(b)->receiver) &&
+           AS_BOUND_METHOD(a)->method == AS_BOUND_METHOD(b)->method;
+}
+
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    return a == b || boundMethodsEqual(a, b);
 #else
     if (a.type != b.type) return false;
     switch (a.type) {
@@ -74,7 +87,7 @@ bool valuesEqual(Value a, Value b) {
             return true;
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b) || boundMethodsEqual(a, b);
         default:
             return false;
     }
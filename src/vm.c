@@ -1,15 +1,24 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
 #include "vm.h"
 
+#ifdef STACK_GUARD
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 VM vm;
 
 static Value clockNative(int argCount, Value *args) {
@@ -21,9 +30,15 @@ static void resetStack() {
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
     vm.openUpvalues = NULL;
+#ifdef TRACE_JIT
+    traceAbort();
+#endif
 }
 
-static void runtimeError(const char *format, ...) {
+// deep recursion only prints the innermost and outermost frames of the trace
+#define TRACE_FRAMES 16
+
+void runtimeError(const char *format, ...) {
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
@@ -31,9 +46,15 @@ static void runtimeError(const char *format, ...) {
     fputs("\n", stderr);
     // 计算错误行
     for (int i = vm.frameCount - 1; i >= 0; i--) {
+        if (i == vm.frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+            fprintf(stderr, "... %d more frames\n", i + 1 - TRACE_FRAMES);
+            i = TRACE_FRAMES;
+            continue;
+        }
         const CallFrame *frame = &vm.frames[i];
         const ObjFunction *function = frame->closure->function;
-        const size_t instruction = frame->ip - function->chunk.code - 1;
+        // after a stack overflow the innermost frame may not have stored an ip past its start
+        const size_t instruction = frame->ip > function->chunk.code ? frame->ip - function->chunk.code - 1 : 0;
         fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
         if (function->name == NULL) {
             fprintf(stderr, "<script>\n");
@@ -48,37 +69,273 @@ static void runtimeError(const char *format, ...) {
 static void defineNative(const char *name, NativeFn function) {
     push(OBJ_VAL(copyString(name, strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    const int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
+    pop();
     pop();
+}
+
+/**
+ * slot of the global variable `name`. the first time a name is seen it gets a
+ * new slot, holding UNDEFINED_VAL until the variable is defined.
+ */
+int globalSlot(ObjString *name) {
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) {
+        return (int) AS_NUMBER(slot);
+    }
+    push(OBJ_VAL(name));
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    tableSet(&vm.globalSlots, name, NUMBER_VAL(vm.globalNames.count - 1));
     pop();
+    return vm.globalNames.count - 1;
+}
+
+#ifdef STACK_GUARD
+/**
+ * a stack reserved in full up front, inaccessible past `committed`. a write into the
+ * rest faults and the SIGSEGV handler commits more, so the stack grows without any
+ * check on push. it never moves, so call frames and open upvalues keep pointing into it.
+ * the last STACK_GUARD_SIZE bytes are never committed, a fault there is an overflow.
+ */
+typedef struct {
+    char *base;
+    size_t committed;
+    size_t size;
+} StackRegion;
+
+#define STACK_GUARD_SIZE (64 * 1024)
+#define STACK_INITIAL_SIZE (64 * 1024)
+
+static StackRegion valueStack;
+static StackRegion frameStack;
+// where interpret() reports an overflow
+static sigjmp_buf overflowJump;
+static volatile sig_atomic_t overflowJumpSet = 0;
+
+static void *reserveStack(StackRegion *region, const size_t size) {
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    region->size = (size + STACK_GUARD_SIZE + page - 1) / page * page;
+    region->base = mmap(NULL, region->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region->base == MAP_FAILED) {
+        fprintf(stderr, "Could not reserve the vm stacks.\n");
+        exit(1);
+    }
+    region->committed = STACK_INITIAL_SIZE;
+    if (mprotect(region->base, region->committed, PROT_READ | PROT_WRITE) != 0) {
+        fprintf(stderr, "Could not reserve the vm stacks.\n");
+        exit(1);
+    }
+    return region->base;
+}
+
+/**
+ * commit the pages of `region` up to `address`, at least doubling what is committed
+ * @return false if `address` lies in the guard pages
+ */
+static bool growStack(StackRegion *region, const char *address) {
+    const size_t limit = region->size - STACK_GUARD_SIZE;
+    size_t committed = region->committed * 2;
+    while (committed <= (size_t) (address - region->base)) {
+        committed *= 2;
+    }
+    if (committed > limit) {
+        committed = limit;
+    }
+    if ((size_t) (address - region->base) >= committed) {
+        return false;
+    }
+    if (mprotect(region->base + region->committed, committed - region->committed, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    region->committed = committed;
+    return true;
+}
+
+static void handleStackFault(const int signal, siginfo_t *info, void *context) {
+    (void) context;
+    const char *address = info->si_addr;
+    StackRegion *regions[] = {&valueStack, &frameStack};
+    for (int i = 0; i < 2; i++) {
+        StackRegion *region = regions[i];
+        if (address < region->base || address >= region->base + region->size) {
+            continue;
+        }
+        if (growStack(region, address)) {
+            // the faulting write is retried
+            return;
+        }
+        if (overflowJumpSet) {
+            siglongjmp(overflowJump, 1);
+        }
+    }
+    // not a stack access, crash as usual once the handler returns
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigaction(signal, &action, NULL);
 }
 
+static void initStacks() {
+    vm.stack = reserveStack(&valueStack, sizeof(Value) * STACK_MAX);
+    vm.frames = reserveStack(&frameStack, sizeof(CallFrame) * FRAMES_MAX);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handleStackFault;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, NULL);
+    // macOS reports the protection faults as SIGBUS
+    sigaction(SIGBUS, &action, NULL);
+}
+
+static void freeStacks() {
+    munmap(valueStack.base, valueStack.size);
+    munmap(frameStack.base, frameStack.size);
+}
+#else
+static void initStacks() {
+    vm.stack = malloc(sizeof(Value) * STACK_MAX);
+    vm.frames = malloc(sizeof(CallFrame) * FRAMES_MAX);
+    if (vm.stack == NULL || vm.frames == NULL) {
+        exit(1);
+    }
+}
+
+static void freeStacks() {
+    free(vm.stack);
+    free(vm.frames);
+}
+#endif
+
 void initVM() {
-    // vm.stackTop = vm.stack;
+    initStacks();
     resetStack();
-    vm.objects = NULL;
+    vm.remembered = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
     // init self adjust gc
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
+    vm.youngBytes = 0;
+    vm.gcPhase = GC_IDLE;
+    vm.gcSliceWork = GC_SLICE_WORK;
+    vm.gcConcurrent = false;
+    vm.gcThreads = 1;
+    vm.gcBackgroundFree = false;
     // init gray stack
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
     // init globals
-    initTable(&vm.globals);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
+    initTable(&vm.globalSlots);
     // init strings
     initTable(&vm.strings);
+    for (int i = 0; i < BOUND_METHODS_MAX; i++) {
+        vm.boundMethods[i] = NULL;
+    }
     // prevent GC error
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
+#ifdef JIT
+    vm.jit = false;
+#endif
+#ifdef TRACE_JIT
+    vm.recording = false;
+#endif
     defineNative("clock", clockNative);
 }
 
+#ifdef INLINE_CACHE_STATS
+static void printInlineCacheStats() {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    fprintf(stderr, "== inline caches ==\n");
+    for (const Obj *object = nextObject(NULL); object != NULL; object = nextObject(object)) {
+        if (object->type != OBJ_FUNCTION) {
+            continue;
+        }
+        const ObjFunction *function = (ObjFunction *) object;
+        const Chunk *chunk = &function->chunk;
+        for (int i = 0; i < chunk->cacheCount; i++) {
+            const InlineCache *cache = &chunk->caches[i];
+            if (cache->hits + cache->misses == 0) {
+                continue;
+            }
+            int shapes = 0;
+            while (shapes < INLINE_CACHE_WAYS && cache->entries[shapes].shape != NULL) {
+                shapes++;
+            }
+            const uint8_t instruction = chunk->code[cache->offset];
+            const ObjString *name = AS_STRING(chunk->constants.values[chunk->code[cache->offset + 1]]);
+            fprintf(stderr, "[line %d] in %s %s '%s': %llu hits, %llu misses, %d shapes\n",
+                    chunk->lines[cache->offset],
+                    function->name != NULL ? function->name->chars : "<script>",
+                    instruction == OP_GET_PROPERTY ? "get" : instruction == OP_SET_PROPERTY ? "set" : "invoke",
+                    name->chars, (unsigned long long) cache->hits, (unsigned long long) cache->misses, shapes);
+            hits += cache->hits;
+            misses += cache->misses;
+        }
+    }
+    fprintf(stderr, "total: %llu hits, %llu misses\n", (unsigned long long) hits, (unsigned long long) misses);
+}
+#endif
+
+#ifdef OPCODE_PROFILE
+// how often each run of two and three plain opcodes was executed, input of tools/superinstructions.py
+static uint64_t opcodePairs[PLAIN_OPCODE_COUNT][PLAIN_OPCODE_COUNT];
+static uint64_t opcodeTriples[PLAIN_OPCODE_COUNT][PLAIN_OPCODE_COUNT][PLAIN_OPCODE_COUNT];
+// the two opcodes executed before the current one, -1 until there are any
+static int previousOpcodes[2] = {-1, -1};
+
+static void profileInstruction(const uint8_t instruction) {
+    if (previousOpcodes[1] != -1) {
+        opcodePairs[previousOpcodes[1]][instruction]++;
+        if (previousOpcodes[0] != -1) {
+            opcodeTriples[previousOpcodes[0]][previousOpcodes[1]][instruction]++;
+        }
+    }
+    previousOpcodes[0] = previousOpcodes[1];
+    previousOpcodes[1] = instruction;
+}
+
+static void printOpcodeProfile() {
+    fprintf(stderr, "== opcode profile ==\n");
+    for (int a = 0; a < PLAIN_OPCODE_COUNT; a++) {
+        for (int b = 0; b < PLAIN_OPCODE_COUNT; b++) {
+            if (opcodePairs[a][b] > 0) {
+                fprintf(stderr, "pair %d %d %llu\n", a, b, (unsigned long long) opcodePairs[a][b]);
+            }
+            for (int c = 0; c < PLAIN_OPCODE_COUNT; c++) {
+                if (opcodeTriples[a][b][c] > 0) {
+                    fprintf(stderr, "triple %d %d %d %llu\n", a, b, c, (unsigned long long) opcodeTriples[a][b][c]);
+                }
+            }
+        }
+    }
+}
+#endif
+
 void freeVM() {
-    freeTable(&vm.globals);
+#ifdef INLINE_CACHE_STATS
+    printInlineCacheStats();
+#endif
+#ifdef OPCODE_PROFILE
+    printOpcodeProfile();
+#endif
+#ifdef GC_STATS
+    printGCStats();
+#endif
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
+    freeTable(&vm.globalSlots);
     freeTable(&vm.strings);
     vm.initString = NULL;
     freeObjects();
+    freeStacks();
 }
 
 void push(const Value value) {
@@ -100,16 +357,31 @@ static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
 
+// every call and tail call counts towards compiling the function at JIT_THRESHOLD
+static void countCall(ObjFunction *function) {
+#ifdef JIT
+    if (vm.jit && ++function->calls == JIT_THRESHOLD) {
+        jitCompile(function);
+    }
+#else
+    (void) function;
+#endif
+}
+
 static bool call(ObjClosure *closure, const int argCount) {
     if (argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d.",
                      closure->function->arity, argCount);
         return false;
     }
+#ifndef STACK_GUARD
+    // with STACK_GUARD the frame stack faults on its guard pages instead
     if (vm.frameCount == FRAMES_MAX) {
         runtimeError("Stack overflow.");
         return false;
     }
+#endif
+    countCall(closure->function);
     CallFrame *frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
@@ -117,7 +389,7 @@ static bool call(ObjClosure *closure, const int argCount) {
     return true;
 }
 
-static bool callValue(const Value callee, const int argCount) {
+bool callValue(const Value callee, const int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_BOUND_METHOD: {
@@ -130,9 +402,8 @@ static bool callValue(const Value callee, const int argCount) {
             case OBJ_CLASS: {
                 ObjClass *klass = AS_CLASS(callee);
                 vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
-                Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer)) {
-                    return call(AS_CLOSURE(initializer), argCount);
+                if (klass->initializer != NULL) {
+                    return call(klass->initializer, argCount);
                 } else if (argCount != 0) {
                     runtimeError("Expected 0 arguments but got %d", argCount);
                     return false;
@@ -156,7 +427,37 @@ static bool callValue(const Value callee, const int argCount) {
     return false;
 }
 
-static bool invokeFromClass(const ObjClass *klass, const ObjString *name, const int argCount) {
+/**
+ * call the callee below `argCount` arguments in place of the top frame, whose locals are dead.
+ * natives and classes are called as usual, the next OP_RETURN returns their result
+ */
+bool tailCall(const int argCount) {
+    const Value callee = vm.stackTop[-1 - argCount];
+    ObjClosure *closure;
+    if (IS_CLOSURE(callee)) {
+        closure = AS_CLOSURE(callee);
+    } else if (IS_BOUND_METHOD(callee)) {
+        closure = AS_BOUND_METHOD(callee)->method;
+        vm.stackTop[-1 - argCount] = AS_BOUND_METHOD(callee)->receiver;
+    } else {
+        return callValue(callee, argCount);
+    }
+    if (argCount != closure->function->arity) {
+        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+        return false;
+    }
+    countCall(closure->function);
+    // the callee and its arguments take the place of the caller's locals
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    closeUpvalues(frame->slots);
+    memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm.stackTop = frame->slots + argCount + 1;
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    return true;
+}
+
+bool invokeFromClass(const ObjClass *klass, const ObjString *name, const int argCount) {
     Value method;
     if (!tableGet(&klass->methods, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
@@ -165,35 +466,84 @@ static bool invokeFromClass(const ObjClass *klass, const ObjString *name, const
     return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(const ObjString *name, const int argCount) {
+/**
+ * remember where receivers of `shape` keep a property, reusing the shape's old
+ * entry, then the first free one. a full cache gives up its last entry so the
+ * shapes seen first stay cached.
+ * @param transition shape a store moves the receiver to, NULL if the field existed
+ * @param index slot of the field, -1 for a method
+ */
+void fillCacheEntry(InlineCache *cache, const ObjShape *shape, const ObjShape *transition,
+                    const ObjClass *klass, const int index, const Value method) {
+    InlineCacheEntry *entry = &cache->entries[INLINE_CACHE_WAYS - 1];
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+        if (cache->entries[i].shape == (Obj *) shape || cache->entries[i].shape == NULL) {
+            entry = &cache->entries[i];
+            break;
+        }
+    }
+    entry->shape = (Obj *) shape;
+    entry->transition = (Obj *) transition;
+    entry->version = klass->version;
+    entry->index = index;
+    entry->method = method;
+    // the cache belongs to the code of the running frame
+    writeBarrier((Obj *) vm.frames[vm.frameCount - 1].closure->function);
+}
+
+bool invoke(const ObjString *name, const int argCount, InlineCache *cache) {
     const Value receiver = peek(argCount);
     if (!IS_INSTANCE(receiver)) {
         runtimeError("Only instances have methods.");
         return false;
     }
     const ObjInstance *instance = AS_INSTANCE(receiver);
-    Value value;
-    if (tableGet(&instance->fields, name, &value)) {
+    const int slot = shapeSlot(instance->shape, name);
+    if (slot != -1) {
+        fillCacheEntry(cache, instance->shape, NULL, instance->klass, slot, NIL_VAL);
+        const Value value = instance->fields[slot];
         // replace the receiver
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
-    return invokeFromClass(instance->klass, name, argCount);
+    Value method;
+    if (!tableGet(&instance->klass->methods, name, &method)) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+    fillCacheEntry(cache, instance->shape, NULL, instance->klass, -1, method);
+    return call(AS_CLOSURE(method), argCount);
 }
 
-static bool bindMethod(const ObjClass *klass, const ObjString *name) {
+bool bindMethod(const ObjClass *klass, const ObjString *name) {
     Value method;
     if (!tableGet(&klass->methods, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
-    ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    ObjBoundMethod *bound = bindReceiver(peek(0), AS_CLOSURE(method));
     pop();
     push(OBJ_VAL(bound));
     return true;
 }
 
-static ObjUpvalue *captureUpvalue(Value *local) {
+/**
+ * the bound method of receiver and method, reused from vm.boundMethods when the pair was
+ * bound before. the receiver must be reachable, the allocation may collect garbage
+ */
+ObjBoundMethod *bindReceiver(const Value receiver, ObjClosure *method) {
+    const uintptr_t key = (uintptr_t) AS_OBJ(receiver) >> 4 ^ (uintptr_t) method >> 4;
+    ObjBoundMethod **cached = &vm.boundMethods[key & (BOUND_METHODS_MAX - 1)];
+    if (*cached != NULL && AS_OBJ((*cached)->receiver) == AS_OBJ(receiver) &&
+        (*cached)->method == method) {
+        return *cached;
+    }
+    ObjBoundMethod *bound = newBoundMethod(receiver, method);
+    *cached = bound;
+    return bound;
+}
+
+ObjUpvalue *captureUpvalue(Value *local) {
     ObjUpvalue *prevUpvalue = NULL;
     ObjUpvalue *upvalue = vm.openUpvalues;
     while (upvalue != NULL && upvalue->location > local) {
@@ -213,11 +563,12 @@ static ObjUpvalue *captureUpvalue(Value *local) {
     return createdUpvalue;
 }
 
-static void closeUpvalues(Value *last) {
+void closeUpvalues(Value *last) {
     while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
         ObjUpvalue *upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        writeBarrier((Obj *) upvalue);
         vm.openUpvalues = upvalue->next;
     }
 }
@@ -228,6 +579,11 @@ static void defineMethod(const ObjString *name) {
     // second value is the class obj.
     ObjClass *klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    if (name == vm.initString) {
+        klass->initializer = AS_CLOSURE(method);
+    }
+    writeBarrier((Obj *) klass);
+    klass->version++;
     pop();
 }
 
@@ -235,7 +591,7 @@ static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
+void concatenate() {
     const ObjString *b = AS_STRING(peek(0));
     const ObjString *a = AS_STRING(peek(1));
 
@@ -251,305 +607,874 @@ static void concatenate() {
 }
 
 static InterpretResult run() {
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
-#define READ_BYTE() (*frame->ip++)
+    // the hot state of the current frame lives in locals, so the compiler can keep
+    // it in registers. it is written back to the frame and `vm.stackTop` only before
+    // anything that may call out (calls, returns, allocation, errors).
+    CallFrame *frame;
+    uint8_t *ip;
+    Value *sp;
+    Value *slots;
+    Value *constants;
+    InlineCache *caches;
+
+#define STORE_FRAME()           \
+    do {                        \
+        frame->ip = ip;         \
+        vm.stackTop = sp;       \
+    } while (false)
+#define LOAD_FRAME()                                             \
+    do {                                                         \
+        frame = &vm.frames[vm.frameCount - 1];                   \
+        ip = frame->ip;                                          \
+        slots = frame->slots;                                    \
+        constants = frame->closure->function->chunk.constants.values; \
+        caches = frame->closure->function->chunk.caches;         \
+        sp = vm.stackTop;                                        \
+    } while (false)
+    // the helpers below use the vm stack, so spill around them
+#define SPILL(call)             \
+    do {                        \
+        STORE_FRAME();          \
+        call;                   \
+        sp = vm.stackTop;       \
+    } while (false)
+#define RUNTIME_ERROR(...)                   \
+    do {                                     \
+        STORE_FRAME();                       \
+        runtimeError(__VA_ARGS__);           \
+        return INTERPRET_RUNTIME_ERROR;      \
+    } while (false)
+    // a frame of a compiled function continues as native code. while a loop is recorded,
+    // every frame stays in the interpreter
+#ifdef TRACE_JIT
+#define NATIVE_FRAME() (frame->closure->function->jit != NULL && !vm.recording)
+#elif defined(JIT)
+#define NATIVE_FRAME() (frame->closure->function->jit != NULL)
+#endif
+    // load the frame on top after a call or return
+#ifdef JIT
+#define ENTER_FRAME()               \
+    do {                            \
+        LOAD_FRAME();               \
+        if (NATIVE_FRAME()) {       \
+            goto runNative;         \
+        }                           \
+    } while (false)
+#else
+#define ENTER_FRAME() LOAD_FRAME()
+#endif
+    // go on after a trace left, in the frame on top
+#define RESUME(status)                          \
+    do {                                        \
+        if ((status) == JIT_ERROR) {            \
+            return INTERPRET_RUNTIME_ERROR;     \
+        }                                       \
+        if ((status) == JIT_DONE) {             \
+            return INTERPRET_OK;                \
+        }                                       \
+        if ((status) == JIT_DEOPT) {            \
+            LOAD_FRAME();                       \
+            DISPATCH();                         \
+        }                                       \
+        ENTER_FRAME();                          \
+        DISPATCH();                             \
+    } while (false)
+
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+#define READ_BYTE() (*ip++)
 #define READ_SHORT() \
-    (frame->ip += 2, \
-    (uint16_t) ((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+    (ip += 2, \
+    (uint16_t) ((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&caches[READ_SHORT()])
+#ifdef INLINE_CACHE_STATS
+#define CACHE_HIT(cache) ((cache)->hits++)
+#define CACHE_MISS(cache) ((cache)->misses++)
+#else
+#define CACHE_HIT(cache) ((void) (cache))
+#define CACHE_MISS(cache) ((void) (cache))
+#endif
     // 弹出栈顶两个元素
     // 第一个弹出的是二元操作符右边的数，第二个弹出的是二元操作符左边的数
 #define BINARY_OP(valueType, op)                           \
     do                                                     \
     {                                                      \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)))  { \
-            runtimeError("Operands must be numbers.");     \
-            return INTERPRET_RUNTIME_ERROR;                \
-        }                                              \
-        double b = AS_NUMBER(pop());                       \
-        double a = AS_NUMBER(pop());                       \
-        push(valueType(a op b));                           \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))  { \
+            RUNTIME_ERROR("Operands must be numbers.");    \
+        }                                                  \
+        double b = AS_NUMBER(POP());                       \
+        double a = AS_NUMBER(PEEK(0));                     \
+        PEEK(0) = valueType(a op b);                       \
+    } while (false)
+
+// for the negated comparisons, see OP_GREATER_EQUAL
+#define NOT_BOOL_VAL(b) BOOL_VAL(!(b))
+
+// compare-and-branch: pop both operands and jump when `condition` on a, b is false.
+// the boolean is never pushed
+#define COMPARE_JUMP(condition)                            \
+    do                                                     \
+    {                                                      \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))  { \
+            RUNTIME_ERROR("Operands must be numbers.");    \
+        }                                                  \
+        const double b = AS_NUMBER(POP());                 \
+        const double a = AS_NUMBER(POP());                 \
+        const uint16_t offset = READ_SHORT();              \
+        if (!(condition)) {                                \
+            ip += offset;                                  \
+        }                                                  \
+    } while (false)
+
+    // bodies of the simple instructions, shared by their own handler and by the
+    // superinstructions that start with them. each one leaves ip on the next opcode.
+    // the generator (tools/superinstructions.py) only fuses opcodes that have one.
+#define EXEC_OP_CONSTANT() PUSH(READ_CONSTANT())
+#define EXEC_OP_NIL() PUSH(NIL_VAL)
+#define EXEC_OP_TRUE() PUSH(BOOL_VAL(true))
+#define EXEC_OP_FALSE() PUSH(BOOL_VAL(false))
+#define EXEC_OP_POP() (sp--)
+#define EXEC_OP_GET_LOCAL() PUSH(slots[READ_BYTE()])
+#define EXEC_OP_SET_LOCAL() (slots[READ_BYTE()] = PEEK(0))
+#define EXEC_OP_GET_GLOBAL_SLOT()                                                               \
+    do {                                                                                        \
+        const uint16_t slot = READ_SHORT();                                                     \
+        const Value value = vm.globalValues.values[slot];                                       \
+        if (IS_UNDEFINED(value)) {                                                              \
+            RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot])); \
+        }                                                                                       \
+        PUSH(value);                                                                            \
+    } while (false)
+#define EXEC_OP_SET_GLOBAL_SLOT()                                                               \
+    do {                                                                                        \
+        const uint16_t slot = READ_SHORT();                                                     \
+        if (IS_UNDEFINED(vm.globalValues.values[slot])) {                                       \
+            RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot])); \
+        }                                                                                       \
+        vm.globalValues.values[slot] = PEEK(0);                                                 \
+    } while (false)
+#define EXEC_OP_GET_UPVALUE() PUSH(*frame->closure->upvalues[READ_BYTE()]->location)
+#define EXEC_OP_SET_UPVALUE()                                         \
+    do {                                                              \
+        ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];  \
+        *upvalue->location = PEEK(0);                                 \
+        writeBarrier((Obj *) upvalue);                                \
+    } while (false)
+#define EXEC_OP_EQUAL()                               \
+    do {                                              \
+        const Value b = POP();                        \
+        PEEK(0) = BOOL_VAL(valuesEqual(PEEK(0), b));  \
+    } while (false)
+#define EXEC_OP_NOT_EQUAL()                           \
+    do {                                              \
+        const Value b = POP();                        \
+        PEEK(0) = BOOL_VAL(!valuesEqual(PEEK(0), b)); \
+    } while (false)
+#define EXEC_OP_GREATER() BINARY_OP(BOOL_VAL, >)
+    // a >= b is !(a < b) and a <= b is !(a > b), as they were compiled before
+    // these opcodes existed, so comparisons with NaN keep their result
+#define EXEC_OP_GREATER_EQUAL() BINARY_OP(NOT_BOOL_VAL, <)
+#define EXEC_OP_LESS() BINARY_OP(BOOL_VAL, <)
+#define EXEC_OP_LESS_EQUAL() BINARY_OP(NOT_BOOL_VAL, >)
+#define EXEC_OP_ADD()                                                     \
+    do {                                                                  \
+        if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {                   \
+            SPILL(concatenate());                                         \
+        } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {            \
+            const double b = AS_NUMBER(POP());                            \
+            const double a = AS_NUMBER(PEEK(0));                          \
+            PEEK(0) = NUMBER_VAL(a + b);                                  \
+        } else {                                                          \
+            RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+        }                                                                 \
+    } while (false)
+#define EXEC_OP_SUBTRACT() BINARY_OP(NUMBER_VAL, -)
+#define EXEC_OP_MULTIPLY() BINARY_OP(NUMBER_VAL, *)
+#define EXEC_OP_DIVIDE() BINARY_OP(NUMBER_VAL, /)
+#define EXEC_OP_NOT() (PEEK(0) = BOOL_VAL(isFalsey(PEEK(0))))
+#define EXEC_OP_NEGATE()                                \
+    do {                                                \
+        if (!IS_NUMBER(PEEK(0))) {                      \
+            RUNTIME_ERROR("Operand must be a number."); \
+        }                                               \
+        PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));      \
     } while (false)
 
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (const Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk,
-                               (int) (frame->ip - frame->closure->function->chunk.code));
+#define TRACE_EXECUTION()                                                        \
+    do {                                                                         \
+        printf("          ");                                                    \
+        for (const Value *slot = vm.stack; slot < sp; slot++) {                  \
+            printf("[ ");                                                        \
+            printValue(*slot);                                                   \
+            printf(" ]");                                                        \
+        }                                                                        \
+        printf("\n");                                                            \
+        disassembleInstruction(&frame->closure->function->chunk,                 \
+                               (int) (ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_EXECUTION() do { } while (false)
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                const Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NIL:
-                push(NIL_VAL);
-                break;
-            case OP_TRUE:
-                push(BOOL_VAL(true));
-                break;
-            case OP_FALSE:
-                push(BOOL_VAL(false));
-                break;
-            case OP_POP:
-                pop();
-                break;
-            case OP_SET_LOCAL: {
-                const uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+
+#ifdef OPCODE_PROFILE
+#define PROFILE_INSTRUCTION() profileInstruction(*ip)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
+
+    // quickening: a generic instruction that sees the operand types its fast form expects
+    // rewrites its own opcode byte, ip[-1], into that form. the profile counts plain
+    // opcodes only, so it runs without quickening.
+    // only the plain handlers quicken: a superinstruction runs the generic body of its
+    // components and keeps its own opcode byte
+#ifdef OPCODE_PROFILE
+#define QUICKEN(condition, quickened) do { } while (false)
+#else
+#define QUICKEN(condition, quickened) \
+    do {                              \
+        if (condition) {              \
+            ip[-1] = (quickened);     \
+        }                             \
+    } while (false)
+#endif
+#define NUMBER_OPERANDS() (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+    // the quickened form: check the types once more and fall back to the generic
+    // instruction, de-quickening the site, when they changed
+#define QUICK_NUMBER_OP(generic, valueType, op)       \
+    do {                                              \
+        if (!NUMBER_OPERANDS()) {                     \
+            ip[-1] = (generic);                       \
+            EXEC_##generic();                         \
+            DISPATCH();                               \
+        }                                             \
+        const double b = AS_NUMBER(POP());            \
+        PEEK(0) = valueType(AS_NUMBER(PEEK(0)) op b); \
+    } while (false)
+
+#ifdef COMPUTED_GOTO
+    // every handler jumps straight to the handler of the next instruction,
+    // so each opcode gets its own indirect branch for the predictor.
+    static void *dispatchTable[] = {
+        [OP_CONSTANT] = &&DO_OP_CONSTANT,
+        [OP_NIL] = &&DO_OP_NIL,
+        [OP_TRUE] = &&DO_OP_TRUE,
+        [OP_FALSE] = &&DO_OP_FALSE,
+        [OP_POP] = &&DO_OP_POP,
+        [OP_GET_LOCAL] = &&DO_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&DO_OP_SET_LOCAL,
+        [OP_GET_GLOBAL_SLOT] = &&DO_OP_GET_GLOBAL_SLOT,
+        [OP_DEFINE_GLOBAL_SLOT] = &&DO_OP_DEFINE_GLOBAL_SLOT,
+        [OP_SET_GLOBAL_SLOT] = &&DO_OP_SET_GLOBAL_SLOT,
+        [OP_GET_UPVALUE] = &&DO_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&DO_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY] = &&DO_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&DO_OP_SET_PROPERTY,
+        [OP_GET_SUPER] = &&DO_OP_GET_SUPER,
+        [OP_EQUAL] = &&DO_OP_EQUAL,
+        [OP_NOT_EQUAL] = &&DO_OP_NOT_EQUAL,
+        [OP_GREATER] = &&DO_OP_GREATER,
+        [OP_GREATER_EQUAL] = &&DO_OP_GREATER_EQUAL,
+        [OP_LESS] = &&DO_OP_LESS,
+        [OP_LESS_EQUAL] = &&DO_OP_LESS_EQUAL,
+        [OP_ADD] = &&DO_OP_ADD,
+        [OP_SUBTRACT] = &&DO_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&DO_OP_MULTIPLY,
+        [OP_DIVIDE] = &&DO_OP_DIVIDE,
+        [OP_NEGATE] = &&DO_OP_NEGATE,
+        [OP_NOT] = &&DO_OP_NOT,
+        [OP_PRINT] = &&DO_OP_PRINT,
+        [OP_JUMP] = &&DO_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&DO_OP_JUMP_IF_FALSE,
+        [OP_POP_JUMP_IF_FALSE] = &&DO_OP_POP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_NOT_EQUAL] = &&DO_OP_JUMP_IF_NOT_EQUAL,
+        [OP_JUMP_IF_EQUAL] = &&DO_OP_JUMP_IF_EQUAL,
+        [OP_JUMP_IF_NOT_GREATER] = &&DO_OP_JUMP_IF_NOT_GREATER,
+        [OP_JUMP_IF_NOT_GREATER_EQUAL] = &&DO_OP_JUMP_IF_NOT_GREATER_EQUAL,
+        [OP_JUMP_IF_NOT_LESS] = &&DO_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_NOT_LESS_EQUAL] = &&DO_OP_JUMP_IF_NOT_LESS_EQUAL,
+        [OP_LOOP] = &&DO_OP_LOOP,
+        [OP_CALL] = &&DO_OP_CALL,
+        [OP_TAIL_CALL] = &&DO_OP_TAIL_CALL,
+        [OP_INVOKE] = &&DO_OP_INVOKE,
+        [OP_SUPER_INVOKE] = &&DO_OP_SUPER_INVOKE,
+        [OP_CLOSURE] = &&DO_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&DO_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&DO_OP_RETURN,
+        [OP_CLASS] = &&DO_OP_CLASS,
+        [OP_METHOD] = &&DO_OP_METHOD,
+        [OP_INHERIT] = &&DO_OP_INHERIT,
+        [OP_ADD_NUMBER] = &&DO_OP_ADD_NUMBER,
+        [OP_ADD_STRING] = &&DO_OP_ADD_STRING,
+        [OP_SUBTRACT_NUMBER] = &&DO_OP_SUBTRACT_NUMBER,
+        [OP_MULTIPLY_NUMBER] = &&DO_OP_MULTIPLY_NUMBER,
+        [OP_DIVIDE_NUMBER] = &&DO_OP_DIVIDE_NUMBER,
+        [OP_GREATER_NUMBER] = &&DO_OP_GREATER_NUMBER,
+        [OP_LESS_NUMBER] = &&DO_OP_LESS_NUMBER,
+#define SUPERINSTRUCTION_LABEL(name, ...) [name] = &&DO_##name,
+        FOR_EACH_SUPERINSTRUCTION2(SUPERINSTRUCTION_LABEL)
+        FOR_EACH_SUPERINSTRUCTION3(SUPERINSTRUCTION_LABEL)
+#undef SUPERINSTRUCTION_LABEL
+    };
+#ifdef TRACE_JIT
+    // while a loop is recorded every opcode goes to DO_RECORD first
+    static void *recordTable[256] = {[0 ... 255] = &&DO_RECORD};
+    void **table = dispatchTable;
+#define DISPATCH_TABLE table
+#else
+#define DISPATCH_TABLE dispatchTable
+#endif
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(code) DO_##code:
+#define DISPATCH()                                \
+    do {                                          \
+        TRACE_EXECUTION();                        \
+        PROFILE_INSTRUCTION();                    \
+        goto *DISPATCH_TABLE[READ_BYTE()];        \
+    } while (false)
+    // the last component of a superinstruction is entered directly, without a dispatch
+#define SUPERINSTRUCTION_TAIL(code) \
+    do {                            \
+        ip++;                       \
+        goto DO_##code;             \
+    } while (false)
+#else
+#define INTERPRET_LOOP      \
+    loop:                   \
+    TRACE_EXECUTION();      \
+    PROFILE_INSTRUCTION();  \
+    switch (READ_BYTE())
+#define CASE(code) case code:
+#define DISPATCH() goto loop
+    // there are no labels to jump to, the last component is dispatched as usual
+#define SUPERINSTRUCTION_TAIL(code) DISPATCH()
+#endif
+
+    LOAD_FRAME();
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT)
+            EXEC_OP_CONSTANT();
+            DISPATCH();
+        CASE(OP_NIL)
+            EXEC_OP_NIL();
+            DISPATCH();
+        CASE(OP_TRUE)
+            EXEC_OP_TRUE();
+            DISPATCH();
+        CASE(OP_FALSE)
+            EXEC_OP_FALSE();
+            DISPATCH();
+        CASE(OP_POP)
+            EXEC_OP_POP();
+            DISPATCH();
+        CASE(OP_SET_LOCAL)
+            EXEC_OP_SET_LOCAL();
+            DISPATCH();
+        CASE(OP_GET_LOCAL)
+            EXEC_OP_GET_LOCAL();
+            DISPATCH();
+        CASE(OP_GET_GLOBAL_SLOT)
+            EXEC_OP_GET_GLOBAL_SLOT();
+            DISPATCH();
+        CASE(OP_DEFINE_GLOBAL_SLOT) {
+            const uint16_t slot = READ_SHORT();
+            vm.globalValues.values[slot] = POP();
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_SLOT)
+            EXEC_OP_SET_GLOBAL_SLOT();
+            DISPATCH();
+        CASE(OP_GET_UPVALUE)
+            EXEC_OP_GET_UPVALUE();
+            DISPATCH();
+        CASE(OP_SET_UPVALUE)
+            EXEC_OP_SET_UPVALUE();
+            DISPATCH();
+        CASE(OP_GET_PROPERTY) {
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+            if (!IS_INSTANCE(PEEK(0))) {
+                RUNTIME_ERROR("Only instances have properties.");
             }
-            case OP_GET_LOCAL: {
-                // 局部变量位于栈上
-                const uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
+            ObjInstance *instance = AS_INSTANCE(PEEK(0));
+            const InlineCacheEntry *entry = findCacheEntry(cache, instance->shape, instance->klass);
+            if (entry != NULL && entry->index >= 0) {
+                CACHE_HIT(cache);
+                PEEK(0) = instance->fields[entry->index];
+                DISPATCH();
             }
-            case OP_GET_GLOBAL: {
-                const ObjString *name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            Value method;
+            if (entry != NULL) {
+                CACHE_HIT(cache);
+                method = entry->method;
+            } else {
+                CACHE_MISS(cache);
+                const int slot = shapeSlot(instance->shape, name);
+                if (slot != -1) {
+                    fillCacheEntry(cache, instance->shape, NULL, instance->klass, slot, NIL_VAL);
+                    PEEK(0) = instance->fields[slot];
+                    DISPATCH();
                 }
-                push(value);
-                break;
-            }
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                if (!tableGet(&instance->klass->methods, name, &method)) {
+                    RUNTIME_ERROR("Undefined property '%s'.", name->chars);
                 }
-                break;
+                fillCacheEntry(cache, instance->shape, NULL, instance->klass, -1, method);
             }
-            case OP_GET_UPVALUE: {
-                const uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+            // the receiver stays on the stack while the bound method is allocated
+            ObjBoundMethod *bound;
+            SPILL(bound = bindReceiver(PEEK(0), AS_CLOSURE(method)));
+            PEEK(0) = OBJ_VAL(bound);
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY) {
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+            if (!IS_INSTANCE(PEEK(1))) {
+                RUNTIME_ERROR("Only instances have fields.");
             }
-            case OP_SET_UPVALUE: {
-                const uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+            ObjInstance *instance = AS_INSTANCE(PEEK(1));
+            const InlineCacheEntry *entry = findCacheEntry(cache, instance->shape, instance->klass);
+            if (entry != NULL && entry->transition == NULL) {
+                CACHE_HIT(cache);
+                instance->fields[entry->index] = PEEK(0);
+                writeBarrier((Obj *) instance);
+            } else if (entry != NULL && entry->index < instance->fieldCapacity) {
+                // adds the field, and there is room for it
+                CACHE_HIT(cache);
+                instance->fields[entry->index] = PEEK(0);
+                instance->shape = (ObjShape *) entry->transition;
+                writeBarrier((Obj *) instance);
+            } else {
+                CACHE_MISS(cache);
+                const ObjShape *shape = instance->shape;
+                int slot;
+                SPILL(slot = setField(instance, name, PEEK(0)));
+                fillCacheEntry(cache, shape, shape != instance->shape ? instance->shape : NULL,
+                               instance->klass, slot, NIL_VAL);
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                const ObjInstance *instance = AS_INSTANCE(peek(0));
-                const ObjString *name = READ_STRING();
-
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop();
-                    push(value);
-                    break;
-                }
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                runtimeError("Undefined property '%s'.", name->chars);
+            const Value value = POP();
+            PEEK(0) = value;
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER) {
+            const ObjString *name = READ_STRING();
+            const ObjClass *superclass = AS_CLASS(POP());
+            bool bound;
+            SPILL(bound = bindMethod(superclass, name));
+            if (!bound) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                const Value value = pop();
-                pop();
-                push(value);
-                break;
+            DISPATCH();
+        }
+        // 比较运算符：== != > >= < <=
+        CASE(OP_EQUAL)
+            EXEC_OP_EQUAL();
+            DISPATCH();
+        CASE(OP_NOT_EQUAL)
+            EXEC_OP_NOT_EQUAL();
+            DISPATCH();
+        CASE(OP_GREATER)
+            QUICKEN(NUMBER_OPERANDS(), OP_GREATER_NUMBER);
+            EXEC_OP_GREATER();
+            DISPATCH();
+        CASE(OP_GREATER_EQUAL)
+            EXEC_OP_GREATER_EQUAL();
+            DISPATCH();
+        CASE(OP_LESS)
+            QUICKEN(NUMBER_OPERANDS(), OP_LESS_NUMBER);
+            EXEC_OP_LESS();
+            DISPATCH();
+        CASE(OP_LESS_EQUAL)
+            EXEC_OP_LESS_EQUAL();
+            DISPATCH();
+        // 二元运算符：+ - * /
+        CASE(OP_ADD)
+            QUICKEN(NUMBER_OPERANDS(), OP_ADD_NUMBER);
+            QUICKEN(IS_STRING(PEEK(0)) && IS_STRING(PEEK(1)), OP_ADD_STRING);
+            EXEC_OP_ADD();
+            DISPATCH();
+        CASE(OP_SUBTRACT)
+            QUICKEN(NUMBER_OPERANDS(), OP_SUBTRACT_NUMBER);
+            EXEC_OP_SUBTRACT();
+            DISPATCH();
+        CASE(OP_MULTIPLY)
+            QUICKEN(NUMBER_OPERANDS(), OP_MULTIPLY_NUMBER);
+            EXEC_OP_MULTIPLY();
+            DISPATCH();
+        CASE(OP_DIVIDE)
+            QUICKEN(NUMBER_OPERANDS(), OP_DIVIDE_NUMBER);
+            EXEC_OP_DIVIDE();
+            DISPATCH();
+        CASE(OP_NOT)
+            EXEC_OP_NOT();
+            DISPATCH();
+        CASE(OP_NEGATE)
+            EXEC_OP_NEGATE();
+            DISPATCH();
+        // 类型特化后的指令
+        CASE(OP_ADD_NUMBER)
+            QUICK_NUMBER_OP(OP_ADD, NUMBER_VAL, +);
+            DISPATCH();
+        CASE(OP_ADD_STRING)
+            if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+                ip[-1] = OP_ADD;
+                EXEC_OP_ADD();
+                DISPATCH();
             }
-            case OP_GET_SUPER: {
-                const ObjString *name = READ_STRING();
-                const ObjClass *superclass = AS_CLASS(pop());
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            SPILL(concatenate());
+            DISPATCH();
+        CASE(OP_SUBTRACT_NUMBER)
+            QUICK_NUMBER_OP(OP_SUBTRACT, NUMBER_VAL, -);
+            DISPATCH();
+        CASE(OP_MULTIPLY_NUMBER)
+            QUICK_NUMBER_OP(OP_MULTIPLY, NUMBER_VAL, *);
+            DISPATCH();
+        CASE(OP_DIVIDE_NUMBER)
+            QUICK_NUMBER_OP(OP_DIVIDE, NUMBER_VAL, /);
+            DISPATCH();
+        CASE(OP_GREATER_NUMBER)
+            QUICK_NUMBER_OP(OP_GREATER, BOOL_VAL, >);
+            DISPATCH();
+        CASE(OP_LESS_NUMBER)
+            QUICK_NUMBER_OP(OP_LESS, BOOL_VAL, <);
+            DISPATCH();
+        CASE(OP_PRINT) {
+            printValue(POP());
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(OP_JUMP) {
+            const uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE) {
+            const uint16_t offset = READ_SHORT();
+            if (isFalsey(PEEK(0))) {
+                ip += offset;
             }
-            // 比较运算符：== > <
-            case OP_EQUAL: {
-                const Value b = pop();
-                const Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+            DISPATCH();
+        }
+        CASE(OP_POP_JUMP_IF_FALSE) {
+            const uint16_t offset = READ_SHORT();
+            if (isFalsey(POP())) {
+                ip += offset;
             }
-            case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
-                break;
-            case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
-                break;
-            // 二元运算符：+ - * /
-            case OP_ADD:
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    const double b = AS_NUMBER(pop());
-                    const double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
-                break;
-            case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
-                break;
-            case OP_DIVIDE:
-                BINARY_OP(NUMBER_VAL, /);
-                break;
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
-                break;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_EQUAL) {
+            const Value b = POP();
+            const Value a = POP();
+            const uint16_t offset = READ_SHORT();
+            if (!valuesEqual(a, b)) {
+                ip += offset;
             }
-            case OP_JUMP: {
-                const uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_EQUAL) {
+            const Value b = POP();
+            const Value a = POP();
+            const uint16_t offset = READ_SHORT();
+            if (valuesEqual(a, b)) {
+                ip += offset;
             }
-            case OP_JUMP_IF_FALSE: {
-                const uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) {
-                    frame->ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_GREATER)
+            COMPARE_JUMP(a > b);
+            DISPATCH();
+        CASE(OP_JUMP_IF_NOT_GREATER_EQUAL)
+            COMPARE_JUMP(!(a < b));
+            DISPATCH();
+        CASE(OP_JUMP_IF_NOT_LESS)
+            COMPARE_JUMP(a < b);
+            DISPATCH();
+        CASE(OP_JUMP_IF_NOT_LESS_EQUAL)
+            COMPARE_JUMP(!(a > b));
+            DISPATCH();
+        CASE(OP_LOOP) {
+            const uint16_t offset = READ_SHORT();
+            ip -= offset;
+#ifdef JIT
+            if (vm.jit) {
+                STORE_FRAME();
+                // on-stack replacement: a frame that keeps looping goes on in the compiled function
+                // from the loop header. slots and open upvalues stay where they are, native code
+                // uses the same frame and stack
+                ObjFunction *function = frame->closure->function;
+                if (function->jit == NULL && ++function->backEdges == OSR_THRESHOLD) {
+                    jitCompile(function);
                 }
-                break;
-            }
-            case OP_LOOP: {
-                const uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
-            }
-            case OP_CALL: {
-                const int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                if (NATIVE_FRAME()) {
+                    goto runNative;
                 }
-                // if the call succeeds, the frame has been update to the top of frame stack
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_INVOKE: {
-                const ObjString *method = READ_STRING();
-                const int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+#ifdef TRACE_JIT
+                const JitStatus status = traceLoop(frame);
+                if (status != JIT_NEXT) {
+                    RESUME(status);
                 }
-                // if the call succeeds, the frame has been update to the top of frame stack
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_SUPER_INVOKE: {
-                const ObjString *method = READ_STRING();
-                const int argCount = READ_BYTE();
-                const ObjClass *superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                if (vm.recording) {
+                    table = recordTable;
                 }
-                // if the call succeeds, the frame has been update to the top of frame stack
-                frame = &vm.frames[vm.frameCount - 1];
+#endif
             }
-            case OP_CLOSURE: {
-                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = newClosure(function);
-                push(OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    const uint8_t isLocal = READ_BYTE();
-                    const uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
+#endif
+            DISPATCH();
+        }
+        CASE(OP_CALL) {
+            const int argCount = READ_BYTE();
+            STORE_FRAME();
+            if (!callValue(PEEK(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            // if the call succeeds, the frame has been update to the top of frame stack
+            ENTER_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL) {
+            const int argCount = READ_BYTE();
+            STORE_FRAME();
+            if (!tailCall(argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE) {
+            const ObjString *name = READ_STRING();
+            const int argCount = READ_BYTE();
+            InlineCache *cache = READ_CACHE();
+            const Value receiver = PEEK(argCount);
+            if (IS_INSTANCE(receiver)) {
+                const ObjInstance *instance = AS_INSTANCE(receiver);
+                const InlineCacheEntry *entry = findCacheEntry(cache, instance->shape, instance->klass);
+                if (entry != NULL && entry->index < 0) {
+                    CACHE_HIT(cache);
+                    STORE_FRAME();
+                    if (!call(AS_CLOSURE(entry->method), argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
                     }
+                    ENTER_FRAME();
+                    DISPATCH();
+                }
+                if (entry != NULL) {
+                    CACHE_HIT(cache);
+                    // the callable field replaces the receiver
+                    const Value field = instance->fields[entry->index];
+                    PEEK(argCount) = field;
+                    STORE_FRAME();
+                    if (!callValue(field, argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    ENTER_FRAME();
+                    DISPATCH();
                 }
-                break;
             }
-            case OP_CLOSE_UPVALUE: {
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
+            CACHE_MISS(cache);
+            STORE_FRAME();
+            if (!invoke(name, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_RETURN: {
-                // Exit interpreter.
-                const Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
-                // Remove argument from stack.
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+            // if the call succeeds, the frame has been update to the top of frame stack
+            ENTER_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE) {
+            const ObjString *method = READ_STRING();
+            const int argCount = READ_BYTE();
+            const ObjClass *superclass = AS_CLASS(POP());
+            STORE_FRAME();
+            if (!invokeFromClass(superclass, method, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLASS:
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-            case OP_INHERIT: {
-                const Value superclass = peek(1);
-                if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+            // if the call succeeds, the frame has been update to the top of frame stack
+            ENTER_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE) {
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            ObjClosure *closure;
+            SPILL(closure = newClosure(function));
+            PUSH(OBJ_VAL(closure));
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                const uint8_t isLocal = READ_BYTE();
+                const uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    // the new closure is on the stack, so it survives the upvalue allocation
+                    SPILL(closure->upvalues[i] = captureUpvalue(slots + index));
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                ObjClass *subclass = AS_CLASS(peek(0));
-                // copy superclass all methods
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop();
-                break;
             }
-            case OP_METHOD:
-                defineMethod(READ_STRING());
-                break;
-            default:
-                break;
+            writeBarrier((Obj *) closure);
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE) {
+            closeUpvalues(sp - 1);
+            sp--;
+            DISPATCH();
+        }
+        CASE(OP_RETURN) {
+            // Exit interpreter.
+            const Value result = POP();
+            closeUpvalues(slots);
+            vm.frameCount--;
+            if (vm.frameCount == 0) {
+                vm.stackTop = sp - 1;
+                return INTERPRET_OK;
+            }
+            // Remove argument from stack.
+            vm.stackTop = slots;
+            push(result);
+            ENTER_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_CLASS) {
+            ObjString *name = READ_STRING();
+            ObjClass *klass;
+            SPILL(klass = newClass(name));
+            PUSH(OBJ_VAL(klass));
+            DISPATCH();
+        }
+        CASE(OP_INHERIT) {
+            const Value superclass = PEEK(1);
+            if (!IS_CLASS(superclass)) {
+                RUNTIME_ERROR("Superclass must be a class.");
+            }
+            ObjClass *subclass = AS_CLASS(PEEK(0));
+            // copy superclass all methods
+            SPILL(tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods));
+            // instances of the subclass get the superclass's fields too
+            subclass->initializer = AS_CLASS(superclass)->initializer;
+            subclass->instanceFields = AS_CLASS(superclass)->instanceFields;
+            subclass->version++;
+            writeBarrier((Obj *) subclass);
+            sp--;
+            DISPATCH();
+        }
+        CASE(OP_METHOD) {
+            const ObjString *name = READ_STRING();
+            SPILL(defineMethod(name));
+            DISPATCH();
+        }
+        // superinstructions run the leading components inline, skipping the opcode
+        // byte each following component still has, then finish with the last one
+#define SUPERINSTRUCTION2(name, first, second) \
+        CASE(name)                             \
+            EXEC_##first();                    \
+            SUPERINSTRUCTION_TAIL(second);
+#define SUPERINSTRUCTION3(name, first, second, third) \
+        CASE(name)                                    \
+            EXEC_##first();                           \
+            ip++;                                     \
+            EXEC_##second();                          \
+            SUPERINSTRUCTION_TAIL(third);
+        FOR_EACH_SUPERINSTRUCTION2(SUPERINSTRUCTION2)
+        FOR_EACH_SUPERINSTRUCTION3(SUPERINSTRUCTION3)
+#undef SUPERINSTRUCTION2
+#undef SUPERINSTRUCTION3
+    }
+
+    // only reached by the switch fallback on a byte that is not an opcode
+    RUNTIME_ERROR("Unknown opcode.");
+
+#ifdef JIT
+runNative:
+    // the native code runs until it leaves its frame, then whatever frame is on top
+    // goes on, as native code again if it was compiled
+    for (;;) {
+        const JitStatus status = jitRun(frame);
+        if (status == JIT_ERROR) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        if (status == JIT_DONE) {
+            return INTERPRET_OK;
+        }
+        LOAD_FRAME();
+        // a deoptimized frame runs the instruction at its ip in the interpreter
+        if (status == JIT_DEOPT || frame->closure->function->jit == NULL) {
+            DISPATCH();
         }
     }
+#endif
 
+#ifdef TRACE_JIT
+DO_RECORD:
+    // the recorder sees the instruction first, then the generic handler of its first
+    // component runs it, so it sees each component of a superinstruction on its own
+    ip--;
+    if (vm.recording) {
+        STORE_FRAME();
+        const JitStatus status = traceRecord(frame);
+        if (status != JIT_NEXT) {
+            RESUME(status);
+        }
+    }
+    if (!vm.recording) {
+        table = dispatchTable;
+        goto *dispatchTable[READ_BYTE()];
+    }
+    goto *dispatchTable[plainInstruction(READ_BYTE())];
+#endif
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef NATIVE_FRAME
+#undef ENTER_FRAME
+#undef RESUME
+#undef SPILL
+#undef RUNTIME_ERROR
+#undef PUSH
+#undef POP
+#undef PEEK
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef CACHE_HIT
+#undef CACHE_MISS
 #undef BINARY_OP
+#undef NOT_BOOL_VAL
+#undef COMPARE_JUMP
+#undef TRACE_EXECUTION
+#undef PROFILE_INSTRUCTION
+#undef SUPERINSTRUCTION_TAIL
+#undef QUICKEN
+#undef NUMBER_OPERANDS
+#undef QUICK_NUMBER_OP
+#undef EXEC_OP_CONSTANT
+#undef EXEC_OP_NIL
+#undef EXEC_OP_TRUE
+#undef EXEC_OP_FALSE
+#undef EXEC_OP_POP
+#undef EXEC_OP_GET_LOCAL
+#undef EXEC_OP_SET_LOCAL
+#undef EXEC_OP_GET_GLOBAL_SLOT
+#undef EXEC_OP_SET_GLOBAL_SLOT
+#undef EXEC_OP_GET_UPVALUE
+#undef EXEC_OP_SET_UPVALUE
+#undef EXEC_OP_EQUAL
+#undef EXEC_OP_NOT_EQUAL
+#undef EXEC_OP_GREATER
+#undef EXEC_OP_GREATER_EQUAL
+#undef EXEC_OP_LESS
+#undef EXEC_OP_LESS_EQUAL
+#undef EXEC_OP_ADD
+#undef EXEC_OP_SUBTRACT
+#undef EXEC_OP_MULTIPLY
+#undef EXEC_OP_DIVIDE
+#undef EXEC_OP_NOT
+#undef EXEC_OP_NEGATE
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+#undef DISPATCH_TABLE
 }
 
 InterpretResult interpret(const char *source) {
@@ -564,5 +1489,22 @@ InterpretResult interpret(const char *source) {
     push(OBJ_VAL(closure));
     call(closure, 0);
     printf("--------------------------------------------------------------------------------\n");
+#ifdef STACK_GUARD
+    if (sigsetjmp(overflowJump, 1) != 0) {
+        // a stack ran into its guard pages. a frame that faulted was counted already
+        overflowJumpSet = 0;
+        const int frames = (int) (frameStack.committed / sizeof(CallFrame));
+        if (vm.frameCount > frames) {
+            vm.frameCount = frames;
+        }
+        runtimeError("Stack overflow.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    overflowJumpSet = 1;
+    const InterpretResult result = run();
+    overflowJumpSet = 0;
+    return result;
+#else
     return run();
+#endif
 }
@@ -0,0 +1,50 @@
+#!/usr/bin/env bash
+# Build clox in release mode from the working tree and from an earlier revision, and run
+# examples/benchmark_alloc.lox with both, printing the best objects allocated per second.
+#
+# usage: tools/alloc_throughput.sh [runs] [revision] [clox-flags...]
+# The revision defaults to the one before the size class allocator, which bumped young
+# objects of any size from the nursery and kept every object on a list through Obj.next.
+set -euo pipefail
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BENCH_DIR="${ROOT}/_bench"
+RUNS="${1:-5}"
+REVISION="${2:-$(git -C "${ROOT}" log --diff-filter=A --format=%H -- examples/benchmark_alloc.lox | tail -n 1)~1}"
+shift 2 || shift $# || true
+FLAGS=("$@")
+SCRIPT="${ROOT}/examples/benchmark_alloc.lox"
+
+mkdir -p "${BENCH_DIR}"
+cmake -S "${ROOT}" -B "${BENCH_DIR}/build-alloc" -DCMAKE_BUILD_TYPE=Release > /dev/null
+cmake --build "${BENCH_DIR}/build-alloc" --target clox > /dev/null
+# every build directory writes its executable to build/build, so keep a copy
+cp "${ROOT}/build/build/clox" "${BENCH_DIR}/clox-alloc"
+
+# the earlier revision is built in a worktree of its own
+WORKTREE="${BENCH_DIR}/alloc-base"
+rm -rf "${WORKTREE}"
+git -C "${ROOT}" worktree prune
+git -C "${ROOT}" worktree add --detach "${WORKTREE}" "${REVISION}" > /dev/null 2>&1
+trap 'git -C "${ROOT}" worktree remove --force "${WORKTREE}"' EXIT
+cmake -S "${WORKTREE}" -B "${WORKTREE}/_build" -DCMAKE_BUILD_TYPE=Release > /dev/null
+cmake --build "${WORKTREE}/_build" --target clox > /dev/null
+cp "${WORKTREE}/build/build/clox" "${BENCH_DIR}/clox-alloc-base"
+
+best() {
+    local result=""
+    for ((i = 0; i < RUNS; i++)); do
+        rate=$("$1" "${FLAGS[@]}" "${SCRIPT}" | tail -n 1)
+        if [ -z "${result}" ] || awk "BEGIN { exit !(${rate} > ${result}) }"; then
+            result="${rate}"
+        fi
+    done
+    echo "${result}"
+}
+
+base=$(best "${BENCH_DIR}/clox-alloc-base")
+current=$(best "${BENCH_DIR}/clox-alloc")
+printf "%-12s%16s\n" "revision" "objects/s"
+printf "%-12s%16.0f\n" "$(git -C "${ROOT}" rev-parse --short "${REVISION}")" "${base}"
+printf "%-12s%16.0f\n" "current" "${current}"
+awk "BEGIN { printf \"speedup     %15.2fx\n\", ${current} / ${base} }"
@@ -0,0 +1,57 @@
+#!/usr/bin/env bash
+# Build clox in release mode once per dispatch mode and time the example scripts,
+# interpreted and with the jit.
+#
+# usage: tools/benchmark.sh [runs] [script...]
+# The binaries are kept in _bench/ so later runs can be compared by hand.
+set -euo pipefail
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BENCH_DIR="${ROOT}/_bench"
+RUNS="${1:-3}"
+shift || true
+SCRIPTS=("$@")
+if [ ${#SCRIPTS[@]} -eq 0 ]; then
+    SCRIPTS=("${ROOT}/examples/benchmark.lox" "${ROOT}/examples/benchmark_gc.lox")
+fi
+
+# name:cmake-options:clox-flags, one binary is built for each
+VARIANTS=(
+    "switch:-DCLOX_COMPUTED_GOTO=OFF:"
+    "goto:-DCLOX_COMPUTED_GOTO=ON:"
+    "jit:-DCLOX_COMPUTED_GOTO=ON:--jit"
+)
+
+mkdir -p "${BENCH_DIR}"
+for variant in "${VARIANTS[@]}"; do
+    name="${variant%%:*}"
+    options="${variant#*:}"
+    options="${options%%:*}"
+    cmake -S "${ROOT}" -B "${BENCH_DIR}/build-${name}" -DCMAKE_BUILD_TYPE=Release ${options} > /dev/null
+    cmake --build "${BENCH_DIR}/build-${name}" --target clox > /dev/null
+    # every build directory writes its executable to build/build, so keep a copy
+    cp "${ROOT}/build/build/clox" "${BENCH_DIR}/clox-${name}"
+done
+
+TIMEFORMAT="%R"
+printf "%-24s" "script"
+for variant in "${VARIANTS[@]}"; do
+    printf "%12s" "${variant%%:*}"
+done
+printf "\n"
+for script in "${SCRIPTS[@]}"; do
+    printf "%-24s" "$(basename "${script}")"
+    for variant in "${VARIANTS[@]}"; do
+        name="${variant%%:*}"
+        flags="${variant##*:}"
+        best=""
+        for ((i = 0; i < RUNS; i++)); do
+            seconds=$( { time "${BENCH_DIR}/clox-${name}" ${flags} "${script}" > /dev/null; } 2>&1 )
+            if [ -z "${best}" ] || awk "BEGIN { exit !(${seconds} < ${best}) }"; then
+                best="${seconds}"
+            fi
+        done
+        printf "%11ss" "${best}"
+    done
+    printf "\n"
+done
@@ -0,0 +1,44 @@
+#!/usr/bin/env bash
+# Build clox in release mode with CLOX_GC_STATS and run a script with a growing number
+# of marking threads, printing the run time, the marking time of the major collections
+# and the longest collection pause reported at exit.
+#
+# usage: tools/gc_scaling.sh [runs] [script] [clox-flags...]
+# The major collections stop the world (--gc-slice 0) unless other flags are given.
+set -euo pipefail
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BENCH_DIR="${ROOT}/_bench"
+RUNS="${1:-3}"
+SCRIPT="${2:-${ROOT}/examples/benchmark_mark.lox}"
+shift 2 || shift $# || true
+FLAGS=("$@")
+if [ ${#FLAGS[@]} -eq 0 ]; then
+    FLAGS=(--gc-slice 0)
+fi
+THREADS=(1 2 4 8 16)
+
+mkdir -p "${BENCH_DIR}"
+cmake -S "${ROOT}" -B "${BENCH_DIR}/build-gcstats" -DCMAKE_BUILD_TYPE=Release -DCLOX_GC_STATS=ON > /dev/null
+cmake --build "${BENCH_DIR}/build-gcstats" --target clox > /dev/null
+# every build directory writes its executable to build/build, so keep a copy
+cp "${ROOT}/build/build/clox" "${BENCH_DIR}/clox-gcstats"
+
+TIMEFORMAT="%R"
+printf "%-10s%12s%12s%14s%14s\n" "threads" "run" "marking" "majors" "pause"
+for threads in "${THREADS[@]}"; do
+    best=""
+    for ((i = 0; i < RUNS; i++)); do
+        # the stats line is the last one on stderr, the time is printed after it
+        output=$( { time "${BENCH_DIR}/clox-gcstats" "${FLAGS[@]}" --gc-threads "${threads}" "${SCRIPT}" > /dev/null; } 2>&1 )
+        seconds=$(echo "${output}" | tail -n 1)
+        stats=$(echo "${output}" | grep "major collections")
+        if [ -z "${best}" ] || awk "BEGIN { exit !(${seconds} < ${best}) }"; then
+            best="${seconds}"
+            majors=$(echo "${stats}" | awk '{ print $1 }')
+            marking=$(echo "${stats}" | awk '{ print $4 }')
+            pause=$(echo "${stats}" | awk '{ print $8 }')
+        fi
+    done
+    printf "%-10s%11ss%12s%14s%14s\n" "${threads}" "${best}" "${marking}" "${majors}" "${pause}"
+done
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""Pick superinstructions from an opcode profile and generate include/superinstructions.h.
+
+usage: tools/superinstructions.py [--count N] [script...]
+
+Builds clox with CLOX_OPCODE_PROFILE into _superinst/, runs the scripts (examples/*.lox by
+default) and counts how often each run of two and three plain opcodes executes. The runs that
+save the most dispatches over all scripts become superinstructions, so long running workloads
+weigh more than short tests.
+
+Only opcodes with an EXEC_<opcode>() body in src/vm.c can lead a run; the last component may be
+any opcode, the vm enters its handler directly. Rebuild clox after regenerating the header.
+"""
+import argparse
+import glob
+import os
+import re
+import shutil
+import subprocess
+import sys
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = os.path.join(ROOT, "_superinst")
+HEADER = os.path.join(ROOT, "include", "superinstructions.h")
+
+
+def plain_opcodes():
+    """opcode names in enum order, up to the superinstructions"""
+    with open(os.path.join(ROOT, "include", "chunk.h")) as f:
+        source = f.read()
+    body = source[source.index("typedef enum {"):source.index("} OPCode;")]
+    return re.findall(r"^\s*(OP_\w+),", body, re.MULTILINE)
+
+
+def fusible_opcodes():
+    """opcodes that have an inline body in run()"""
+    with open(os.path.join(ROOT, "src", "vm.c")) as f:
+        return set(re.findall(r"#define EXEC_(OP_\w+)\(\)", f.read()))
+
+
+def run_quietly(command):
+    result = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                            universal_newlines=True)
+    if result.returncode != 0:
+        sys.stderr.write(result.stdout)
+        sys.exit("failed: " + " ".join(command))
+
+
+def build_profiler():
+    run_quietly(["cmake", "-S", ROOT, "-B", os.path.join(BUILD_DIR, "build"),
+                 "-DCMAKE_BUILD_TYPE=Release", "-DCLOX_OPCODE_PROFILE=ON"])
+    run_quietly(["cmake", "--build", os.path.join(BUILD_DIR, "build"), "--target", "clox"])
+    # every build directory writes its executable to build/build, so keep a copy
+    binary = os.path.join(BUILD_DIR, "clox-profile")
+    shutil.copy(os.path.join(ROOT, "build", "build", "clox"), binary)
+    return binary
+
+
+def profile(binary, script, names):
+    """runs of opcode names -> how often the script executed them"""
+    result = subprocess.run([binary, script], stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                            universal_newlines=True)
+    counts = {}
+    for line in result.stderr.splitlines():
+        fields = line.split()
+        if fields and fields[0] in ("pair", "triple"):
+            counts[tuple(names[int(code)] for code in fields[1:-1])] = int(fields[-1])
+    return counts
+
+
+def superinstruction_name(run):
+    return "OP_" + "__".join(opcode[len("OP_"):] for opcode in run)
+
+
+def write_header(selected, scripts):
+    pairs = [run for run in selected if len(run) == 2]
+    triples = [run for run in selected if len(run) == 3]
+    lines = [
+        "// generated by tools/superinstructions.py, do not edit by hand.",
+        "// profile: " + ", ".join(os.path.relpath(script, ROOT) for script in scripts),
+        "#ifndef clox_superinstructions_h",
+        "#define clox_superinstructions_h",
+        "",
+        "// X(name, first, second)",
+        "#define FOR_EACH_SUPERINSTRUCTION2(X)" + (" \\" if pairs else ""),
+    ]
+    for i, run in enumerate(pairs):
+        end = " \\" if i < len(pairs) - 1 else ""
+        lines.append("    X(%s, %s)%s" % (superinstruction_name(run), ", ".join(run), end))
+    lines += ["", "// X(name, first, second, third)",
+              "#define FOR_EACH_SUPERINSTRUCTION3(X)" + (" \\" if triples else "")]
+    for i, run in enumerate(triples):
+        end = " \\" if i < len(triples) - 1 else ""
+        lines.append("    X(%s, %s)%s" % (superinstruction_name(run), ", ".join(run), end))
+    lines += ["", "#endif", ""]
+    with open(HEADER, "w") as f:
+        f.write("\n".join(lines))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--count", type=int, default=12, help="number of superinstructions")
+    parser.add_argument("scripts", nargs="*")
+    args = parser.parse_args()
+    scripts = [os.path.abspath(script) for script in args.scripts] or \
+        sorted(glob.glob(os.path.join(ROOT, "examples", "*.lox")))
+
+    names = plain_opcodes()
+    fusible = fusible_opcodes()
+    binary = build_profiler()
+
+    # dispatches saved: a run of n opcodes saves n - 1 each time
+    scores = {}
+    for script in scripts:
+        for run, count in profile(binary, script, names).items():
+            if all(opcode in fusible for opcode in run[:-1]):
+                scores[run] = scores.get(run, 0) + count * (len(run) - 1)
+    ranked = sorted(scores, key=lambda run: (-scores[run], run))
+    selected = ranked[:args.count]
+    for run in selected:
+        print("%-50s %d" % (superinstruction_name(run), scores[run]))
+    write_header(sorted(selected), scripts)
+    print("wrote %s, rebuild clox to use it" % os.path.relpath(HEADER, ROOT), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()